@@ -0,0 +1,729 @@
+////////////////////////////////////////////////////////////////////////
+// Headless test harness for MSX Megaroms built with the megalinker
+//
+// Runs a ROM on an emulated Z80 with the 8KB mapper assumed by
+// crt0.megalinker.s, and reports cycles and mapper writes.
+//
+// FLAGS: -std=c++17 -O2
+
+#include "libmegalinker.h"
+
+#include <fstream>
+#include <cstdio>
+
+// Z80 core. Instructions are executed atomically, and step() returns the T-states of each one.
+struct Z80 {
+
+	enum { FC=0x01, FN=0x02, FP=0x04, FX=0x08, FH=0x10, FY=0x20, FZ=0x40, FS=0x80 };
+
+	std::function<uint8_t(uint16_t)> read;
+	std::function<void(uint16_t, uint8_t)> write;
+	std::function<uint8_t(uint16_t)> in;
+	std::function<void(uint16_t, uint8_t)> out;
+
+	// B, C, D, E, H, L, F, A: the same order used by the opcodes, with F in the place of (HL).
+	uint8_t r8[8] = {0,0,0,0,0,0,0xFF,0xFF};
+	enum { B=0, C=1, D=2, E=3, H=4, L=5, F=6, A=7 };
+	uint16_t AF_=0, BC_=0, DE_=0, HL_=0;
+	uint16_t IX=0xFFFF, IY=0xFFFF, SP=0xFFFF, PC=0;
+	uint8_t I=0, R=0;
+	bool IFF1=false, IFF2=false, halted=false, eiDelay=false;
+	int IM=1;
+
+	uint8_t sz53[256], sz53p[256];
+
+	Z80() {
+		for (int i=0; i<256; i++) {
+			sz53[i] = (i & (FS|FY|FX)) | (i==0 ? FZ : 0);
+			int p = 0;
+			for (int j=0; j<8; j++) p ^= (i>>j)&1;
+			sz53p[i] = sz53[i] | (p ? 0 : FP);
+		}
+	}
+
+	uint16_t pair(int hi, int lo) const { return (r8[hi]<<8) | r8[lo]; }
+	void setPair(int hi, int lo, uint16_t v) { r8[hi] = v>>8; r8[lo] = v & 0xFF; }
+
+	uint16_t HL() const { return pair(H,L); }
+	uint16_t BC() const { return pair(B,C); }
+	uint16_t DE() const { return pair(D,E); }
+	uint16_t AF() const { return pair(A,F); }
+
+	void incR() { R = (R & 0x80) | ((R+1) & 0x7F); }
+	uint8_t fetch() { return read(PC++); }
+	uint16_t fetch16() { uint16_t lo = fetch(); return lo | (fetch()<<8); }
+	uint16_t read16(uint16_t addr) { return read(addr) | (read(addr+1)<<8); }
+	void write16(uint16_t addr, uint16_t v) { write(addr, v & 0xFF); write(addr+1, v>>8); }
+	void push(uint16_t v) { SP -= 2; write16(SP, v); }
+	uint16_t pop() { uint16_t v = read16(SP); SP += 2; return v; }
+
+	bool condition(int cc) const {
+		switch (cc) {
+			case 0: return not (r8[F] & FZ);
+			case 1: return r8[F] & FZ;
+			case 2: return not (r8[F] & FC);
+			case 3: return r8[F] & FC;
+			case 4: return not (r8[F] & FP);
+			case 5: return r8[F] & FP;
+			case 6: return not (r8[F] & FS);
+			default: return r8[F] & FS;
+		}
+	}
+
+	// 16 bit register pairs: BC, DE, HL (or IX/IY), SP. With af, the last one is AF.
+	uint16_t &index(int prefix) { return prefix==0xDD ? IX : IY; }
+	uint16_t getRP(int p, int prefix, bool af=false) {
+		if (p==0) return BC();
+		if (p==1) return DE();
+		if (p==2) return prefix ? index(prefix) : HL();
+		return af ? AF() : SP;
+	}
+	void setRP(int p, int prefix, uint16_t v, bool af=false) {
+		if (p==0) return setPair(B,C,v);
+		if (p==1) return setPair(D,E,v);
+		if (p==2) { if (prefix) index(prefix) = v; else setPair(H,L,v); return; }
+		if (af) setPair(A,F,v); else SP = v;
+	}
+
+	// 8 bit registers, with H and L replaced by the halves of IX/IY when prefixed.
+	uint8_t getR(int idx, int prefix) {
+		if (prefix and idx==H) return index(prefix) >> 8;
+		if (prefix and idx==L) return index(prefix) & 0xFF;
+		return r8[idx];
+	}
+	void setR(int idx, int prefix, uint8_t v) {
+		if (prefix and idx==H) { index(prefix) = (index(prefix) & 0x00FF) | (v<<8); return; }
+		if (prefix and idx==L) { index(prefix) = (index(prefix) & 0xFF00) | v; return; }
+		r8[idx] = v;
+	}
+
+	void alu(int op, uint8_t v) {
+		uint8_t a = r8[A];
+		uint32_t res;
+		switch (op) {
+			case 0: case 1: // ADD, ADC
+				res = a + v + (op==1 and (r8[F] & FC) ? 1 : 0);
+				r8[F] = sz53[res & 0xFF] | ((a^v^res) & FH) | (((a^~v) & (a^res) & 0x80) ? FP : 0) | (res > 0xFF ? FC : 0);
+				r8[A] = res;
+				break;
+			case 2: case 3: case 7: // SUB, SBC, CP
+				res = a - v - (op==3 and (r8[F] & FC) ? 1 : 0);
+				r8[F] = (sz53[res & 0xFF] & ~(FY|FX)) | ((op==7 ? v : res) & (FY|FX)) | ((a^v^res) & FH) | (((a^v) & (a^res) & 0x80) ? FP : 0) | FN | ((res & 0x100) ? FC : 0);
+				if (op != 7) r8[A] = res;
+				break;
+			case 4: r8[A] &= v; r8[F] = sz53p[r8[A]] | FH; break;
+			case 5: r8[A] ^= v; r8[F] = sz53p[r8[A]]; break;
+			default: r8[A] |= v; r8[F] = sz53p[r8[A]]; break;
+		}
+	}
+
+	uint8_t inc8(uint8_t v) {
+		uint8_t res = v+1;
+		r8[F] = (r8[F] & FC) | sz53[res] | ((v & 0x0F)==0x0F ? FH : 0) | (v==0x7F ? FP : 0);
+		return res;
+	}
+
+	uint8_t dec8(uint8_t v) {
+		uint8_t res = v-1;
+		r8[F] = (r8[F] & FC) | FN | sz53[res] | ((v & 0x0F)==0 ? FH : 0) | (v==0x80 ? FP : 0);
+		return res;
+	}
+
+	uint16_t add16(uint16_t a, uint16_t v) {
+		uint32_t res = a + v;
+		r8[F] = (r8[F] & (FS|FZ|FP)) | ((res>>8) & (FY|FX)) | (((a^v^res)>>8) & FH) | (res > 0xFFFF ? FC : 0);
+		return res;
+	}
+
+	uint16_t adc16(uint16_t a, uint16_t v) {
+		uint32_t res = a + v + (r8[F] & FC);
+		r8[F] = ((res>>8) & (FS|FY|FX)) | ((res & 0xFFFF)==0 ? FZ : 0) | (((a^v^res)>>8) & FH) | (((a^~v) & (a^res) & 0x8000) ? FP : 0) | (res > 0xFFFF ? FC : 0);
+		return res;
+	}
+
+	uint16_t sbc16(uint16_t a, uint16_t v) {
+		uint32_t res = a - v - (r8[F] & FC);
+		r8[F] = ((res>>8) & (FS|FY|FX)) | ((res & 0xFFFF)==0 ? FZ : 0) | (((a^v^res)>>8) & FH) | (((a^v) & (a^res) & 0x8000) ? FP : 0) | FN | ((res & 0x10000) ? FC : 0);
+		return res;
+	}
+
+	// CB rotations and shifts: RLC, RRC, RL, RR, SLA, SRA, SLL, SRL.
+	uint8_t rot(int op, uint8_t v) {
+		uint8_t res, carry;
+		switch (op) {
+			case 0: carry = v>>7; res = (v<<1) | carry; break;
+			case 1: carry = v&1; res = (v>>1) | (carry<<7); break;
+			case 2: carry = v>>7; res = (v<<1) | (r8[F] & FC); break;
+			case 3: carry = v&1; res = (v>>1) | ((r8[F] & FC)<<7); break;
+			case 4: carry = v>>7; res = v<<1; break;
+			case 5: carry = v&1; res = (v>>1) | (v & 0x80); break;
+			case 6: carry = v>>7; res = (v<<1) | 1; break;
+			default: carry = v&1; res = v>>1; break;
+		}
+		r8[F] = sz53p[res] | carry;
+		return res;
+	}
+
+	void bit(int b, uint8_t v) {
+		r8[F] = (r8[F] & FC) | FH | (v & (FY|FX));
+		if (v & (1<<b)) r8[F] |= (b==7 ? FS : 0);
+		else r8[F] |= FZ | FP;
+	}
+
+	void daa() {
+		uint8_t a = r8[A], correction = 0;
+		bool carry = r8[F] & FC, halfCarry;
+		if ((r8[F] & FH) or (a & 0x0F) > 9) correction |= 0x06;
+		if (carry or a > 0x99) { correction |= 0x60; carry = true; }
+		if (r8[F] & FN) {
+			halfCarry = (r8[F] & FH) and (a & 0x0F) < 6;
+			a -= correction;
+		} else {
+			halfCarry = (a & 0x0F) > 9;
+			a += correction;
+		}
+		r8[F] = (r8[F] & FN) | sz53p[a] | (halfCarry ? FH : 0) | (carry ? FC : 0);
+		r8[A] = a;
+	}
+
+	int interrupt() {
+		if (not IFF1 or eiDelay) return 0;
+		halted = false;
+		IFF1 = IFF2 = false;
+		incR();
+		if (IM==2) {
+			push(PC);
+			PC = read16((I<<8) | 0xFF);
+			return 19;
+		}
+		push(PC);
+		PC = 0x0038;
+		return 13;
+	}
+
+	int step() {
+
+		eiDelay = false;
+		incR();
+		if (halted) return 4;
+
+		uint8_t op = fetch();
+		if (op==0xCB) return stepCB(0, 0);
+		if (op==0xED) return stepED();
+		if (op==0xDD or op==0xFD) {
+			uint8_t next = read(PC);
+			// Repeated prefixes behave as a NOP
+			if (next==0xDD or next==0xFD or next==0xED) return 4;
+			incR();
+			PC++;
+			if (next==0xCB) {
+				uint16_t addr = index(op) + int8_t(fetch());
+				return stepCB(op, addr);
+			}
+			return 4 + stepMain(next, op);
+		}
+		return stepMain(op, 0);
+	}
+
+	int stepMain(uint8_t op, int prefix) {
+
+		int x = op>>6, y = (op>>3)&7, z = op&7, p = y>>1, q = y&1;
+
+		// Address of the (HL) operand: HL, or IX/IY plus a displacement when prefixed.
+		int extra = 0;
+		auto memAddr = [&]() -> uint16_t {
+			if (not prefix) return HL();
+			extra = 8;
+			return index(prefix) + int8_t(fetch());
+		};
+
+		switch (x) {
+		case 0:
+			switch (z) {
+			case 0:
+				if (y==0) return 4;
+				if (y==1) { uint16_t t = AF(); setPair(A,F,AF_); AF_ = t; return 4; }
+				if (y==2) { int8_t d = fetch(); if (--r8[B]) { PC += d; return 13; } return 8; }
+				{
+					int8_t d = fetch();
+					if (y==3 or condition(y-4)) { PC += d; return 12; }
+					return 7;
+				}
+			case 1:
+				if (q==0) { setRP(p, prefix, fetch16()); return 10; }
+				setRP(2, prefix, add16(getRP(2, prefix), getRP(p, prefix)));
+				return 11;
+			case 2:
+				switch (y) {
+					case 0: write(BC(), r8[A]); return 7;
+					case 1: r8[A] = read(BC()); return 7;
+					case 2: write(DE(), r8[A]); return 7;
+					case 3: r8[A] = read(DE()); return 7;
+					case 4: write16(fetch16(), getRP(2, prefix)); return 16;
+					case 5: setRP(2, prefix, read16(fetch16())); return 16;
+					case 6: write(fetch16(), r8[A]); return 13;
+					default: r8[A] = read(fetch16()); return 13;
+				}
+			case 3:
+				setRP(p, prefix, getRP(p, prefix) + (q ? -1 : 1));
+				return 6;
+			case 4: case 5:
+				if (y==6) {
+					uint16_t addr = memAddr();
+					write(addr, z==4 ? inc8(read(addr)) : dec8(read(addr)));
+					return 11 + extra;
+				}
+				setR(y, prefix, z==4 ? inc8(getR(y, prefix)) : dec8(getR(y, prefix)));
+				return 4;
+			case 6:
+				if (y==6) {
+					uint16_t addr = memAddr();
+					write(addr, fetch());
+					return 10 + (extra ? 5 : 0);
+				}
+				setR(y, prefix, fetch());
+				return 7;
+			default:
+				switch (y) {
+					case 0: r8[A] = (r8[A]<<1) | (r8[A]>>7); r8[F] = (r8[F] & (FS|FZ|FP)) | (r8[A] & (FY|FX|FC)); break;
+					case 1: r8[F] = (r8[F] & (FS|FZ|FP)) | (r8[A] & FC); r8[A] = (r8[A]>>1) | (r8[A]<<7); r8[F] |= r8[A] & (FY|FX); break;
+					case 2: { uint8_t c = r8[A]>>7; r8[A] = (r8[A]<<1) | (r8[F] & FC); r8[F] = (r8[F] & (FS|FZ|FP)) | (r8[A] & (FY|FX)) | c; break; }
+					case 3: { uint8_t c = r8[A]&1; r8[A] = (r8[A]>>1) | ((r8[F] & FC)<<7); r8[F] = (r8[F] & (FS|FZ|FP)) | (r8[A] & (FY|FX)) | c; break; }
+					case 4: daa(); break;
+					case 5: r8[A] = ~r8[A]; r8[F] = (r8[F] & (FS|FZ|FP|FC)) | FH | FN | (r8[A] & (FY|FX)); break;
+					case 6: r8[F] = (r8[F] & (FS|FZ|FP)) | FC | (r8[A] & (FY|FX)); break;
+					default: r8[F] = (r8[F] & (FS|FZ|FP)) | ((r8[F] & FC) ? FH : FC) | (r8[A] & (FY|FX)); break;
+				}
+				return 4;
+			}
+
+		case 1:
+			if (y==6 and z==6) { halted = true; return 4; }
+			if (y==6) { uint16_t addr = memAddr(); write(addr, r8[z]); return 7 + extra; }
+			if (z==6) { uint16_t addr = memAddr(); r8[y] = read(addr); return 7 + extra; }
+			setR(y, prefix, getR(z, prefix));
+			return 4;
+
+		case 2:
+			if (z==6) { uint16_t addr = memAddr(); alu(y, read(addr)); return 7 + extra; }
+			alu(y, getR(z, prefix));
+			return 4;
+
+		default:
+			switch (z) {
+			case 0:
+				if (condition(y)) { PC = pop(); return 11; }
+				return 5;
+			case 1:
+				if (q==0) { setRP(p, prefix, pop(), true); return 10; }
+				if (p==0) { PC = pop(); return 10; }
+				if (p==1) {
+					uint16_t t;
+					t = BC(); setPair(B,C,BC_); BC_ = t;
+					t = DE(); setPair(D,E,DE_); DE_ = t;
+					t = HL(); setPair(H,L,HL_); HL_ = t;
+					return 4;
+				}
+				if (p==2) { PC = getRP(2, prefix); return 4; }
+				SP = getRP(2, prefix);
+				return 6;
+			case 2: {
+				uint16_t nn = fetch16();
+				if (condition(y)) PC = nn;
+				return 10;
+			}
+			case 3:
+				switch (y) {
+					case 0: PC = fetch16(); return 10;
+					case 2: out((r8[A]<<8) | fetch(), r8[A]); return 11;
+					case 3: r8[A] = in((r8[A]<<8) | fetch()); return 11;
+					case 4: { uint16_t t = read16(SP); write16(SP, getRP(2, prefix)); setRP(2, prefix, t); return 19; }
+					case 5: { uint16_t t = DE(); setPair(D,E,HL()); setPair(H,L,t); return 4; }
+					case 6: IFF1 = IFF2 = false; return 4;
+					case 7: IFF1 = IFF2 = true; eiDelay = true; return 4;
+					default: return 4; // CB is handled by step()
+				}
+			case 4: {
+				uint16_t nn = fetch16();
+				if (condition(y)) { push(PC); PC = nn; return 17; }
+				return 10;
+			}
+			case 5:
+				if (q==0) { push(getRP(p, prefix, true)); return 11; }
+				if (p==0) { uint16_t nn = fetch16(); push(PC); PC = nn; return 17; }
+				return 4; // DD, ED and FD are handled by step()
+			case 6:
+				alu(y, fetch());
+				return 7;
+			default:
+				push(PC);
+				PC = y*8;
+				return 11;
+			}
+		}
+	}
+
+	int stepCB(int prefix, uint16_t addr) {
+
+		uint8_t op = fetch();
+		if (not prefix) incR();
+		int x = op>>6, y = (op>>3)&7, z = op&7;
+
+		if (prefix or z==6) {
+			if (not prefix) addr = HL();
+			uint8_t v = read(addr);
+			if (x==1) { bit(y, v); return prefix ? 20 : 12; }
+			if (x==0) v = rot(y, v);
+			if (x==2) v &= ~(1<<y);
+			if (x==3) v |= (1<<y);
+			write(addr, v);
+			// Undocumented: the result is also copied to a register
+			if (prefix and z!=6) r8[z] = v;
+			return prefix ? 23 : 15;
+		}
+
+		if (x==0) r8[z] = rot(y, r8[z]);
+		if (x==1) bit(y, r8[z]);
+		if (x==2) r8[z] &= ~(1<<y);
+		if (x==3) r8[z] |= (1<<y);
+		return 8;
+	}
+
+	int stepED() {
+
+		uint8_t op = fetch();
+		incR();
+		int x = op>>6, y = (op>>3)&7, z = op&7, p = y>>1, q = y&1;
+
+		if (x==1) {
+			switch (z) {
+			case 0: {
+				uint8_t v = in(BC());
+				if (y!=6) r8[y] = v;
+				r8[F] = (r8[F] & FC) | sz53p[v];
+				return 12;
+			}
+			case 1: out(BC(), y==6 ? 0 : r8[y]); return 12;
+			case 2:
+				setPair(H,L, q ? adc16(HL(), getRP(p, 0)) : sbc16(HL(), getRP(p, 0)));
+				return 15;
+			case 3: {
+				uint16_t nn = fetch16();
+				if (q) setRP(p, 0, read16(nn)); else write16(nn, getRP(p, 0));
+				return 20;
+			}
+			case 4: { uint8_t a = r8[A]; r8[A] = 0; alu(2, a); return 8; }
+			case 5: PC = pop(); IFF1 = IFF2; return 14;
+			case 6: IM = (y & 3)==2 ? 1 : (y & 3)==3 ? 2 : 0; return 8;
+			default:
+				switch (y) {
+					case 0: I = r8[A]; return 9;
+					case 1: R = r8[A]; return 9;
+					case 2: r8[A] = I; r8[F] = (r8[F] & FC) | sz53[r8[A]] | (IFF2 ? FP : 0); return 9;
+					case 3: r8[A] = R; r8[F] = (r8[F] & FC) | sz53[r8[A]] | (IFF2 ? FP : 0); return 9;
+					case 4: {
+						uint8_t v = read(HL());
+						write(HL(), (r8[A]<<4) | (v>>4));
+						r8[A] = (r8[A] & 0xF0) | (v & 0x0F);
+						r8[F] = (r8[F] & FC) | sz53p[r8[A]];
+						return 18;
+					}
+					case 5: {
+						uint8_t v = read(HL());
+						write(HL(), (v<<4) | (r8[A] & 0x0F));
+						r8[A] = (r8[A] & 0xF0) | (v>>4);
+						r8[F] = (r8[F] & FC) | sz53p[r8[A]];
+						return 18;
+					}
+					default: return 8;
+				}
+			}
+		}
+
+		if (x==2 and z<=3 and y>=4) {
+
+			int dir = (y & 1) ? -1 : 1;
+			bool repeat = y >= 6;
+
+			if (z==0) { // LDI, LDD, LDIR, LDDR
+				uint8_t v = read(HL());
+				write(DE(), v);
+				setPair(H,L,HL()+dir);
+				setPair(D,E,DE()+dir);
+				setPair(B,C,BC()-1);
+				uint8_t n = v + r8[A];
+				r8[F] = (r8[F] & (FS|FZ|FC)) | (BC() ? FP : 0) | (n & FX) | ((n & 0x02) ? FY : 0);
+				if (repeat and BC()) { PC -= 2; return 21; }
+				return 16;
+			}
+
+			if (z==1) { // CPI, CPD, CPIR, CPDR
+				uint8_t v = read(HL());
+				uint8_t res = r8[A] - v;
+				setPair(H,L,HL()+dir);
+				setPair(B,C,BC()-1);
+				uint8_t hf = (r8[A]^v^res) & FH;
+				uint8_t n = res - (hf ? 1 : 0);
+				r8[F] = (r8[F] & FC) | FN | (res & FS) | (res==0 ? FZ : 0) | hf | (BC() ? FP : 0) | (n & FX) | ((n & 0x02) ? FY : 0);
+				if (repeat and BC() and res) { PC -= 2; return 21; }
+				return 16;
+			}
+
+			if (z==2) { // INI, IND, INIR, INDR
+				write(HL(), in(BC()));
+				setPair(H,L,HL()+dir);
+			} else { // OUTI, OUTD, OTIR, OTDR
+				uint8_t v = read(HL());
+				r8[B]--;
+				out(BC(), v);
+				r8[B]++;
+				setPair(H,L,HL()+dir);
+			}
+			r8[B]--;
+			r8[F] = (r8[F] & FC) | FN | sz53[r8[B]];
+			if (repeat and r8[B]) { PC -= 2; return 21; }
+			return 16;
+		}
+
+		return 8;
+	}
+};
+
+// MSX with 16KB of RAM in page 3, and a Konami-style 8KB mapper in pages 1 and 2.
+// The BIOS is a stub: every entry point returns, but the ones required by the crt and the interrupt hook.
+struct Machine {
+
+	std::vector<uint8_t> rom, ram, bios;
+	uint32_t segment[4] = {0,1,2,3};
+	uint64_t mapperWrites[4] = {0,0,0,0};
+	std::string output;
+
+	Machine(std::vector<uint8_t> rom) : rom(rom), ram(0x4000, 0x00), bios(0x4000, 0xC9) {
+
+		if (this->rom.empty()) this->rom.resize(0x2000, 0xFF);
+
+		// RSLREG: primary slot register reads as 0
+		bios[0x0138] = 0xAF; bios[0x0139] = 0xC9;
+
+		// Interrupt handler: calls the H.TIMI hook
+		const uint8_t isr[] = { 0xF5, 0xC5, 0xD5, 0xE5, 0xCD, 0x9F, 0xFD, 0xE1, 0xD1, 0xC1, 0xF1, 0xFB, 0xC9 };
+		std::copy(std::begin(isr), std::end(isr), bios.begin() + 0x0038);
+
+		// HIMEM, and all system hooks return
+		ram[0xFC4A - 0xC000] = 0x80;
+		ram[0xFC4B - 0xC000] = 0xF3;
+		std::fill(ram.begin() + (0xFD9A - 0xC000), ram.begin() + (0xFFCA - 0xC000), 0xC9);
+	}
+
+	uint8_t read(uint16_t addr) {
+		if (addr < 0x4000) return bios[addr];
+		if (addr >= 0xC000) return ram[addr - 0xC000];
+		uint32_t page = (addr - 0x4000) >> 13;
+		return rom[(segment[page] * 0x2000 + (addr & 0x1FFF)) % rom.size()];
+	}
+
+	void write(uint16_t addr, uint8_t v) {
+		if (addr >= 0xC000) { ram[addr - 0xC000] = v; return; }
+		if (addr < 0x4000) return;
+		// Mapper registers: 0x5000, 0x7000, 0x9000 and 0xB000 (and their mirrors up to 0x7FF bytes after)
+		if ((addr & 0x1800) == 0x1000) {
+			uint32_t page = (addr - 0x4000) >> 13;
+			segment[page] = v;
+			mapperWrites[page]++;
+		}
+	}
+};
+
+// Symbols from a ROM_FILE.symbols.map: name -> (address, segment, page). Page -1 is non banked.
+struct SymbolInfo { uint32_t addr, segment; int page; };
+
+std::multimap<std::string, SymbolInfo> readSymbolsMap(const std::string &filename) {
+
+	std::multimap<std::string, SymbolInfo> symbols;
+	std::ifstream isf(filename);
+	if (not isf) throw std::runtime_error("Could not open symbols map: " + filename);
+
+	std::string line;
+	while (std::getline(isf, line)) {
+
+		std::vector<std::string> fields;
+		std::istringstream isl(line);
+		std::string field;
+		while (std::getline(isl, field, '#')) fields.push_back(field);
+		if (fields.size() < 10) continue;
+
+		SymbolInfo info;
+		if (sscanf(fields[1].c_str(), "%x", &info.segment) != 1) continue;
+		if (sscanf(fields[2].c_str(), "%x", &info.addr) != 1) continue;
+
+		for (int col=5; col<10; col++) {
+			std::istringstream isn(fields[col]);
+			std::string name;
+			if (not (isn >> name)) continue;
+			info.page = col==5 ? -1 : col-6;
+			symbols.emplace(name, info);
+		}
+	}
+	return symbols;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[]) {
+
+	Log::reportLevel(10);
+
+	std::string romName, breakpoint;
+	uint64_t maxCycles = 100000000;
+	std::vector<std::pair<uint32_t, uint32_t>> dumps;
+
+	try {
+
+		for (int i=1; i<argc; i++) {
+
+			std::string arg = argv[i];
+
+			if (arg == "-l" or arg == "--log") {
+
+				if (i==argc-1) throw std::runtime_error("Log level required but not specified");
+				int level;
+				if (sscanf(argv[++i], "%i", &level) != 1) throw std::runtime_error("Unrecognized level" + arg);
+				Log::reportLevel(level);
+
+			} else if (arg == "-b" or arg == "--break") {
+
+				if (i==argc-1) throw std::runtime_error("Breakpoint symbol required but not specified");
+				breakpoint = argv[++i];
+
+			} else if (arg == "-c" or arg == "--cycles") {
+
+				if (i==argc-1) throw std::runtime_error("Maximum cycles required but not specified");
+				maxCycles = std::stoull(argv[++i], nullptr, 0);
+
+			} else if (arg == "-d" or arg == "--dump") {
+
+				uint32_t addr, size;
+				if (i==argc-1 or sscanf(argv[++i], "%x:%x", &addr, &size) != 2) throw std::runtime_error("Dump requires ADDR:SIZE in hexadecimal");
+				dumps.emplace_back(addr, size);
+
+			} else if (arg == "-h" or arg == "--help") {
+
+				std::cout << "Megalinker harness: runs a megarom on a headless Z80 and mapper" << std::endl;
+				std::cout << "Usage: megalinker-harness [OPTION] ROM_FILE" << std::endl;
+				std::cout << "  Option: -b SYMBOL stops when SYMBOL is executed (address taken from ROM_FILE.symbols.map)" << std::endl;
+				std::cout << "  Option: -c N stops after N cycles (default is 100000000)" << std::endl;
+				std::cout << "  Option: -d ADDR:SIZE dumps SIZE bytes of memory from ADDR (hexadecimal) when stopping" << std::endl;
+				std::cout << "  Option: -l N sets the debug level to N (default is 3)" << std::endl;
+				std::cout << "  Option: -h prints this help message" << std::endl;
+				std::cout << "Returns 0 if the breakpoint is reached (or the program halts, if no breakpoint is given)." << std::endl;
+				return 1;
+
+			} else if (arg[0] == '-') {
+
+				throw std::runtime_error("Unknown flag " + arg);
+
+			} else {
+
+				romName = arg;
+			}
+		}
+
+		if (romName.empty()) throw std::runtime_error("ROM file required but not specified");
+
+		std::vector<uint8_t> rom;
+		{
+			std::ifstream isf(romName, std::ios::binary);
+			if (not isf) throw std::runtime_error("Could not open ROM: " + romName);
+			rom.assign(std::istreambuf_iterator<char>(isf), std::istreambuf_iterator<char>());
+		}
+
+		std::vector<SymbolInfo> stops;
+		if (not breakpoint.empty()) {
+			auto symbols = readSymbolsMap(romName + ".symbols.map");
+			// The symbols map truncates names to 20 characters
+			auto range = symbols.equal_range(breakpoint.substr(0,20));
+			for (auto it = range.first; it != range.second; it++) stops.push_back(it->second);
+			if (stops.empty()) throw std::runtime_error("Breakpoint symbol not found: " + breakpoint);
+		}
+
+		Machine msx(rom);
+		Z80 cpu;
+		cpu.read = [&](uint16_t addr) { return msx.read(addr); };
+		cpu.write = [&](uint16_t addr, uint8_t v) { msx.write(addr, v); };
+		cpu.in = [](uint16_t) -> uint8_t { return 0xFF; };
+		cpu.out = [](uint16_t, uint8_t) {};
+		cpu.SP = 0xF380;
+		cpu.PC = msx.read(0x4002) | (msx.read(0x4003)<<8);
+
+		// 3.58MHz, 60Hz
+		const uint64_t frameCycles = 59736;
+		uint64_t cycles = 0, instructions = 0, nextFrame = frameCycles;
+		bool interruptPending = false;
+		std::string reason = "cycle limit reached";
+		bool success = false;
+
+		while (cycles < maxCycles) {
+
+			bool stop = false;
+			for (auto &s : stops)
+				if (cpu.PC == s.addr and (s.page < 0 or msx.segment[s.page] == s.segment))
+					stop = true;
+			if (stop) {
+				reason = "breakpoint " + breakpoint + " reached";
+				success = true;
+				break;
+			}
+
+			// CHPUT and CHGET are emulated on the console
+			if (cpu.PC == 0x00A2) msx.output += char(cpu.r8[Z80::A]);
+			if (cpu.PC == 0x009F) cpu.r8[Z80::A] = 13;
+
+			if (cpu.halted and not cpu.IFF1) {
+				reason = "halted with interrupts disabled";
+				success = breakpoint.empty();
+				break;
+			}
+
+			cycles += cpu.step();
+			instructions++;
+
+			// The VDP keeps the frame interrupt asserted until the CPU accepts it
+			if (cycles >= nextFrame) {
+				nextFrame += frameCycles;
+				interruptPending = true;
+			}
+			if (interruptPending) {
+				int accepted = cpu.interrupt();
+				cycles += accepted;
+				interruptPending = accepted == 0;
+			}
+		}
+
+		std::cout << "Stopped: " << reason << std::endl;
+		std::cout << "PC: 0x" << std::hex << cpu.PC << std::dec << std::endl;
+		std::cout << "Cycles: " << cycles << std::endl;
+		std::cout << "Instructions: " << instructions << std::endl;
+		std::cout << "Frames: " << cycles / frameCycles << std::endl;
+		std::cout << "Mapper writes: " << (msx.mapperWrites[0] + msx.mapperWrites[1] + msx.mapperWrites[2] + msx.mapperWrites[3]);
+		std::cout << " (A: " << msx.mapperWrites[0] << ", B: " << msx.mapperWrites[1] << ", C: " << msx.mapperWrites[2] << ", D: " << msx.mapperWrites[3] << ")" << std::endl;
+		if (not msx.output.empty())
+			std::cout << "Output: " << msx.output << std::endl;
+
+		for (auto &d : dumps) {
+			for (uint32_t i=0; i<d.second; i++) {
+				char s[16];
+				if (i%16==0) { snprintf(s,15,"%04X:", (d.first+i) & 0xFFFF); std::cout << s; }
+				snprintf(s,15," %02X", msx.read(d.first+i));
+				std::cout << s;
+				if (i%16==15 or i+1==d.second) std::cout << std::endl;
+			}
+		}
+
+		return success ? 0 : 1;
+
+	} catch (std::exception &e) {
+
+		Log(5) << e.what();
+		return -1;
+	}
+}
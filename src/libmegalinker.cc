@@ -0,0 +1,3708 @@
+////////////////////////////////////////////////////////////////////////
+// Linker for MSX Megaroms
+//
+// Manuel Martinez (salutte@gmail.com)
+//
+// FLAGS: -std=c++17 -O0
+
+#include "libmegalinker.h"
+
+#include <fstream>
+#include <tuple>
+#include <algorithm>
+#include <regex>
+
+struct AR { //ASSERT READ;
+	
+	std::string expected;
+	AR(std::string expected) : expected(expected) {}
+	
+	friend std::istream & operator>>(std::istream &is, const AR& ar) {
+		std::string read;
+		is >> read;
+		if (read != ar.expected) 
+			throw std::runtime_error("Read: " + read + ", expected: " + ar.expected);
+		return is;
+	}
+};
+
+struct HEX { //READ HEXADECIMAL VALUE
+	
+	enum FORMAT {
+		
+		PLAIN, TWO_NIBBLES
+	};
+	
+	struct HEX2DEC : std::vector<int> {
+		HEX2DEC() {
+			resize(256,0);
+			for (int i='0'; i<='9'; i++)
+				at(i) = i-'0';
+				
+			for (int i='A'; i<='F'; i++)
+				at(i) = 10+ i-'A';
+
+			for (int i='a'; i<='f'; i++)
+				at(i) = 10+ i-'a';
+		}
+	};
+	
+	static uint32_t Hex2Dec(int v) {
+		static HEX2DEC HD;
+		return HD[v];
+	}
+	
+	uint32_t &value;
+	FORMAT format;
+	
+	HEX(uint32_t &value, FORMAT format) : value(value), format(format) {}
+	
+	friend std::istream &operator>>(std::istream &is, HEX&& hex) {
+		
+		hex.value = 0;
+		
+		if (hex.format==TWO_NIBBLES) {
+			
+			std::string s;
+			if (not (is >> s)) return is;
+			if (s.size()!=2) throw std::runtime_error("Not an hex byte");
+			
+			hex.value += Hex2Dec(s[0])<<4;
+			hex.value += Hex2Dec(s[1])<<0;
+
+		} else if (hex.format==PLAIN) {
+			
+			std::string s;
+			if (not (is >> s)) throw std::runtime_error("Could not read expected value");
+
+			for (auto &c : s)
+				hex.value = hex.value * 16 + Hex2Dec(c);
+		}
+		return is;
+	}
+};
+
+struct HEX2 : public HEX { HEX2(uint32_t &value) : HEX(value, HEX::TWO_NIBBLES) {} };
+
+// preprocessModule makes a 1st pass scan through the REL file of a module.
+// It determines the module name, its symbols, and its areas.
+void preprocessModule(Module &module) {
+
+	std::set<std::string> known_areas = { 
+		"_HEADER0",     // Fixed to segment 0, contains megarom initialization
+		"_CODE",        // Banked code and const data
+		"_DATA",        // Ram that does not need initialization
+		"_XDATA",       // External Ram that does not need initialization
+		"_XDATA_BANKED",// Ram in the segments of the MSX2 memory mapper, seen through page 2
+		"_GSINIT",      // Initialization code to be executed before calling main, sits in segment 0,
+		"_GSFINAL",     // After code is initialized, it only remains to call main,
+		"_INITIALIZED", // RAM that must be initialized
+		"_INITIALIZER", // Contents to initialize RAM, sits in segment 0
+		"_HOME",        // Non banked code that will be copied to RAM on initialization
+		"_CABS#"        // ROM segment at a fixed address
+	};
+	
+	std::istringstream isf(module.content);
+	std::string line;
+
+	module.name = "";
+	// If the module comes from a rel file, the module name defaults to the filename.
+	if (module.filename.find(".rel") != std::string::npos) {
+		module.name = module.filename.substr(0, module.filename.find(".rel"));
+		for (auto &&c : module.name) 
+			if (c=='.') 
+				c='_';
+	}
+
+	Log(2) << "File name: " << module.filename << " (" << module.name << ")"; 
+		
+	
+	while (std::getline(isf, line)) {
+		
+		std::istringstream isl(line);
+		std::string type;
+		isl >> type;
+
+		if (type=="XL2") { // HEADER
+			
+			module.version = 2;
+
+		} else if (type=="XL3") {
+			
+			module.version = 3;
+
+		} else if (type=="XL4") {
+			
+			module.version = 4;
+
+		} else if (type=="M") {
+			
+			// The module name is implicitly declared.
+			isl >> module.name;
+			Log(1) << "Module name: " << module.name << " (" << module.filename << ")"; 
+			
+		} else if (type=="O") { // NOT NEEDED
+		} else if (type=="H") { // NOT NEEDED
+		} else if (type=="S") {
+			
+			Module::Symbol symbol;
+			std::string st = "   ";
+			
+			isl >> symbol.name >> st[0] >> st[1] >> st[2] >> HEX(symbol.addr, HEX::PLAIN);
+			
+				
+			if (st=="Def") {
+				symbol.type = Module::Symbol::DEF;
+			} else if (st=="Ref") {
+				symbol.type = Module::Symbol::REF;
+			} else throw std::runtime_error("Symbol type unexpected");
+			
+			if (not module.areas.empty())
+				symbol.areaName = module.areas.back().name;
+			
+			module.symbols.push_back(symbol);
+			
+			if (module.name.empty() and symbol.type == Module::Symbol::DEF and symbol.name.size()>1 and symbol.name[0]=='_') {
+				module.name = symbol.name.substr(1);
+				Log(1) << "Rel named after symbol" << module.name << " (" << module.filename << ")"; 
+			}
+			
+		} else if (type=="A") {
+			
+			Module::Area area;
+			
+			uint32_t flags;
+			isl >> area.name >> AR("size") >> HEX(area.size,HEX::PLAIN) 
+				>> AR("flags") >> flags 
+				>> AR("addr") >> HEX(area.addr,HEX::PLAIN);
+				
+			if (area.name.size()>0 and area.name[0]!='_')
+				area.name = '_' + area.name;
+							
+			if (flags==0) {
+				area.type = Module::Area::RELATIVE;
+			} else if (flags==8) {
+				area.type = Module::Area::ABSOLUTE;
+			} else throw std::runtime_error("Unexpected flag");
+			
+			
+			if (area.size>0) {
+				
+				Log(1) << "Found area: " << area.name << " of size: " << area.size;
+				
+				if (area.name.substr(0,5) == "_CABS") {
+					known_areas.insert(area.name);
+					module.has_cabs_areas = true;
+				}
+				
+				if (known_areas.count(area.name) == 0) 
+					throw std::runtime_error("Area " + area.name +" unknown");
+			}
+			
+			// NOTE: if the _HEADER0 area is defined, the module must be enabled. Other modules will be enabled on demand.
+			if (area.name=="_HEADER0") module.enabled=true;
+
+			module.areas.push_back(area);
+			
+		} else if (type=="T") { // NOT NOW
+		} else if (type=="R") { // NOT NOW
+		} else if (not type.empty()) {
+			
+			throw std::runtime_error("Unrecognized type: " + type);
+		}
+	}
+
+	if (module.name.empty()) throw std::runtime_error("Module not given a name, and we could not determine a name for it: " + module.filename);
+	if (module.version < 0) throw std::runtime_error("Object format not recognized.");
+}
+
+// preprocessAsset turns the raw bytes of an asset into a binary module.
+// The payload is the banked _CODE area of the module, defined as _<name>, and its size is the absolute symbol _<name>_size.
+void preprocessAsset(Module &module) {
+
+	Log(2) << "Asset: " << module.filename << " (" << module.name << ")";
+
+	if (module.content.size() > 0x2000) throw std::runtime_error("Asset " + module.filename + " too large to fit a segment");
+
+	module.version = 2;
+	module.binary = true;
+	module.areas.push_back({"_CODE", uint32_t(module.content.size()), 0, 0, Module::Area::RELATIVE});
+
+	Module::Symbol data;
+	data.name = "_" + module.name;
+	data.addr = 0;
+	data.type = Module::Symbol::DEF;
+	data.areaName = "_CODE";
+	module.symbols.push_back(data);
+
+	Module::Symbol size = data;
+	size.name = "_" + module.name + "_size";
+	size.addr = module.content.size();
+	size.areaName = "";
+	module.symbols.push_back(size);
+}
+
+// packLZ compresses data in the format understood by __ML_unpack (megalinker_unpack.s):
+//   0x00       end of data
+//   0x01-0x7F  literal run of that many bytes
+//   0x80       the data continues at the start of the next segment
+//   0x81-0xFF  match of (token & 0x7F) + 2 bytes, followed by its 16 bit distance back in the output
+// Matches are searched greedily through hash chains of 3 bytes, thus the output depends only on the input.
+// If segmented, the output is split in chunks of up to 0x2000 bytes, all but the last one ending in 0x80.
+std::vector<std::string> packLZ(const std::string &data, bool segmented) {
+
+	std::vector<std::string> chunks(1);
+
+	// Bytes left in the current chunk for a token, keeping one byte for the final 0x80 or 0x00.
+	auto room = [&]() { return segmented ? 0x2000 - 1 - int(chunks.back().size()) : 0x10000; };
+	auto nextChunk = [&]() {
+		chunks.back() += char(0x80);
+		chunks.emplace_back();
+	};
+	auto emit = [&](const std::string &token) {
+		if (room() < int(token.size())) nextChunk();
+		chunks.back() += token;
+	};
+
+	// Literal runs are cut at the end of a chunk.
+	std::string literals;
+	auto flush = [&]() {
+		for (size_t i=0; i<literals.size(); ) {
+			if (room() < 2) nextChunk();
+			size_t n = std::min<size_t>({0x7F, literals.size() - i, size_t(room() - 1)});
+			emit(char(n) + literals.substr(i, n));
+			i += n;
+		}
+		literals.clear();
+	};
+
+	std::vector<int32_t> head(0x10000, -1), prev(data.size(), -1);
+	auto hash = [&](size_t i) { return (uint8_t(data[i])*0x2E5 ^ uint8_t(data[i+1])*0x3B ^ uint8_t(data[i+2])) & 0xFFFF; };
+	auto insert = [&](size_t i) {
+		if (i+2 >= data.size()) return;
+		prev[i] = head[hash(i)];
+		head[hash(i)] = i;
+	};
+
+	for (size_t i=0; i<data.size(); ) {
+
+		size_t bestLength = 0, bestDistance = 0;
+		if (i+2 < data.size()) {
+			int chain = 64;
+			for (int32_t j = head[hash(i)]; j >= 0 and i-j <= 0xFFFF and chain--; j = prev[j]) {
+				size_t length = 0;
+				while (length < 129 and i+length < data.size() and data[j+length] == data[i+length]) length++;
+				if (length > bestLength) {
+					bestLength = length;
+					bestDistance = i-j;
+				}
+				if (length == 129) break;
+			}
+		}
+
+		if (bestLength >= 3) {
+			flush();
+			emit(std::string{char(0x80 | (bestLength-2)), char(bestDistance & 0xFF), char(bestDistance >> 8)});
+			for (size_t k=0; k<bestLength; k++) insert(i+k);
+			i += bestLength;
+		} else {
+			literals += data[i];
+			insert(i);
+			i++;
+		}
+	}
+	flush();
+	chunks.back() += char(0x00);
+
+	return chunks;
+}
+
+// makeIPS returns an IPS patch that turns the previous rom into the new one.
+// Differences closer than the size of a record header are merged in a single record.
+// A rom shorter than the previous one is truncated by the size that follows the EOF marker.
+std::vector<uint8_t> makeIPS(const std::string &previous, const std::vector<uint8_t> &rom) {
+
+	std::vector<uint8_t> patch = {'P', 'A', 'T', 'C', 'H'};
+
+	auto differs = [&](size_t i) { return i >= previous.size() or uint8_t(previous[i]) != rom[i]; };
+	for (size_t i=0; i<rom.size(); i++) {
+
+		if (not differs(i)) continue;
+
+		// An offset that reads as "EOF" would end the patch: the record starts one byte earlier.
+		size_t begin = i == 0x454F46 ? i-1 : i;
+		size_t end = i+1;
+		for (size_t j=end; j<rom.size() and j<end+5 and j-begin<0xFFFF; j++)
+			if (differs(j))
+				end = j+1;
+
+		if (begin > 0xFFFFFF) throw std::runtime_error("The ROM is too large for an IPS patch");
+
+		patch.insert(patch.end(), {uint8_t(begin>>16), uint8_t(begin>>8), uint8_t(begin), uint8_t((end-begin)>>8), uint8_t(end-begin)});
+		patch.insert(patch.end(), rom.begin()+begin, rom.begin()+end);
+		i = end-1;
+	}
+
+	patch.insert(patch.end(), {'E', 'O', 'F'});
+	if (rom.size() < previous.size())
+		patch.insert(patch.end(), {uint8_t(rom.size()>>16), uint8_t(rom.size()>>8), uint8_t(rom.size())});
+	return patch;
+}
+
+// readFile returns the raw contents of a file.
+std::string readFile(const std::string &filename) {
+
+	std::ifstream isf(filename, std::ios::binary);
+	if (not isf) throw std::runtime_error("Could not open file: " + filename);
+	std::stringstream buffer;
+	buffer << isf.rdbuf();
+	return buffer.str();
+}
+
+// loadAsset reads an asset file into a module named name.
+// Compressed assets also define the absolute symbol _<name>_unpacked_size.
+Module loadAsset(const std::string &name, const std::string &filename, bool compress = false, const FileReader &read = readFile) {
+
+	Module module;
+	module.filename = filename;
+	module.name = name;
+
+	std::string data = read(filename);
+	if (compress) {
+		if (data.size() > 0xFFFF) throw std::runtime_error("Compressed asset " + filename + " too large, it must be streamed");
+		module.content = packLZ(data, false).front();
+		Log(2) << "Asset: " << filename << " compressed from " << data.size() << " to " << module.content.size() << " bytes";
+	} else {
+		module.content = data;
+	}
+
+	preprocessAsset(module);
+
+	if (compress) {
+		Module::Symbol unpacked = module.symbols.back();
+		unpacked.name = "_" + name + "_unpacked_size";
+		unpacked.addr = data.size();
+		module.symbols.push_back(unpacked);
+	}
+	return module;
+}
+
+// Size of the table of a stream: length (4), number of chunks (1), and per chunk: segment (1 or 2), offset (2) and length (2).
+uint32_t streamTableSize(uint32_t nChunks, uint32_t segmentBytes) { return 5 + (4 + segmentBytes)*nChunks; }
+
+// loadStream reads an asset that spans several segments.
+// The payload is split in chunk modules name_0, name_1, ... of one segment each, that are placed in consecutive segments.
+// The stream itself is a _HOME module that defines _name: a table with the total length (4 bytes), the number of chunks (1 byte),
+// and the segment (1 or 2 bytes, see ___ML_CONFIG_SEGMENT_BITS), offset within the page (2 bytes) and length (2 bytes) of each chunk.
+// Compressed streams are packed as a whole, and their total length is the unpacked length.
+std::vector<Module> loadStream(const std::string &name, const std::string &filename, bool compress = false, const FileReader &read = readFile) {
+
+	std::string data = read(filename);
+
+	std::vector<std::string> parts;
+	if (compress) {
+		parts = packLZ(data, true);
+	} else {
+		for (uint32_t i=0; i<data.size(); i+=0x2000)
+			parts.push_back(data.substr(i, 0x2000));
+	}
+	uint32_t nChunks = parts.size();
+	if (nChunks == 0) throw std::runtime_error("Stream " + filename + " is empty");
+	if (nChunks > 255) throw std::runtime_error("Stream " + filename + " too large");
+
+	Module table;
+	table.filename = filename;
+	table.name = name;
+	table.version = 2;
+	table.binary = true;
+	table.areas.push_back({"_HOME", streamTableSize(nChunks, 1), 0, 0, Module::Area::RELATIVE});
+
+	Module::Symbol head;
+	head.name = "_" + name;
+	head.addr = 0;
+	head.type = Module::Symbol::DEF;
+	head.areaName = "_HOME";
+	table.symbols.push_back(head);
+
+	std::vector<Module> chunks;
+	for (uint32_t i=0; i<nChunks; i++) {
+
+		Module chunk;
+		chunk.filename = filename;
+		chunk.name = name + "_" + std::to_string(i);
+		chunk.content = parts[i];
+		preprocessAsset(chunk);
+
+		// The page of a chunk is irrelevant, as the table holds offsets, thus chunks are not requested in any page.
+		chunk.page = 0;
+		chunks.push_back(chunk);
+
+		// The table refers to each chunk, so the chunks are enabled with the stream.
+		Module::Symbol address = head;
+		address.name = "_" + chunk.name;
+		address.type = Module::Symbol::REF;
+		table.symbols.push_back(address);
+	}
+
+	// The width of the segments is only known once the crt is read, so it is resolved as a configuration symbol.
+	table.generate = [length = data.size(), symbols = table.symbols, chunks](const Module::Resolver &resolve) {
+
+		Module::Symbol bits = symbols[0];
+		bits.name = "___ML_CONFIG_SEGMENT_BITS";
+		bits.type = Module::Symbol::REF;
+		uint32_t segmentBytes = resolve(bits) == 16 ? 2 : 1;
+
+		std::string entry;
+		for (int i=0; i<4; i++)
+			entry += char((length >> (8*i)) & 0xFF);
+		entry += char(chunks.size());
+		for (size_t i=0; i<chunks.size(); i++) {
+			Module::Symbol segment = symbols[1+i];
+			segment.name = "___ML_SEGMENT_A_" + chunks[i].name;
+			segment.type = Module::Symbol::REF;
+
+			uint32_t offset = resolve(symbols[1+i]) & 0x1FFF;
+			for (uint32_t j=0; j<segmentBytes; j++)
+				entry += char(resolve(segment) >> (8*j));
+			entry += char(offset & 0xFF);
+			entry += char(offset >> 8);
+			entry += char(chunks[i].content.size() & 0xFF);
+			entry += char(chunks[i].content.size() >> 8);
+		}
+		return entry;
+	};
+
+	chunks.insert(chunks.begin(), table);
+	return chunks;
+}
+
+// alignUp returns the first address from addr that is a multiple of align.
+uint32_t alignUp(uint32_t addr, uint32_t align) { return (addr + align - 1) / align * align; }
+
+// layoutAreas places areas (size, alignment) one after the other from ptr, and returns their addresses.
+// Each area goes to the first gap left by the alignment padding that can hold it, or after the previous ones.
+// Areas with larger alignments are placed first, so the smaller ones can fill their gaps. Otherwise, the order is kept.
+// It advances ptr, and adds to lost the bytes of the gaps that remain empty.
+std::vector<uint32_t> layoutAreas(const std::vector<std::pair<uint32_t, uint32_t>> &areas, uint32_t &ptr, uint32_t &lost) {
+
+	std::vector<size_t> order(areas.size());
+	for (size_t i=0; i<order.size(); i++) order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return areas[a].second > areas[b].second; });
+
+	std::vector<uint32_t> addr(areas.size());
+	std::vector<std::pair<uint32_t, uint32_t>> gaps;
+	for (auto i : order) {
+
+		auto [size, align] = areas[i];
+
+		auto gap = gaps.begin();
+		while (gap != gaps.end() and alignUp(gap->first, align) + size > gap->second) gap++;
+
+		if (gap != gaps.end()) {
+			auto [begin, end] = *gap;
+			addr[i] = alignUp(begin, align);
+			gap = gaps.erase(gap);
+			if (addr[i] + size < end) gap = gaps.insert(gap, {addr[i] + size, end});
+			if (begin < addr[i]) gaps.insert(gap, {begin, addr[i]});
+		} else {
+			addr[i] = alignUp(ptr, align);
+			if (ptr < addr[i]) gaps.emplace_back(ptr, addr[i]);
+			ptr = addr[i] + size;
+		}
+	}
+
+	for (auto &gap : gaps) lost += gap.second - gap.first;
+	return addr;
+}
+
+// FirstFit keeps the free bytes of each segment in a max tree, to find the first segment that may hold a module
+// in logarithmic time. Thus, allocation scales to thousands of segments.
+struct FirstFit {
+
+	uint32_t size = 1;
+	std::vector<uint32_t> tree = std::vector<uint32_t>(2, 0);
+
+	void set(uint32_t i, uint32_t value) {
+
+		while (i >= size) {
+			std::vector<uint32_t> larger(4*size, 0);
+			std::copy(tree.begin()+size, tree.end(), larger.begin()+2*size);
+			size *= 2;
+			tree.swap(larger);
+			for (uint32_t n=size-1; n>0; n--)
+				tree[n] = std::max(tree[2*n], tree[2*n+1]);
+		}
+
+		tree[size+i] = value;
+		for (uint32_t n=(size+i)/2; n>0; n/=2)
+			tree[n] = std::max(tree[2*n], tree[2*n+1]);
+	}
+
+	// Returns the first segment from the given one with at least the requested free bytes, or -1.
+	uint32_t find(uint32_t from, uint32_t bytes, uint32_t n = 1, uint32_t begin = 0, uint32_t end = 0) const {
+
+		if (n == 1) end = size;
+		if (end <= from or tree[n] < bytes) return uint32_t(-1);
+		if (n >= size) return begin;
+
+		uint32_t middle = (begin + end) / 2;
+		uint32_t i = find(from, bytes, 2*n, begin, middle);
+		return i != uint32_t(-1) ? i : find(from, bytes, 2*n+1, middle, end);
+	}
+};
+
+enum {
+	R3_WORD=0x00, R3_BYTE=0x01,
+	R3_AREA=0x00, R3_SYM =0x02,
+	R3_NORM=0x00, R3_PCR =0x04,
+	R3_BYT1=0x00, R3_BYTX=0x08,
+	R3_SGND=0x00, R3_USGN=0x10,
+	R3_LSB =0x00, R3_MSB =0x80
+};
+
+// A Relocation is a single entry of an R record, as seen by the analysis passes.
+struct Relocation {
+	uint32_t area;   // Area that holds the relocated field
+	uint32_t offset; // Offset of the field within its area
+	uint32_t flags;  // R3_ flags of the entry
+	uint32_t index;  // Symbol index if flags & R3_SYM, area index otherwise
+	uint32_t value;  // Value stored in the field before relocation
+	int opcode;      // Byte that precedes the field, -1 if it is not in the same T record
+};
+
+// scanRelocations walks the T and R records of a module without resolving any address.
+// It follows the same byte removal rules as the code extraction.
+std::vector<Relocation> scanRelocations(const Module &module) {
+
+	std::vector<Relocation> relocations;
+	if (module.binary) return relocations;
+
+	std::istringstream isf(module.content);
+	std::string line;
+
+	uint32_t last_t_pos=0;
+	std::vector<uint8_t> T;
+
+	while (std::getline(isf, line)) {
+
+		std::istringstream isl(line);
+		std::string type;
+		isl >> type;
+
+		if (type=="T") {
+
+			uint32_t xx0, xx1, xx2;
+			isl >> HEX(xx0,HEX::TWO_NIBBLES) >> HEX(xx1,HEX::TWO_NIBBLES);
+			if (module.version==3) isl >> HEX(xx2,HEX::TWO_NIBBLES);
+			if (module.version==4) isl >> HEX(xx2,HEX::TWO_NIBBLES) >> HEX(xx2,HEX::TWO_NIBBLES);
+
+			last_t_pos = xx1*0x100 + xx0;
+
+			T.clear();
+			uint32_t nn;
+			while (isl >> HEX(nn,HEX::TWO_NIBBLES))
+				T.push_back(nn);
+
+		} else if (type=="R") {
+
+			uint32_t aa0, aa1;
+			isl >> AR("00") >> AR("00") >> HEX2(aa0) >> HEX2(aa1);
+			uint32_t current_area = aa1*0x100 + aa0;
+
+			uint32_t n2Adjust = 2;
+			if (module.version==3) n2Adjust = 3;
+			if (module.version==4) n2Adjust = 4;
+
+			uint32_t n1, n2, xx0, xx1;
+			while (isl >> HEX2(n1) >> HEX2(n2) >> HEX2(xx0) >> HEX2(xx1)) {
+
+				if (n2 <n2Adjust)
+					throw std::runtime_error("n2 < n2Adjust??");
+				n2-=n2Adjust;
+				if (n2+1 >= T.size()) throw std::runtime_error("Relocation out of T record in: " + module.filename);
+
+				Relocation r;
+				r.area = current_area;
+				r.offset = last_t_pos + n2;
+				r.flags = n1;
+				r.index = xx1*0x100 + xx0;
+				r.value = T[n2+0] + T[n2+1]*0x100;
+				r.opcode = n2>0 ? T[n2-1] : -1;
+				relocations.push_back(r);
+
+				// Byte relocations shrink the T record, the following fields are shifted.
+				if (n1 & R3_BYTX) {
+					uint32_t removed = 1;
+					if (module.version==3) removed = 2;
+					if (module.version==4) removed = 3;
+					T.erase(T.begin()+n2+1, T.begin()+std::min<size_t>(T.size(), n2+1+removed));
+					n2Adjust += removed;
+				}
+			}
+		}
+	}
+	return relocations;
+}
+
+// readAreaImages returns the bytes of each area of a module, before relocation.
+// It follows the same byte removal rules as the code extraction. Bytes not initialized are 0xFF, as in the ROM.
+std::vector<std::string> readAreaImages(const Module &module) {
+
+	std::vector<std::string> images;
+	for (auto &area : module.areas)
+		images.emplace_back(area.size, char(0xFF));
+	if (module.binary) return images;
+
+	std::istringstream isf(module.content);
+	std::string line;
+
+	uint32_t last_t_pos=0;
+	std::vector<uint8_t> T;
+
+	while (std::getline(isf, line)) {
+
+		std::istringstream isl(line);
+		std::string type;
+		isl >> type;
+
+		if (type=="T") {
+
+			uint32_t xx0, xx1, xx2;
+			isl >> HEX(xx0,HEX::TWO_NIBBLES) >> HEX(xx1,HEX::TWO_NIBBLES);
+			if (module.version==3) isl >> HEX(xx2,HEX::TWO_NIBBLES);
+			if (module.version==4) isl >> HEX(xx2,HEX::TWO_NIBBLES) >> HEX(xx2,HEX::TWO_NIBBLES);
+
+			last_t_pos = xx1*0x100 + xx0;
+
+			T.clear();
+			uint32_t nn;
+			while (isl >> HEX(nn,HEX::TWO_NIBBLES))
+				T.push_back(nn);
+
+		} else if (type=="R") {
+
+			uint32_t aa0, aa1;
+			isl >> AR("00") >> AR("00") >> HEX2(aa0) >> HEX2(aa1);
+			uint32_t current_area = aa1*0x100 + aa0;
+
+			uint32_t n2Adjust = 2;
+			if (module.version==3) n2Adjust = 3;
+			if (module.version==4) n2Adjust = 4;
+
+			uint32_t n1, n2, xx0, xx1;
+			while (isl >> HEX2(n1) >> HEX2(n2) >> HEX2(xx0) >> HEX2(xx1)) {
+
+				if (n2 <n2Adjust)
+					throw std::runtime_error("n2 < n2Adjust??");
+				n2-=n2Adjust;
+				if (n2+1 >= T.size()) throw std::runtime_error("Relocation out of T record in: " + module.filename);
+
+				if (n1 & R3_BYTX) {
+					uint32_t removed = 1;
+					if (module.version==3) removed = 2;
+					if (module.version==4) removed = 3;
+					T.erase(T.begin()+n2+1, T.begin()+std::min<size_t>(T.size(), n2+1+removed));
+					n2Adjust += removed;
+				}
+			}
+
+			if (current_area >= images.size()) throw std::runtime_error("Unknown area in: " + module.filename);
+			for (uint32_t i=0; i<T.size() and last_t_pos+i < images[current_area].size(); i++)
+				images[current_area][last_t_pos+i] = T[i];
+		}
+	}
+	return images;
+}
+
+// z80InstructionLength returns the length of the Z80 instruction at pos of an image.
+uint32_t z80InstructionLength(const std::string &image, uint32_t pos) {
+
+	static const std::set<int> length2 = {
+		0x06, 0x0E, 0x10, 0x16, 0x18, 0x1E, 0x20, 0x26, 0x28, 0x2E, 0x30, 0x36, 0x38, 0x3E,
+		0xC6, 0xCB, 0xCE, 0xD3, 0xD6, 0xDB, 0xDE, 0xE6, 0xEE, 0xF6, 0xFE };
+	static const std::set<int> length3 = {
+		0x01, 0x11, 0x21, 0x22, 0x2A, 0x31, 0x32, 0x3A,
+		0xC2, 0xC3, 0xC4, 0xCA, 0xCC, 0xCD, 0xD2, 0xD4, 0xDA, 0xDC, 0xE2, 0xE4, 0xEA, 0xEC, 0xF2, 0xF4, 0xFA, 0xFC };
+	static const std::set<int> indexed = {
+		0x34, 0x35, 0x36, 0x46, 0x4E, 0x56, 0x5E, 0x66, 0x6E, 0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x77, 0x7E,
+		0x86, 0x8E, 0x96, 0x9E, 0xA6, 0xAE, 0xB6, 0xBE };
+
+	auto at = [&](uint32_t i) { return i < image.size() ? uint8_t(image[i]) : 0; };
+	uint8_t op = at(pos);
+	if (op == 0xED) {
+		uint8_t next = at(pos+1);
+		return (next & 0xC7) == 0x43 ? 4 : 2;
+	}
+	if (op == 0xDD or op == 0xFD) {
+		uint8_t next = at(pos+1);
+		if (next == 0xCB) return 4;
+		if (next == 0xDD or next == 0xED or next == 0xFD) return 1;
+		return 1 + z80InstructionLength(image, pos+1) + indexed.count(next);
+	}
+	return length3.count(op) ? 3 : length2.count(op) ? 2 : 1;
+}
+
+// decodeCodeRange decodes the instructions of an image in [begin, end), and appends the targets of its relative branches
+// (jr, djnz) to targets. It returns true if the range ends exactly with ret, reti, retn, jp or jr, i.e., it never falls through.
+bool decodeCodeRange(const std::string &image, uint32_t begin, uint32_t end, std::vector<int32_t> &targets) {
+
+	auto at = [&](uint32_t i) { return i < image.size() ? uint8_t(image[i]) : 0; };
+	uint32_t pos = begin, last = begin;
+	while (pos < end) {
+		uint8_t op = at(pos);
+		if (op == 0x10 or op == 0x18 or op == 0x20 or op == 0x28 or op == 0x30 or op == 0x38)
+			targets.push_back(int32_t(pos) + 2 + int8_t(at(pos+1)));
+		last = pos;
+		pos += z80InstructionLength(image, pos);
+	}
+
+	uint8_t op = at(last), next = at(last+1);
+	bool ends = op == 0xC9 or op == 0xC3 or op == 0x18 or op == 0xE9
+		or (op == 0xED and (next == 0x45 or next == 0x4D))
+		or ((op == 0xDD or op == 0xFD) and next == 0xE9);
+	return pos == end and ends;
+}
+
+// findFoldableRanges returns the ranges (offset, bytes) of the _CODE area of a module that may be replaced by an identical copy.
+// Ranges are delimited by the global symbols, the data labels and the end of the area, and must hold no relocated field.
+// Data labels are local labels only referenced by instructions other than jumps and calls (e.g., string literals).
+// Moving a range breaks code that falls through into it, and relative branches (jr, djnz) into or out of it.
+// Code is assumed to never fall through into a data label. Ranges that start at a global symbol or at the start of the area
+// are decoded as code: they must end with ret, reti, retn, jp or jr, and their relative branches must stay within the range.
+// Ranges of data that start at a global symbol are thus not folded.
+std::vector<std::pair<uint32_t, std::string>> findFoldableRanges(const Module &module) {
+
+	std::vector<std::pair<uint32_t, std::string>> ranges;
+	if (module.binary or module.has_cabs_areas) return ranges;
+
+	uint32_t code = module.areas.size();
+	for (uint32_t i=0; i<module.areas.size(); i++)
+		if (module.areas[i].name == "_CODE")
+			code = i;
+	if (code == module.areas.size() or module.areas[code].size == 0) return ranges;
+	uint32_t size = module.areas[code].size;
+
+	std::set<uint32_t> bounds = { 0, size };
+	for (auto &sym : module.symbols)
+		if (sym.type == Module::Symbol::DEF and sym.areaName == "_CODE" and sym.addr < size)
+			bounds.insert(sym.addr);
+
+	std::vector<bool> relocated(size+1, false);
+	std::map<uint32_t, bool> dataLabels;
+	static const std::set<int> jumps = { 0xC2, 0xC3, 0xC4, 0xCA, 0xCC, 0xCD, 0xD2, 0xD4, 0xDA, 0xDC, 0xE2, 0xE4, 0xEA, 0xEC, 0xF2, 0xF4, 0xFA, 0xFC };
+	for (auto &r : scanRelocations(module)) {
+		if (r.area == code and r.offset < size) {
+			relocated[r.offset] = true;
+			if (not (r.flags & R3_BYTX))
+				relocated[r.offset+1] = true;
+		}
+		if (not (r.flags & R3_SYM) and r.index == code and r.value < size) {
+			bool isData = jumps.count(r.opcode)==0;
+			dataLabels[r.value] = dataLabels.count(r.value) ? dataLabels[r.value] and isData : isData;
+		}
+	}
+	for (auto &dl : dataLabels)
+		if (dl.second)
+			bounds.insert(dl.first);
+
+	std::string image = readAreaImages(module)[code];
+
+	// Ranges of code, their relative branches and how they end.
+	std::set<uint32_t> rejected;
+	for (auto it = bounds.begin(); std::next(it) != bounds.end(); it++) {
+		uint32_t begin = *it, end = *std::next(it);
+		if (dataLabels.count(begin) and dataLabels[begin]) continue;
+
+		std::vector<int32_t> targets;
+		if (not decodeCodeRange(image, begin, end, targets)) rejected.insert(begin);
+		for (int32_t target : targets) {
+			if (target >= int32_t(begin) and target < int32_t(end)) continue;
+			rejected.insert(begin);
+			if (target >= 0 and target < int32_t(size))
+				rejected.insert(*std::prev(bounds.upper_bound(target)));
+		}
+	}
+
+	for (auto it = bounds.begin(); std::next(it) != bounds.end(); it++) {
+		uint32_t begin = *it, end = *std::next(it);
+		if (rejected.count(begin)) continue;
+		if (std::find(relocated.begin()+begin, relocated.begin()+end, true) != relocated.begin()+end) continue;
+		ranges.emplace_back(begin, image.substr(begin, end - begin));
+	}
+	return ranges;
+}
+
+// findFold returns the folded range of a module that holds an offset of its _CODE area, or nullptr.
+const Module::Fold *findFold(const Module &module, uint32_t offset) {
+
+	for (auto &f : module.folds)
+		if (offset >= f.offset and offset < f.offset + f.size)
+			return &f;
+	return nullptr;
+}
+
+// foldedOffset maps an offset of the _CODE area of a module, as compiled, to its offset once the folded ranges are removed.
+uint32_t foldedOffset(const Module &module, uint32_t offset) {
+
+	uint32_t removed = 0;
+	for (auto &f : module.folds)
+		if (f.offset + f.size <= offset)
+			removed += f.size;
+	return offset - removed;
+}
+
+// computeStackBound estimates the worst case stack usage of the program from the call graph.
+// Calls are found from the relocations that follow a CALL or JP opcode in _CODE and _HOME areas.
+// Frame sizes, extra edges and interrupt entry points are read from the contents of an annotation file:
+//   frame <symbol> <bytes>       bytes pushed by the function besides the return address
+//   default <bytes>              frame size of the functions not annotated
+//   call <caller> <callee>       edge not visible in the relocations (e.g., function pointers)
+//   ignore <caller> <callee>     edge found in the relocations that is not a real call
+//   interrupt <symbol>           entry point that may run on top of the main stack
+// The stack map is returned in map.
+uint32_t computeStackBound(const std::map<std::string, std::vector<Module>> &modules, const std::string &annotations, std::string &map) {
+
+	std::map<std::string, uint32_t> frames;
+	std::map<std::string, std::set<std::string>> calls;
+	std::set<std::pair<std::string, std::string>> ignored;
+	std::vector<std::string> interrupts;
+	uint32_t defaultFrame = 0;
+
+	{
+		std::istringstream isf(annotations);
+
+		std::string line;
+		while (std::getline(isf, line)) {
+
+			std::istringstream isl(line.substr(0, line.find('#')));
+			std::string type, a, b;
+			if (not (isl >> type)) continue;
+
+			if (type=="frame") {
+				uint32_t bytes;
+				if (not (isl >> a >> bytes)) throw std::runtime_error("Malformed stack annotation: " + line);
+				frames[a] = bytes;
+			} else if (type=="default") {
+				if (not (isl >> defaultFrame)) throw std::runtime_error("Malformed stack annotation: " + line);
+			} else if (type=="call") {
+				if (not (isl >> a >> b)) throw std::runtime_error("Malformed stack annotation: " + line);
+				calls[a].insert(b);
+			} else if (type=="ignore") {
+				if (not (isl >> a >> b)) throw std::runtime_error("Malformed stack annotation: " + line);
+				ignored.emplace(a,b);
+			} else if (type=="interrupt") {
+				if (not (isl >> a)) throw std::runtime_error("Malformed stack annotation: " + line);
+				interrupts.push_back(a);
+			} else throw std::runtime_error("Unknown stack annotation: " + type);
+		}
+	}
+
+	auto isCall = [](int op) { return op==0xCD or (op & 0xC7) == 0xC4; };
+	auto isJump = [](int op) { return op==0xC3 or (op & 0xC7) == 0xC2; };
+
+	std::set<std::string> functions;
+	for (auto &mp : modules) {
+		for (auto &module : mp.second) {
+
+			// Functions of each area, sorted by address. Static functions are accounted to the preceding global symbol.
+			std::vector<std::vector<std::pair<uint32_t, std::string>>> areaFunctions(module.areas.size());
+			for (auto &sym : module.symbols) {
+				if (sym.type != Module::Symbol::DEF) continue;
+				if (sym.areaName!="_CODE" and sym.areaName!="_HOME") continue;
+				for (size_t i=0; i<module.areas.size(); i++)
+					if (module.areas[i].name == sym.areaName)
+						areaFunctions[i].emplace_back(sym.addr, sym.name);
+				functions.insert(sym.name);
+			}
+			for (auto &af : areaFunctions)
+				std::sort(af.begin(), af.end());
+
+			auto functionAt = [&](uint32_t area, uint32_t offset) -> std::string {
+				if (area >= areaFunctions.size()) return "";
+				auto &af = areaFunctions[area];
+				auto it = std::upper_bound(af.begin(), af.end(), std::make_pair(offset, std::string("\xff")));
+				if (it == af.begin()) return "";
+				return std::prev(it)->second;
+			};
+
+			for (auto &r : scanRelocations(module)) {
+				if (not isCall(r.opcode) and not isJump(r.opcode)) continue;
+
+				std::string caller = functionAt(r.area, r.offset);
+				if (caller.empty()) continue;
+
+				std::string callee = (r.flags & R3_SYM) ? module.symbols.at(r.index).name : functionAt(r.index, r.value);
+				if (callee.empty() or callee == caller) continue;
+				if (ignored.count(std::make_pair(caller, callee))) continue;
+
+				calls[caller].insert(callee);
+			}
+		}
+	}
+
+	// Depth of a function: its frame, plus the deepest callee and its return address.
+	std::map<std::string, uint32_t> depth;
+	std::map<std::string, std::string> deepest;
+	std::set<std::string> visiting;
+	std::set<std::string> unannotated;
+	std::function<uint32_t(const std::string &)> visit = [&](const std::string &f) -> uint32_t {
+
+		if (depth.count(f)) return depth[f];
+		if (visiting.count(f)) throw std::runtime_error("Recursive call chain through: " + f + ", the stack usage can not be bounded");
+		visiting.insert(f);
+
+		uint32_t d = 0;
+		if (calls.count(f)) {
+			for (auto &callee : calls[f]) {
+				if (functions.count(callee)==0) continue;
+				uint32_t c = 2 + visit(callee);
+				if (c > d) {
+					d = c;
+					deepest[f] = callee;
+				}
+			}
+		}
+
+		if (frames.count(f)) {
+			d += frames[f];
+		} else {
+			d += defaultFrame;
+			unannotated.insert(f);
+		}
+
+		visiting.erase(f);
+		return depth[f] = d;
+	};
+
+	if (functions.count("_main")==0) throw std::runtime_error("Stack analysis requires a _main function");
+	uint32_t bound = 2 + visit("_main");
+
+	uint32_t interruptBound = 0;
+	for (auto &isr : interrupts) {
+		if (functions.count(isr)==0) throw std::runtime_error("Unknown interrupt function: " + isr);
+		interruptBound = std::max(interruptBound, 2 + visit(isr));
+	}
+	bound += interruptBound;
+
+	{
+		std::ostringstream off;
+		off << "STACK MAP: " << std::endl;
+		off << "Worst case stack usage: " << bound << " bytes (main: " << bound - interruptBound << ", interrupts: " << interruptBound << ")" << std::endl;
+
+		std::vector<std::string> roots = interrupts;
+		roots.insert(roots.begin(), "_main");
+		for (auto &root : roots) {
+			off << std::endl << "Deepest path from " << root << ":" << std::endl;
+			for (std::string f = root; not f.empty(); f = deepest.count(f) ? deepest[f] : "")
+				off << "  " << f << " (frame: " << (frames.count(f) ? frames[f] : defaultFrame) << ", depth: " << depth[f] << ")" << std::endl;
+		}
+
+		off << std::endl << "# DEPTH # FRAME # FUNCTION" << std::endl;
+		for (auto &d : depth) {
+			char s[200];
+			snprintf(s,199,"# %5u # %5u # %s%s",d.second, frames.count(d.first) ? frames[d.first] : defaultFrame, d.first.c_str(), unannotated.count(d.first) ? " (not annotated)" : "");
+			off << s << std::endl;
+		}
+		map = off.str();
+	}
+
+	if (not unannotated.empty())
+		Log(3) << "Warning: " << unannotated.size() << " reachable functions have no frame size annotation, assumed " << defaultFrame << " bytes";
+
+	return bound;
+}
+
+// analyzeBankSwitches builds the graph of references between modules, once they are placed in segments and pages.
+// Each edge counts the relocated fields of one kind: "load" (a ___ML_SEGMENT_X symbol, i.e. a mapper write and its
+// restore), "call" (call or jump) or "ref" (any other reference). References from _HOME and _INITIALIZER run from
+// the non banked ROM. The graph is returned as DOT and as JSON, and the illegal edges as errors: banked code that
+// maps another segment in its own page, or that calls code of another segment of its own page.
+std::vector<std::string> analyzeBankSwitches(const std::map<std::string, std::vector<Module>> &modules, std::string &dot, std::string &json) {
+
+	std::map<std::string, std::string> definedIn;
+	for (auto &mp : modules)
+		for (auto &module : mp.second)
+			for (auto &sym : module.symbols)
+				if (sym.type == Module::Symbol::DEF and not sym.areaName.empty())
+					definedIn[sym.name] = mp.first;
+
+	struct Edge {
+		uint32_t sites = 0;
+		int fromPage = -1, toPage = -1;
+		int fromSegment = 0, toSegment = 0;
+		std::string status;
+	};
+	std::map<std::tuple<std::string, std::string, std::string>, Edge> edges;
+	std::vector<std::string> errors;
+
+	auto isCall = [](int op) { return op==0xCD or (op & 0xC7) == 0xC4; };
+	auto isJump = [](int op) { return op==0xC3 or (op & 0xC7) == 0xC2; };
+
+	for (auto &mp : modules) {
+		for (auto &module : mp.second) {
+			for (auto &r : scanRelocations(module)) {
+				if (not (r.flags & R3_SYM)) continue;
+
+				const Module::Symbol &sym = module.symbols.at(r.index);
+				bool banked = module.areas.at(r.area).name == "_CODE";
+				int fromPage = banked ? module.page : -1;
+
+				std::string kind, target;
+				int toPage;
+				if (sym.isSegmentSymbol()) {
+					kind = "load";
+					target = sym.getSegmentName();
+					toPage = sym.getSegmentPage();
+				} else {
+					if (definedIn.count(sym.name)==0) continue;
+					kind = isCall(r.opcode) or isJump(r.opcode) ? "call" : "ref";
+					target = definedIn[sym.name];
+					toPage = modules.at(target).front().page;
+				}
+				if (target == mp.first or modules.count(target)==0) continue;
+
+				Edge &edge = edges[std::make_tuple(mp.first, target, kind)];
+				edge.sites++;
+				edge.fromPage = fromPage;
+				edge.toPage = toPage;
+				edge.fromSegment = module.segment;
+				edge.toSegment = modules.at(target).front().segment;
+
+				bool sameSegment = edge.fromSegment == edge.toSegment;
+				if (toPage < 0 or (fromPage == toPage and sameSegment)) {
+					edge.status = "local";
+				} else if (fromPage != toPage) {
+					edge.status = kind == "load" ? "switch" : "mapped";
+				} else if (kind == "ref") {
+					edge.status = "same page";
+				} else {
+					edge.status = "illegal";
+					errors.push_back("Module " + mp.first + " in page " + char('A' + fromPage) + (kind == "load" ? " maps " : " calls ") + sym.name + " of module " + target + ", in another segment of the same page");
+				}
+			}
+		}
+	}
+
+	// Each load site writes the mapper twice: to map the module, and to restore the previous segment.
+	auto writes = [](const std::string &kind, const Edge &edge) { return kind == "load" and edge.status != "local" ? 2 * edge.sites : 0; };
+	auto pageName = [](int page) { return page < 0 ? std::string("-") : std::string(1, 'A' + page); };
+
+	{
+		std::ostringstream off;
+		off << "digraph megalinker {" << std::endl;
+		off << "  node [shape=box];" << std::endl;
+		for (auto &mp : modules) {
+			int page = mp.second.front().page;
+			off << "  \"" << mp.first << "\" [label=\"" << mp.first << "\\nsegment " << mp.second.front().segment << ", page " << pageName(page) << "\"";
+			if (page >= 0) off << ", style=filled, fillcolor=\"/pastel14/" << page+1 << "\"";
+			off << "];" << std::endl;
+		}
+		for (auto &[key, edge] : edges) {
+			auto &[from, to, kind] = key;
+			off << "  \"" << from << "\" -> \"" << to << "\" [label=\"" << kind << " x" << edge.sites;
+			if (writes(kind, edge)) off << "\\n" << writes(kind, edge) << " writes";
+			off << "\"";
+			if (kind == "load") off << ", style=dashed";
+			if (edge.status == "illegal") off << ", color=red";
+			off << "];" << std::endl;
+		}
+		off << "}" << std::endl;
+		dot = off.str();
+	}
+
+	{
+		std::ostringstream off;
+		off << "{" << std::endl;
+		off << "  \"modules\": [" << std::endl;
+		for (auto it = modules.begin(); it != modules.end(); it++)
+			off << "    {\"module\": \"" << it->first << "\", \"segment\": " << it->second.front().segment << ", \"page\": \"" << pageName(it->second.front().page) << "\"}" << (std::next(it) == modules.end() ? "" : ",") << std::endl;
+		off << "  ]," << std::endl;
+		off << "  \"edges\": [" << std::endl;
+		for (auto it = edges.begin(); it != edges.end(); it++) {
+			auto &[from, to, kind] = it->first;
+			auto &edge = it->second;
+			off << "    {\"from\": \"" << from << "\", \"to\": \"" << to << "\", \"kind\": \"" << kind << "\", \"sites\": " << edge.sites;
+			off << ", \"from_segment\": " << edge.fromSegment << ", \"from_page\": \"" << pageName(edge.fromPage) << "\"";
+			off << ", \"to_segment\": " << edge.toSegment << ", \"to_page\": \"" << pageName(edge.toPage) << "\"";
+			off << ", \"mapper_writes\": " << writes(kind, edge) << ", \"status\": \"" << edge.status << "\"}" << (std::next(it) == edges.end() ? "" : ",") << std::endl;
+		}
+		off << "  ]" << std::endl;
+		off << "}" << std::endl;
+		json = off.str();
+	}
+
+	return errors;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+
+// readInput reads a .rel, .lib, .bin or .assets file. Other files are ignored.
+Input readInput(const std::string &arg, const FileReader &read) {
+
+	Input input;
+	input.files.push_back(arg);
+
+	if (arg.substr(arg.find_last_of(".")) == ".rel") {	
+		
+		Log(1) << "Processing: " << arg;
+		Module module;
+		module.filename = arg;
+		module.content = read(arg);
+		
+		preprocessModule(module);
+		input.modules.push_back(module);
+
+	} else if (arg.substr(arg.find_last_of(".")) == ".bin") {
+
+		// The module of a binary asset is named after its file name.
+		std::string name = arg.substr(0, arg.find_last_of("."));
+		if (name.find_last_of("/\\") != std::string::npos)
+			name = name.substr(name.find_last_of("/\\")+1);
+		for (auto &&c : name)
+			if (not isalnum(c))
+				c='_';
+
+		Log(1) << "Processing: " << arg;
+		input.modules.push_back(loadAsset(name, arg, false, read));
+
+	} else if (arg.substr(arg.find_last_of(".")) == ".assets") {
+
+		// Each line of an asset manifest reads: name path [options]. Paths are relative to the manifest.
+		Log(1) << "Processing: " << arg;
+		std::istringstream isf(read(arg));
+
+		std::string dir = arg.find_last_of("/\\") == std::string::npos ? "" : arg.substr(0, arg.find_last_of("/\\")+1);
+
+		std::string line;
+		while (std::getline(isf, line)) {
+
+			std::istringstream isl(line.substr(0, line.find('#')));
+			std::string name, path, option;
+			if (not (isl >> name)) continue;
+			if (not (isl >> path)) throw std::runtime_error("Asset " + name + " has no path in: " + arg);
+			if (path[0]!='/') path = dir + path;
+			input.files.push_back(path);
+
+			bool stream = false, compress = false;
+			while (isl >> option) {
+				if (option == "stream") {
+					stream = true;
+				} else if (option == "compress") {
+					compress = true;
+				} else throw std::runtime_error("Unknown option " + option + " for asset " + name + " in: " + arg);
+			}
+
+			std::vector<Module> assetModules;
+			if (stream) {
+				assetModules = loadStream(name, path, compress, read);
+				for (size_t i=1; i<assetModules.size(); i++)
+					input.streams[name].push_back(assetModules[i].name);
+			} else {
+				assetModules.push_back(loadAsset(name, path, compress, read));
+			}
+
+			for (auto &module : assetModules)
+				input.modules.push_back(module);
+		}
+
+	} else if (arg.substr(arg.find_last_of(".")) == ".lib") {	
+
+		Log(1) << "Processing: " << arg;
+		std::istringstream isf(read(arg));
+		
+		std::string ar_signature = "!<arch>\n"; 
+		isf.read(&ar_signature[0],8); 
+		if (ar_signature != "!<arch>\n") throw std::runtime_error("Wrong signature in archive: " + arg);
+		
+		while (isf) {
+			std::string ar_file_name(16+1,0);
+			isf.read(&ar_file_name[0],16); 
+			
+			if (!isf) break;
+
+			std::string ar_buffer(12+6+6+8+1,0);
+			isf.read(&ar_buffer[0],12+6+6+8); 
+
+			std::string ar_size(10+1,0);
+			isf.read(&ar_size[0],10); 
+			std::istringstream issize(ar_size);
+			size_t ar_file_size;
+			issize >> ar_file_size;
+			
+			isf.read(&ar_buffer[0],2); 
+
+			Log(1) << "Found in archive: " << ar_file_name << "(" << ar_file_size << ")";
+
+			if (!isf) throw std::runtime_error("library terminates before reading full file");
+			
+			Module module;
+			module.filename = ar_file_name;
+			module.content.resize(ar_file_size);
+			isf.read(&module.content[0],ar_file_size); 
+
+			if (!isf) break;
+			if (!isf) throw std::runtime_error("library terminates before reading entire file");
+			
+			
+			if (module.content.size()>10 and module.content.substr(0,2)=="XL") {
+				
+				preprocessModule(module);
+				input.modules.push_back(module);
+
+			} else {
+				
+				Log(2) << "File " << ar_file_name << " not a relocatable object file";
+			} 
+			
+			if (ar_file_size % 2 == 1) isf.get(); // Align to 2
+		}
+	}
+	return input;
+}
+
+// addInput adds the modules of an input to the link. A .rel file supplied twice is only added once.
+void addInput(std::map<std::string, std::vector<Module>> &modules, std::map<std::string, std::vector<std::string>> &streams, const Input &input, const std::string &arg) {
+
+	for (auto &module : input.modules) {
+		if (modules.count(module.name)) {
+			if (modules[module.name].front().filename == module.filename and module.filename == arg) continue;
+			throw std::runtime_error("File " + arg + " declares a module already defined in: " + modules[module.name].front().filename);
+		}
+		modules[module.name].push_back(module);
+		modules[module.name].back().source = arg;
+	}
+	for (auto &st : input.streams)
+		streams[st.first] = st.second;
+}
+
+// fingerprint hashes (64 bit FNV-1a) the options of a link and the contents of the named modules. Returns 0 if a module is missing.
+// Only the modules read from inputs are hashed: the generated ones derive from them.
+uint64_t fingerprint(const LinkOptions &options, const std::map<std::string, std::vector<Module>> &modules, const std::set<std::string> &names, const FileReader &read) {
+
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	auto add = [&hash](const std::string &data) {
+		for (unsigned char c : data)
+			hash = (hash ^ c) * 0x100000001b3ULL;
+		hash = (hash ^ 0xFF) * 0x100000001b3ULL;
+	};
+
+	// Files that may be missing, such as the rom of a previous link, are hashed as empty.
+	auto contents = [&read](const std::string &filename) {
+		if (filename.empty()) return std::string();
+		try {
+			return read(filename);
+		} catch (std::runtime_error &) {
+			return std::string();
+		}
+	};
+
+	add(options.romName);
+	add(options.stackAnnotations.empty() ? "" : read(options.stackAnnotations));
+	add(std::string{char(options.instrument), char(options.fold), char(options.gc), char(options.disk), char(options.budget), char(options.callGraph)});
+	for (auto &ov : options.overrides)
+		add(ov.first + "=" + std::to_string(ov.second));
+	add(options.previousRom);
+	add(contents(options.previousRom));
+	add(contents(options.previousRom.empty() ? "" : options.previousRom + ".layout"));
+	add(options.budgetBaseline);
+	add(contents(options.budgetBaseline));
+
+	// A new input may override a library member, so the inputs and their order count, not only the modules linked.
+	for (auto &input : options.inputs)
+		add(input);
+
+	for (auto &name : names) {
+		if (modules.count(name) == 0) return 0;
+		for (auto &module : modules.at(name)) {
+			if (module.source.empty()) continue;
+			add(module.name);
+			add(module.content);
+		}
+	}
+	return hash ? hash : 1;
+}
+
+// link arranges the modules in the megarom, and returns the rom and its maps.
+LinkOutput link(const LinkOptions &options, std::map<std::string, std::vector<Module>> modules, std::map<std::string, std::vector<std::string>> streams, const FileReader &read) {
+
+	LinkOutput output;
+	Log::Capture capture(options.quiet ? &output.diagnostics : Log::captured());
+
+	// OVERRIDE ABSOLUTE SYMBOLS
+	// The variants of a batch link may give other values to the absolute symbols of their modules (e.g., configuration symbols).
+	for (auto &ov : options.overrides) {
+		bool defined = false;
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &sym : module.symbols) {
+					if (sym.type != Module::Symbol::DEF or sym.name != ov.first) continue;
+					if (not sym.areaName.empty()) throw std::runtime_error("Only absolute symbols can be overridden: " + sym.name);
+					sym.addr = ov.second;
+					defined = true;
+				}
+			}
+		}
+		if (not defined) throw std::runtime_error("Overridden symbol not defined: " + ov.first);
+	}
+
+	// PROCESS THE MOVE_TO_ DIRECTIVE
+	{
+		std::map<std::string, std::string > moveDirectives;
+
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &sym : module.symbols) {
+					if (not sym.isMoveSymbol()) continue;
+					std::string source = sym.getMoveSource();
+					std::string target = sym.getMoveTarget();
+					
+					if (moveDirectives.count(source) and moveDirectives[source] != target) throw std::runtime_error("Module symbols can not be send to more than one target: (" + source + " -> " + target + ")" );
+					if (modules.count(source)==0) throw std::runtime_error("Unknown source module: " + source );
+					
+					moveDirectives[source] = target;
+				}
+			}
+		}
+		
+		for (auto &md : moveDirectives) {
+
+			if (moveDirectives.count(md.second)) 
+				throw std::runtime_error("Moving symbols functionality does not support chains (yet)" );
+			
+			for (auto &mp : modules[md.first]) {
+				Log(3) << "Moving module: " << mp.name << " to " << md.second;
+				modules[md.second].push_back(mp);
+			}
+			modules.erase(md.first);
+		}
+	}
+
+	// PROCESS THE OVERLAY_GROUP DIRECTIVE
+	std::map<std::string, std::set<std::string>> overlayGroups;
+	std::map<std::string, std::string> moduleOverlay;
+	{
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &sym : module.symbols) {
+					if (not sym.isOverlaySymbol()) continue;
+					std::string group = sym.getOverlayGroup();
+					std::string target = sym.getOverlayModule();
+
+					if (moduleOverlay.count(target) and moduleOverlay[target] != group) throw std::runtime_error("Module can not belong to more than one overlay group: (" + target + " -> " + group + ", " + moduleOverlay[target] + ")" );
+					if (modules.count(target)==0) throw std::runtime_error("Unknown overlay module: " + target );
+
+					moduleOverlay[target] = group;
+					overlayGroups[group].insert(target);
+				}
+			}
+		}
+	}
+
+	// PROCESS THE PIN DIRECTIVE
+	std::map<std::string, int> pinnedModules;
+	{
+		std::vector<std::string> pagePin(4);
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &sym : module.symbols) {
+					if (not sym.isPinSymbol()) continue;
+					std::string target = sym.getPinModule();
+					int page = sym.getPinPage();
+
+					if (modules.count(target)==0) throw std::runtime_error("Unknown pinned module: " + target );
+					if (pinnedModules.count(target) and pinnedModules[target] != page) throw std::runtime_error("Module " + target + " pinned in more than one page");
+					if (not pagePin[page].empty() and pagePin[page] != target) throw std::runtime_error("Page " + std::string(1, 'A' + page) + " pinned by " + pagePin[page] + " and " + target);
+
+					pinnedModules[target] = page;
+					pagePin[page] = target;
+				}
+			}
+		}
+	}
+
+	// PROCESS THE ALIGN DIRECTIVE
+	std::map<std::string, uint32_t> moduleAlignment;
+	{
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &sym : module.symbols) {
+					if (not sym.isAlignSymbol()) continue;
+					std::string target = sym.getAlignModule();
+					uint32_t bytes = sym.getAlignBytes();
+
+					if (modules.count(target)==0) throw std::runtime_error("Unknown aligned module: " + target );
+					if (bytes==0 or bytes>0x2000 or (bytes & (bytes-1))) throw std::runtime_error("Alignment of " + target + " must be a power of two up to 8192: " + sym.name);
+					if (moduleAlignment.count(target) and moduleAlignment[target] != bytes) throw std::runtime_error("Module " + target + " aligned to more than one boundary");
+
+					moduleAlignment[target] = bytes;
+				}
+			}
+		}
+	}
+
+	// FIND THE WIDTH OF THE SEGMENT NUMBERS
+	// The tables generated by the linker hold 8 or 16 bit segment numbers, as set by ___ML_CONFIG_SEGMENT_BITS in the crt.
+	uint32_t segmentBytes = 1;
+	{
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &sym : module.symbols) {
+					if (sym.type != Module::Symbol::DEF or sym.name != "___ML_CONFIG_SEGMENT_BITS") continue;
+					if (sym.addr != 8 and sym.addr != 16) throw std::runtime_error("___ML_CONFIG_SEGMENT_BITS must be 8 or 16");
+					segmentBytes = sym.addr / 8;
+				}
+			}
+		}
+
+		for (auto &st : streams)
+			for (auto &module : modules[st.first])
+				module.areas.front().size = streamTableSize(st.second.size(), segmentBytes);
+	}
+
+	// GENERATE FAR POINTERS
+	// Each far pointer becomes a _HOME module holding its (segment, page, address) entry.
+	// The module requests the module of the function, so both are enabled and paged as usual.
+	{
+		std::set<std::string> farSymbols;
+		for (auto &mp : modules)
+			for (auto &module : mp.second)
+				for (auto &sym : module.symbols)
+					if (sym.type == Module::Symbol::REF and sym.isFarSymbol())
+						farSymbols.insert(sym.name);
+
+		for (auto &farName : farSymbols) {
+
+			Module::Symbol far;
+			far.name = farName;
+			far.addr = 0;
+			far.type = Module::Symbol::DEF;
+			far.areaName = "_HOME";
+
+			std::string target;
+			for (auto &mp : modules)
+				for (auto &module : mp.second)
+					for (auto &sym : module.symbols)
+						if (sym.type == Module::Symbol::DEF and sym.name == far.getFarFunction())
+							target = mp.first;
+
+			// If the function does not exist, the far pointer is reported as undefined when used.
+			if (target.empty()) continue;
+
+			Module::Symbol segment = far, function = far;
+			segment.name = "___ML_SEGMENT_" + std::string(1, 'A' + far.getFarPage()) + "_" + target;
+			segment.type = Module::Symbol::REF;
+			function.name = far.getFarFunction();
+			function.type = Module::Symbol::REF;
+
+			Module module;
+			module.filename = "(far pointer)";
+			module.name = farName;
+			module.version = 2;
+			module.areas.push_back({"_HOME", 3 + segmentBytes, 0, 0, Module::Area::RELATIVE});
+			module.symbols.push_back(far);
+			module.symbols.push_back(segment);
+			module.symbols.push_back(function);
+			module.binary = true;
+			module.generate = [page = far.getFarPage(), segment, function, segmentBytes](const Module::Resolver &resolve) {
+
+				uint32_t address = resolve(function);
+				std::string entry;
+				for (uint32_t i=0; i<segmentBytes; i++)
+					entry += char(resolve(segment) >> (8*i));
+				entry += char(page);
+				entry += char(address & 0xFF);
+				entry += char(address >> 8);
+				return entry;
+			};
+
+			Log(1) << "Far pointer: " << farName << " to module: " << target;
+			modules[module.name].push_back(module);
+		}
+	}
+
+	// GENERATE SEGMENT SETS
+	// Each set becomes a _HOME module holding a mask of its pages and the segment of each page.
+	{
+		std::map<std::string, std::vector<std::string>> sets;
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &sym : module.symbols) {
+					if (not sym.isSetMemberSymbol()) continue;
+
+					std::string target = sym.getSetModule();
+					if (modules.count(target)==0) throw std::runtime_error("Unknown set module: " + target );
+
+					auto &members = sets[sym.getSetName()];
+					members.resize(4);
+					if (not members[sym.getSetPage()].empty() and members[sym.getSetPage()] != target)
+						throw std::runtime_error("Set " + sym.getSetName() + " loads more than one module in page " + std::string(1, 'A' + sym.getSetPage()));
+					members[sym.getSetPage()] = target;
+				}
+			}
+		}
+
+		// The set loader returns the previous segments of the 4 pages in 32 bits, which only holds 8 bit segments.
+		if (not sets.empty() and segmentBytes != 1) throw std::runtime_error("Segment sets require 8 bit segments (___ML_CONFIG_SEGMENT_BITS)");
+
+		for (auto &set : sets) {
+
+			Module module;
+			module.filename = "(segment set)";
+			module.name = "___ML_SET_" + set.first;
+			module.version = 2;
+			module.areas.push_back({"_HOME", 5, 0, 0, Module::Area::RELATIVE});
+			module.binary = true;
+
+			Module::Symbol table;
+			table.name = module.name;
+			table.addr = 0;
+			table.type = Module::Symbol::DEF;
+			table.areaName = "_HOME";
+			module.symbols.push_back(table);
+
+			std::vector<int> pages;
+			for (int page=0; page<4; page++) {
+				if (set.second[page].empty()) continue;
+
+				Module::Symbol segment = table;
+				segment.name = "___ML_SEGMENT_" + std::string(1, 'A' + page) + "_" + set.second[page];
+				segment.type = Module::Symbol::REF;
+				module.symbols.push_back(segment);
+				pages.push_back(page);
+			}
+
+			module.generate = [pages, symbols = module.symbols](const Module::Resolver &resolve) {
+
+				std::string entry(5,0);
+				for (size_t i=0; i<pages.size(); i++) {
+					entry[0] |= 1 << pages[i];
+					entry[1+pages[i]] = resolve(symbols[1+i]);
+				}
+				return entry;
+			};
+
+			Log(1) << "Segment set: " << set.first << " with " << pages.size() << " pages";
+			modules[module.name].push_back(module);
+		}
+	}
+
+	// GENERATE THE BOOT DATA CHUNKS
+	// A crt that refers to ___ML_INIT_CHUNKS copies _HOME and _INITIALIZER from banked segments, instead of from the header.
+	// The table holds the number of chunks (1 byte), and the segment (1 or 2 bytes), offset within the page (2 bytes) and length (2 bytes) of each chunk.
+	// The chunks are copied one after the other from ___ML_CONFIG_INIT_RAM_START.
+	struct InitChunk { uint32_t start, size, segment, offset; };
+	std::vector<InitChunk> initChunks;
+	bool spillInit = false;
+	{
+		for (auto &mp : modules)
+			for (auto &module : mp.second)
+				for (auto &sym : module.symbols)
+					if (sym.type == Module::Symbol::REF and sym.name == "___ML_INIT_CHUNKS")
+						spillInit = true;
+
+		if (spillInit) {
+			if (options.disk) throw std::runtime_error("Disk overlays copy the boot data with the program, ___ML_INIT_CHUNKS can not be used");
+
+			Module module;
+			module.filename = "(boot data chunks)";
+			module.name = "___ML_INIT_CHUNKS";
+			module.version = 2;
+			// The size of the table is only known once _HOME and _INITIALIZER are laid out.
+			module.areas.push_back({"_INIT_CHUNKS", 0, 0, 0, Module::Area::RELATIVE});
+			module.binary = true;
+
+			Module::Symbol table;
+			table.name = module.name;
+			table.addr = 0;
+			table.type = Module::Symbol::DEF;
+			table.areaName = "_INIT_CHUNKS";
+			module.symbols.push_back(table);
+			// The content is generated once the chunks are placed in their segments (ALLOCATE BANKABLE CODE AREAS).
+
+			modules[module.name].push_back(module);
+		}
+	}
+
+	// ENABLE ALL REQUIRED FILES / MODULES
+	auto enableRequiredModules = [&]() {
+		for (;;) {
+		
+			bool updated = false;
+
+			std::map<std::string,int> referencedSymbols;
+
+			for (auto &mp : modules) {
+				for (auto &module : mp.second) {
+				
+					if (not module.enabled) continue;
+				
+					for (auto &sym : module.symbols) {
+					
+						if (sym.type != Module::Symbol::REF) continue;
+					
+						if (sym.isConfigurationSymbol()) continue;
+					
+						if (sym.isSegmentSymbol()) {
+						
+							std::string requiredModule = sym.getSegmentName(); 
+						
+							if (modules.count(requiredModule)==0) throw std::runtime_error("Module: " + module.name + " requires unknown module: " + requiredModule );
+
+							for (auto &m : modules[requiredModule]) {
+								if (m.enabled == false) {
+									m.enabled = true;
+									updated = true;
+								}
+							}
+
+							continue;
+						}
+
+						if (sym.isRamSegmentSymbol()) {
+
+							std::string requiredModule = sym.getRamSegmentName();
+
+							if (modules.count(requiredModule)==0) throw std::runtime_error("Module: " + module.name + " requires unknown module: " + requiredModule );
+
+							for (auto &m : modules[requiredModule]) {
+								if (m.enabled == false) {
+									m.enabled = true;
+									updated = true;
+								}
+							}
+
+							continue;
+						}
+					
+						referencedSymbols[sym.name] = 0;
+					}
+				}
+			}
+
+			for (auto &mp : modules) {
+				for (auto &module : mp.second) {
+					for (auto &sym : module.symbols) {
+					
+						if (sym.type != Module::Symbol::DEF) continue;
+
+						if (sym.isConfigurationSymbol()) continue;
+						
+						if (not module.enabled and referencedSymbols.count(sym.name)) {
+							module.enabled = true;
+							updated = true;
+						}
+					
+						if (module.enabled and referencedSymbols.count(sym.name)) {
+						
+							if (referencedSymbols[sym.name]>0) throw std::runtime_error("Symbol: " + sym.name + " defined multiple times");
+							referencedSymbols[sym.name]++;
+						}
+					}
+				}
+			}
+		
+			for (auto &ref : referencedSymbols) {
+
+				if (ref.second==0) {
+
+					std::string errorString = std::string("Referenced Symbol: ") + ref.first + " not defined. Required by the following modules: ";
+
+					for (auto &mp : modules) {
+						for (auto &module : mp.second) {
+						
+							if (not module.enabled) continue;
+						
+							for (auto &sym : module.symbols) {
+							
+								if (sym.name != ref.first) continue;
+							
+								if (sym.type != Module::Symbol::REF) continue;
+							
+								if (sym.isConfigurationSymbol()) continue;
+							
+								if (sym.isSegmentSymbol()) continue;
+
+								if (sym.isRamSegmentSymbol()) continue;
+							
+								errorString += module.name;
+								errorString += " ";
+							}
+						}
+					}				
+
+					throw std::runtime_error(errorString);
+				}
+			}
+				
+			if (not updated) break;
+		}
+	};
+	enableRequiredModules();
+
+	// GENERATE THE INTERRUPT DISPATCHER
+	// The handlers registered by the modules of the .rel files, and by the library members linked for other reasons,
+	// are called in order from a _HOME dispatcher, hooked by a _GSINIT installer. Registering a handler in a library
+	// member does not pull it into the ROM.
+	// Only the pages of the banked handlers are saved, each handler is mapped unless the previous one in its page
+	// is of the same module, and the saved pages are restored before jumping to the previous contents of the hook.
+	// The modules of the handlers are then enabled.
+	std::set<int> interruptPages; // Pages whose mapper registers are written by the dispatcher
+	{
+		std::set<std::tuple<uint32_t, std::string, int>> handlers; // (order, function, page)
+		auto isLibraryMember = [](const Module &module) { return module.source.size() > 4 and module.source.substr(module.source.size()-4) == ".lib"; };
+		for (auto &mp : modules)
+			for (auto &module : mp.second)
+				if (module.enabled or not isLibraryMember(module))
+					for (auto &sym : module.symbols)
+						if (sym.type == Module::Symbol::DEF and sym.isInterruptSymbol())
+							handlers.emplace(sym.getInterruptOrder(), sym.getInterruptFunction(), sym.getInterruptPage());
+
+		if (not handlers.empty()) {
+			if (options.disk) throw std::runtime_error("Interrupt handlers can not be registered in a disk overlay");
+
+			Module module;
+			module.filename = "(interrupt dispatcher)";
+			module.name = "___ML_INTERRUPT_DISPATCH";
+			module.version = 2;
+			module.binary = true;
+			module.enabled = true;
+
+			Module::Symbol dispatch;
+			dispatch.name = "___ML_interrupt_dispatch";
+			dispatch.addr = 0;
+			dispatch.type = Module::Symbol::DEF;
+			dispatch.areaName = "_HOME";
+			module.symbols.push_back(dispatch);
+
+			auto ref = [&](const std::string &name) {
+				Module::Symbol symbol = dispatch;
+				symbol.name = name;
+				symbol.type = Module::Symbol::REF;
+				module.symbols.push_back(symbol);
+				return module.symbols.size() - 1;
+			};
+
+			// The code is a list of opcodes, and of the symbols whose 8 or 16 bit value follows them.
+			struct Op { std::string bytes; size_t symbol; uint32_t width; };
+			std::vector<Op> code;
+			auto size = [&]() { uint32_t n = 0; for (auto &op : code) n += op.bytes.size() + op.width; return n; };
+
+			std::set<int> saved;
+			std::vector<std::string> mapped(4);
+			std::vector<std::tuple<std::string, int, std::string>> calls; // (function, page, module or empty)
+			for (auto &[order, function, page] : handlers) {
+
+				std::string target;
+				for (auto &mp : modules)
+					for (auto &m : mp.second)
+						for (auto &sym : m.symbols)
+							if (sym.type == Module::Symbol::DEF and sym.name == function)
+								target = mp.first;
+				if (target.empty()) throw std::runtime_error("Unknown interrupt handler: " + function);
+
+				// Handlers pinned in their page are always mapped.
+				if (page >= 0 and pinnedModules.count(target) and pinnedModules[target] == page) {
+					ref("___ML_SEGMENT_" + std::string(1, 'A' + page) + "_" + target);
+					target.clear();
+				}
+				if (page >= 0 and not target.empty())
+					saved.insert(page);
+				calls.emplace_back(function, page, page < 0 ? "" : target);
+			}
+
+			auto current = [](int page) { return "___ML_current_segment_" + std::string(1, 'a' + page); };
+			auto address = [](int page) { return "___ML_address_" + std::string(1, 'a' + page); };
+			auto addressHi = [](int page) { return "___ML_address_hi_" + std::string(1, 'a' + page); };
+
+			// Writes the segment in hl (16 bit) or a (8 bit) to the page.
+			auto map = [&](int page) {
+				if (segmentBytes == 2) {
+					code.push_back({"\x22", ref(current(page)), 2});   // ld (current),hl
+					code.push_back({"\x7D\x32", ref(address(page)), 2}); // ld a,l ; ld (address),a
+					code.push_back({"\x7C\x32", ref(addressHi(page)), 2}); // ld a,h ; ld (address_hi),a
+				} else {
+					code.push_back({"\x32", ref(current(page)), 2});   // ld (current),a
+					code.push_back({"\x32", ref(address(page)), 2});   // ld (address),a
+				}
+			};
+
+			code.push_back({"\xF5", 0, 0}); // push af: the hook is called with the VDP status in a
+			for (int page : saved) {
+				if (segmentBytes == 2) {
+					code.push_back({"\x2A", ref(current(page)), 2}); // ld hl,(current)
+					code.push_back({"\xE5", 0, 0});                  // push hl
+				} else {
+					code.push_back({"\x3A", ref(current(page)), 2}); // ld a,(current)
+					code.push_back({"\xF5", 0, 0});                  // push af
+				}
+			}
+			for (auto &[function, page, target] : calls) {
+				if (not target.empty() and mapped[page] != target) {
+					std::string segment = "___ML_SEGMENT_" + std::string(1, 'A' + page) + "_" + target;
+					code.push_back({segmentBytes == 2 ? "\x21" : "\x3E", ref(segment), segmentBytes}); // ld hl/a,#segment
+					map(page);
+					mapped[page] = target;
+				}
+				code.push_back({"\xCD", ref(function), 2}); // call function
+			}
+			for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+				code.push_back({segmentBytes == 2 ? "\xE1" : "\xF1", 0, 0}); // pop hl/af
+				map(*it);
+			}
+			code.push_back({"\xF1", 0, 0}); // pop af
+
+			// The previous contents of the hook follow, copied by the installer.
+			Module::Symbol chain = dispatch;
+			chain.name = "___ML_interrupt_chain";
+			chain.addr = size();
+			module.symbols.push_back(chain);
+
+			module.areas.push_back({"_HOME", size() + 5, 0, 0, Module::Area::RELATIVE});
+			module.generate = [code, symbols = module.symbols](const Module::Resolver &resolve) {
+
+				std::string entry;
+				for (auto &op : code) {
+					entry += op.bytes;
+					for (uint32_t i=0; i<op.width; i++)
+						entry += char(resolve(symbols[op.symbol]) >> (8*i));
+				}
+				return entry + std::string(5, char(0xC9));
+			};
+
+			Log(1) << "Interrupt dispatcher: " << calls.size() << " handlers, " << saved.size() << " pages saved, " << size() + 5 << " bytes";
+			interruptPages = saved;
+			modules[module.name].push_back(module);
+
+			Module install;
+			install.filename = "(interrupt installer)";
+			install.name = "___ML_INTERRUPT_INSTALL";
+			install.version = 2;
+			install.binary = true;
+			install.enabled = true;
+			install.areas.push_back({"_GSINIT", 22, 0, 0, Module::Area::RELATIVE});
+
+			Module::Symbol hook = dispatch;
+			hook.name = "___ML_CONFIG_INTERRUPT_HOOK";
+			hook.type = Module::Symbol::REF;
+			hook.areaName = "_GSINIT";
+			install.symbols.push_back(hook);
+			dispatch.type = chain.type = Module::Symbol::REF;
+			dispatch.areaName = chain.areaName = "_GSINIT";
+			install.symbols.push_back(dispatch);
+			install.symbols.push_back(chain);
+
+			// H.TIMI unless the crt sets another hook.
+			install.generate = [symbols = install.symbols](const Module::Resolver &resolve) {
+
+				uint32_t hook = resolve(symbols[0]) ? resolve(symbols[0]) : 0xFD9F;
+				auto word = [](uint32_t value) { return std::string(1, char(value & 0xFF)) + char(value >> 8); };
+				return "\x21" + word(hook) +                  // ld hl,#hook
+					"\x11" + word(resolve(symbols[2])) +      // ld de,#___ML_interrupt_chain
+					"\x01" + word(5) +                        // ld bc,#5
+					"\xED\xB0" +                             // ldir
+					"\x3E\xC3" +                             // ld a,#0xC3 (jp)
+					"\x32" + word(hook) +                     // ld (hook),a
+					"\x21" + word(resolve(symbols[1])) +      // ld hl,#___ML_interrupt_dispatch
+					"\x22" + word(hook + 1);                  // ld (hook+1),hl
+			};
+			modules[install.name].push_back(install);
+		}
+	}
+	enableRequiredModules();
+
+	// REMOVE NON ENABLED SUB-MODULES
+	for (auto &mp : modules) {
+		auto &m = mp.second;
+		auto it =  std::remove_if(m.begin(), m.end(), [](const Module &item) { return not item.enabled; });
+		m.erase(it, m.end());
+	}
+
+	// REMOVE MODULES WITHOUT ACTIVE SUB-MODULES
+	for (auto it = modules.begin(); it != modules.end(); ) {
+        if (it->second.empty())
+			it = modules.erase(it);
+        else
+            ++it;
+    }
+ 
+	// The banked RAM window replaces pages C and D, where the dispatcher would write its mapper registers.
+	if (modules.count("megalinker_ram") and (interruptPages.count(2) or interruptPages.count(3)))
+		throw std::runtime_error("Interrupt handlers mapped in page C or D can not be used with the banked RAM window (megalinker_ram)");
+
+	// LIST THE FILES THAT CONTRIBUTE TO THE ROM
+	// The dependency file is a make rule with the inputs of the modules linked (and their asset files).
+	// The members of the libraries linked, the modules, and their fingerprint follow as comments.
+	if (not options.dependencyFile.empty()) {
+
+		std::set<std::string> files, members, names;
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				if (module.source.empty()) continue;
+				names.insert(module.name);
+				files.insert(module.source);
+				if (module.binary)
+					files.insert(module.filename);
+				if (module.source.size() > 4 and module.source.substr(module.source.size()-4) == ".lib") {
+					std::string member = module.filename.substr(0, module.filename.find_last_not_of(std::string(" /\0", 3)) + 1);
+					members.insert(module.source + "(" + member + ")");
+				}
+			}
+		}
+		if (not options.stackAnnotations.empty())
+			files.insert(options.stackAnnotations);
+
+		auto escape = [](std::string path) {
+			for (size_t i = path.find(' '); i != std::string::npos; i = path.find(' ', i+2))
+				path.insert(i, "\\");
+			return path;
+		};
+
+		std::ostringstream off;
+		off << escape(options.romName) << ":";
+		for (auto &file : files)
+			off << " " << escape(file);
+		off << std::endl;
+		off << "# members:";
+		for (auto &member : members)
+			off << " " << member;
+		off << std::endl;
+		off << "# modules:";
+		for (auto &name : names)
+			off << " " << name;
+		off << std::endl;
+		off << "# fingerprint: " << std::hex << fingerprint(options, modules, names, read) << std::dec << std::endl;
+		output.files[options.dependencyFile] = off.str();
+	}
+
+	// PAGE ALLOCATION AND ERROR CHECKING
+	{
+		// A pinned module owns its page: no other module can be requested there.
+		std::vector<std::string> pagePin(4);
+		for (auto &pm : pinnedModules) {
+			if (modules.count(pm.first)==0) continue;
+			pagePin[pm.second] = pm.first;
+			for (auto &m : modules[pm.first])
+				m.page = pm.second;
+		}
+
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &sym : module.symbols) {
+					if (not sym.isSegmentSymbol()) continue;
+					
+					std::string requiredModule = sym.getSegmentName(); 
+					int requiredPage = sym.getSegmentPage();
+					
+					if (not pagePin[requiredPage].empty() and pagePin[requiredPage] != requiredModule)
+						throw std::runtime_error("Module " + module.name + " requests " + requiredModule + " in page " + std::string(1, 'A' + requiredPage) + ", which is pinned by " + pagePin[requiredPage]);
+
+					for (auto &m : modules[requiredModule]) {
+						if (m.page == -1)
+							m.page = requiredPage;
+					
+						if (m.page != requiredPage)
+							throw std::runtime_error("Module " + requiredModule + " required at different pages");
+					}
+				}
+			}
+		}
+
+		// Stream chunks are loaded by the header through the address of their page, which would evict a pinned module.
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &sym : module.symbols) {
+					if (sym.type != Module::Symbol::REF) continue;
+					for (int page=0; page<4; page++)
+						if (sym.name == "___ML_CONFIG_STREAM_PAGE_" + std::string(1, 'A' + page) and not pagePin[page].empty())
+							throw std::runtime_error("Module " + module.name + " loads stream chunks in page " + std::string(1, 'A' + page) + ", which is pinned by " + pagePin[page]);
+				}
+			}
+		}
+	}
+	
+	std::map<std::string, uint32_t> megalinkerSymbols;
+	// FIND ALL MEGALINKER DEFINED CONFIGURATION SYMBOLS
+	{
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &sym : module.symbols) {
+					if (sym.type != Module::Symbol::DEF) continue;
+					if (not sym.isConfigurationSymbol()) continue;
+										
+					if (megalinkerSymbols.count(sym.name) and megalinkerSymbols[sym.name] != sym.addr)
+						throw std::runtime_error("Conflicting definitions of: " + sym.name );
+						
+					megalinkerSymbols[sym.name] = sym.addr;
+				}
+			}
+		}
+
+		for (int page=0; page<4; page++)
+			megalinkerSymbols["___ML_CONFIG_STREAM_PAGE_" + std::string(1, 'A' + page)] = 0x4000 + 0x2000*page;
+	}
+	
+	// ELIMINATE DEAD CODE
+	// The _CODE area of each module is split at its global symbols. The ranges that are not reachable from the
+	// other areas, or from the code kept in other modules, are removed. Ranges are also reached by falling through
+	// from the previous range, and by the relative branches that land in them or jump over them.
+	std::vector<std::tuple<std::string, std::string, uint32_t>> deadRanges; // module, first symbol, size
+	if (options.gc) {
+
+		struct Range {
+			uint32_t begin, end;
+			std::vector<std::string> symbols, refs;
+			std::vector<uint32_t> locals;
+			bool live = false;
+		};
+		std::map<std::pair<std::string, uint32_t>, std::vector<Range>> moduleRanges;
+		std::map<std::string, std::tuple<std::string, uint32_t, uint32_t>> symbolRange; // symbol -> (module, part, range)
+		std::vector<std::string> rootSymbols;
+		std::vector<std::tuple<std::string, uint32_t, uint32_t>> pending;
+
+		for (auto &mp : modules) {
+			for (uint32_t part=0; part<mp.second.size(); part++) {
+				Module &module = mp.second[part];
+
+				uint32_t code = module.areas.size();
+				for (uint32_t i=0; i<module.areas.size(); i++)
+					if (module.areas[i].name == "_CODE")
+						code = i;
+
+				// Modules that are kept whole make roots of all the symbols they refer to.
+				if (module.binary or module.has_cabs_areas or moduleAlignment.count(mp.first) or code == module.areas.size() or module.areas[code].size == 0) {
+					if (module.binary) {
+						for (auto &sym : module.symbols)
+							if (sym.type == Module::Symbol::REF)
+								rootSymbols.push_back(sym.name);
+					} else {
+						for (auto &r : scanRelocations(module))
+							if (r.flags & R3_SYM)
+								rootSymbols.push_back(module.symbols[r.index].name);
+					}
+					continue;
+				}
+
+				uint32_t size = module.areas[code].size;
+				std::set<uint32_t> boundSet = { 0, size };
+				for (auto &sym : module.symbols)
+					if (sym.type == Module::Symbol::DEF and sym.areaName == "_CODE" and sym.addr < size)
+						boundSet.insert(sym.addr);
+				std::vector<uint32_t> bounds(boundSet.begin(), boundSet.end());
+				auto rangeOf = [&](uint32_t offset) { return uint32_t(std::upper_bound(bounds.begin(), bounds.end(), offset) - bounds.begin() - 1); };
+
+				auto &ranges = moduleRanges[{mp.first, part}];
+				for (uint32_t i=0; i+1<bounds.size(); i++)
+					ranges.push_back({bounds[i], bounds[i+1], {}, {}, {}});
+
+				for (auto &sym : module.symbols) {
+					if (sym.type != Module::Symbol::DEF or sym.areaName != "_CODE" or sym.addr >= size) continue;
+					symbolRange[sym.name] = std::make_tuple(mp.first, part, rangeOf(sym.addr));
+					ranges[rangeOf(sym.addr)].symbols.push_back(sym.name);
+				}
+
+				// Code before the first global symbol can only be reached through local labels, it is always kept.
+				if (ranges.front().symbols.empty())
+					pending.emplace_back(mp.first, part, 0);
+
+				// Relative branches have no relocation: the ranges they reach or jump over are kept with the range
+				// of the branch, so that its offset still holds. A range that may fall through keeps the next one.
+				std::string image = readAreaImages(module)[code];
+				for (uint32_t i=0; i<ranges.size(); i++) {
+					std::vector<int32_t> targets;
+					if (not decodeCodeRange(image, ranges[i].begin, ranges[i].end, targets) and i+1<ranges.size())
+						ranges[i].locals.push_back(i+1);
+					for (int32_t target : targets) {
+						if (target < 0 or target >= int32_t(size)) continue;
+						uint32_t t = rangeOf(target);
+						for (uint32_t j=std::min(i, t); j<=std::max(i, t); j++)
+							if (j != i)
+								ranges[i].locals.push_back(j);
+					}
+				}
+
+				for (auto &r : scanRelocations(module)) {
+					bool fromCode = r.area == code and r.offset < size;
+					if (r.flags & R3_SYM) {
+						if (fromCode)
+							ranges[rangeOf(r.offset)].refs.push_back(module.symbols[r.index].name);
+						else
+							rootSymbols.push_back(module.symbols[r.index].name);
+					} else if (r.index == code and r.value < size) {
+						if (fromCode)
+							ranges[rangeOf(r.offset)].locals.push_back(rangeOf(r.value));
+						else
+							pending.emplace_back(mp.first, part, rangeOf(r.value));
+					}
+				}
+			}
+		}
+
+		for (auto &name : rootSymbols)
+			if (symbolRange.count(name))
+				pending.push_back(symbolRange[name]);
+
+		while (not pending.empty()) {
+			auto [name, part, i] = pending.back();
+			pending.pop_back();
+
+			Range &range = moduleRanges[{name, part}][i];
+			if (range.live) continue;
+			range.live = true;
+
+			for (auto &ref : range.refs)
+				if (symbolRange.count(ref))
+					pending.push_back(symbolRange[ref]);
+			for (auto &local : range.locals)
+				pending.emplace_back(name, part, local);
+		}
+
+		uint32_t removed = 0;
+		for (auto &mr : moduleRanges) {
+			Module &module = modules[mr.first.first][mr.first.second];
+			for (auto &range : mr.second) {
+				if (range.live) continue;
+
+				module.folds.push_back({range.begin, range.end - range.begin, "", "", 0, 0});
+				for (auto &area : module.areas)
+					if (area.name == "_CODE")
+						area.size -= range.end - range.begin;
+
+				deadRanges.emplace_back(module.name, range.symbols.empty() ? "" : range.symbols.front(), range.end - range.begin);
+				removed += range.end - range.begin;
+			}
+		}
+		Log(1) << "Dead code: " << deadRanges.size() << " ranges removed, " << removed << " bytes";
+	}
+
+	// FOLD IDENTICAL CODE RANGES
+	// Identical relocation free ranges of _CODE are kept once. If all copies are requested in the same page,
+	// each segment keeps one copy, chosen while allocating the bankable code. Otherwise, the copy is moved to _HOME.
+	struct FoldGroup {
+		uint32_t size;
+		std::vector<std::tuple<std::string, uint32_t, uint32_t>> members; // module, part, offset
+		bool home = false;
+		uint32_t copies = 0;
+	};
+	std::vector<FoldGroup> foldGroups;
+	std::map<std::pair<std::string, uint32_t>, std::vector<std::pair<uint32_t, uint32_t>>> foldableRanges; // (module, part) -> (group, offset)
+	if (options.fold) {
+
+		std::map<std::string, FoldGroup> groups;
+		for (auto &mp : modules) {
+			if (moduleAlignment.count(mp.first)) continue;
+			for (uint32_t part=0; part<mp.second.size(); part++) {
+				for (auto &range : findFoldableRanges(mp.second[part])) {
+					if (findFold(mp.second[part], range.first)) continue;
+					groups[range.second].size = range.second.size();
+					groups[range.second].members.emplace_back(mp.first, part, range.first);
+				}
+			}
+		}
+
+		std::string home;
+		for (auto &gp : groups) {
+			FoldGroup &group = gp.second;
+			if (group.members.size() < 2) continue;
+
+			std::set<int> pages;
+			for (auto &[name, part, offset] : group.members)
+				pages.insert(modules[name][part].page);
+
+			group.home = pages.size() > 1;
+			for (auto &[name, part, offset] : group.members) {
+				if (group.home) {
+					Module &module = modules[name][part];
+					module.folds.push_back({offset, group.size, "___ML_FOLDED", "_HOME", 0, uint32_t(home.size())});
+					for (auto &area : module.areas)
+						if (area.name == "_CODE")
+							area.size -= group.size;
+				} else {
+					foldableRanges[{name, part}].emplace_back(foldGroups.size(), offset);
+				}
+			}
+			if (group.home) {
+				home += gp.first;
+				group.copies = 1;
+			}
+			foldGroups.push_back(group);
+		}
+
+		if (not home.empty()) {
+			Module module;
+			module.filename = "(folded ranges)";
+			module.name = "___ML_FOLDED";
+			module.version = 2;
+			module.areas.push_back({"_HOME", uint32_t(home.size()), 0, 0, Module::Area::RELATIVE});
+			module.binary = true;
+			module.content = home;
+			module.enabled = true;
+			modules[module.name].push_back(module);
+		}
+		Log(1) << "Folding: " << foldGroups.size() << " groups of identical ranges, " << home.size() << " bytes moved to _HOME";
+	}
+
+	uint32_t rom_ptr = -1;
+	uint32_t ram_ptr = -1;
+	std::map<std::string, uint32_t> alignmentLost;
+	if (megalinkerSymbols.count("___ML_CONFIG_RAM_START")==0) throw std::runtime_error("___ML_CONFIG_RAM_START not defined");
+	ram_ptr = megalinkerSymbols["___ML_CONFIG_RAM_START"];
+	
+	// ALLOCATE ALL NON BANKABLE AREAS
+	{
+
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &area:  module.areas) {
+					if (area.name!="_HEADER0") continue;
+					if (rom_ptr!=uint32_t(-1)) throw std::runtime_error(area.name + " defined more than once: " + module.filename);
+					if (area.type != Module::Area::ABSOLUTE) throw std::runtime_error(area.name + " not absolute: " + module.filename);
+					if (area.addr != 0x4000) throw std::runtime_error("HEADER not at 0x4000: " + module.filename);
+		
+					rom_ptr = area.addr;
+					area.rom_addr = area.addr;
+					rom_ptr += area.size;
+				}
+			}
+		}
+		
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &area:  module.areas) {
+					if (area.name!="_GSINIT") continue;
+					if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
+
+					area.addr = rom_ptr;
+					area.rom_addr = area.addr;
+					rom_ptr += area.size;
+				}
+			}
+		}
+
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &area:  module.areas) {
+					if (area.name!="_GSFINAL") continue;
+					if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
+
+					area.addr = rom_ptr;
+					area.rom_addr = area.addr;
+					rom_ptr += area.size;
+				}
+			}
+		}
+
+		// With ___ML_INIT_CHUNKS, _HOME and _INITIALIZER are laid out from 0, and are moved to banked segments once these are allocated.
+		uint32_t init_ptr = spillInit ? 0 : rom_ptr;
+		megalinkerSymbols["___ML_CONFIG_INIT_ROM_START"] = init_ptr;
+		megalinkerSymbols["___ML_CONFIG_INIT_RAM_START"] = ram_ptr;
+
+		// _HOME areas are aligned in RAM, where they run. In ROM they keep the same offsets, so a single copy initializes them.
+		{
+			std::vector<Module::Area *> areas;
+			std::vector<std::pair<uint32_t, uint32_t>> layout;
+			for (auto &mp : modules) {
+				for (auto &module : mp.second) {
+					for (auto &area:  module.areas) {
+						if (area.name!="_HOME") continue;
+						if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
+
+						areas.push_back(&area);
+						layout.emplace_back(area.size, area.size and moduleAlignment.count(mp.first) ? moduleAlignment[mp.first] : 1);
+					}
+				}
+			}
+
+			uint32_t ram_start = ram_ptr;
+			auto addr = layoutAreas(layout, ram_ptr, alignmentLost["HOME"]);
+			for (size_t i=0; i<areas.size(); i++) {
+				areas[i]->addr = addr[i];
+				areas[i]->rom_addr = init_ptr + addr[i] - ram_start;
+			}
+			init_ptr += ram_ptr - ram_start;
+		}
+
+
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &area:  module.areas) {
+					if (area.name!="_INITIALIZER") continue;
+					if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
+
+					area.addr = init_ptr;
+					area.rom_addr = area.addr;
+					init_ptr += area.size;
+				}
+			}
+		}
+		megalinkerSymbols["___ML_CONFIG_INIT_SIZE"] = init_ptr - megalinkerSymbols["___ML_CONFIG_INIT_ROM_START"];
+
+		if (not spillInit) {
+			rom_ptr = init_ptr;
+		} else {
+			// Chunks end before the area that would cross their 8KB, so each area is kept whole in a single segment.
+			std::vector<Module::Area *> payload;
+			for (auto &mp : modules)
+				for (auto &module : mp.second)
+					for (auto &area:  module.areas)
+						if (area.size and (area.name=="_HOME" or area.name=="_INITIALIZER"))
+							payload.push_back(&area);
+			std::sort(payload.begin(), payload.end(), [](const Module::Area *a, const Module::Area *b) { return a->rom_addr < b->rom_addr; });
+
+			initChunks.push_back({0, 0, 0, 0});
+			for (auto *area : payload) {
+				if (area->size > 0x2000) throw std::runtime_error(area->name + " area of " + std::to_string(area->size) + " bytes does not fit a segment, it can not be copied through ___ML_INIT_CHUNKS");
+				while (area->rom_addr + area->size > initChunks.back().start + 0x2000)
+					initChunks.push_back({std::min(area->rom_addr, initChunks.back().start + 0x2000), 0, 0, 0});
+			}
+			for (size_t k=0; k<initChunks.size(); k++)
+				initChunks[k].size = (k+1 < initChunks.size() ? initChunks[k+1].start : init_ptr) - initChunks[k].start;
+			initChunks.erase(std::remove_if(initChunks.begin(), initChunks.end(), [](const InitChunk &chunk) { return chunk.size == 0; }), initChunks.end());
+			if (initChunks.size() > 255) throw std::runtime_error("Too many ___ML_INIT_CHUNKS");
+
+			// The table is read by the crt before _HOME is copied, so it stays in the header, after _GSFINAL.
+			for (auto &module : modules["___ML_INIT_CHUNKS"]) {
+				for (auto &area : module.areas) {
+					area.size = 1 + initChunks.size() * (segmentBytes + 4);
+					area.addr = rom_ptr;
+					area.rom_addr = area.addr;
+					rom_ptr += area.size;
+				}
+			}
+
+			// The crt maps each chunk in page D, which can not hold the header.
+			if (rom_ptr > 0xA000) throw std::runtime_error("The header reaches page D, through which the crt copies the ___ML_INIT_CHUNKS");
+			Log(1) << "Boot data: " << megalinkerSymbols["___ML_CONFIG_INIT_SIZE"] << " bytes in " << initChunks.size() << " chunks";
+		}
+
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				for (auto &area:  module.areas) {
+					if (area.name!="_INITIALIZED") continue;
+					if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
+
+					area.addr = ram_ptr;
+					area.rom_addr = uint32_t(-1);
+					ram_ptr += area.size;
+				}
+			}
+		}
+
+		// Places the RAM areas of the given modules from ptr.
+		auto layoutRam = [&](const std::set<std::string> &areaNames, const std::vector<std::string> &names, uint32_t &ptr, uint32_t &lost) {
+
+			std::vector<Module::Area *> areas;
+			std::vector<std::pair<uint32_t, uint32_t>> layout;
+			for (auto &name : names) {
+				for (auto &module : modules[name]) {
+					for (auto &area:  module.areas) {
+						if (areaNames.count(area.name)==0) continue;
+						if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
+
+						areas.push_back(&area);
+						layout.emplace_back(area.size, area.size and moduleAlignment.count(name) ? moduleAlignment[name] : 1);
+					}
+				}
+			}
+
+			auto addr = layoutAreas(layout, ptr, lost);
+			for (size_t i=0; i<areas.size(); i++) {
+				areas[i]->addr = addr[i];
+				areas[i]->rom_addr = uint32_t(-1);
+			}
+		};
+
+		std::vector<std::string> ramModules;
+		for (auto &mp : modules)
+			if (moduleOverlay.count(mp.first)==0)
+				ramModules.push_back(mp.first);
+
+		layoutRam({"_DATA"}, ramModules, ram_ptr, alignmentLost["DATA"]);
+		layoutRam({"_XDATA"}, ramModules, ram_ptr, alignmentLost["XDATA"]);
+
+		// Modules of different overlay groups are never live at the same time, so every group starts at the same base.
+		uint32_t overlay_base = ram_ptr;
+		for (auto &og : overlayGroups) {
+			std::vector<std::string> names;
+			for (auto &name : og.second)
+				if (modules.count(name))
+					names.push_back(name);
+
+			uint32_t group_ptr = overlay_base;
+			layoutRam({"_DATA", "_XDATA"}, names, group_ptr, alignmentLost["OVERLAY " + og.first]);
+			Log(2) << "Overlay group: " << og.first << " uses " << (group_ptr - overlay_base) << " bytes of RAM";
+			ram_ptr = std::max(ram_ptr, group_ptr);
+		}
+
+		megalinkerSymbols["___ML_CONFIG_INIT_RAM_END"] = ram_ptr;
+		megalinkerSymbols["___ML_CONFIG_INIT_RAM_SIZE"] = ram_ptr - megalinkerSymbols["___ML_CONFIG_INIT_RAM_START"];
+	}
+
+	// ALLOCATE BANKED RAM AREAS
+	// The _XDATA_BANKED areas of each module are packed in 16KB segments of the memory mapper, mapped at 0x8000 when used.
+	std::map<std::string, uint32_t> ramSegments;
+	{
+		std::vector<uint32_t> ramSegmentsFree;
+		uint32_t first = megalinkerSymbols.count("___ML_CONFIG_RAM_SEGMENT_FIRST") ? megalinkerSymbols["___ML_CONFIG_RAM_SEGMENT_FIRST"] : 4;
+		uint32_t count = megalinkerSymbols.count("___ML_CONFIG_RAM_SEGMENTS") ? megalinkerSymbols["___ML_CONFIG_RAM_SEGMENTS"] : 4;
+
+		std::vector<std::pair<uint32_t,std::string>> bankedModules;
+		for (auto &mp : modules) {
+			uint32_t size = 0;
+			for (auto &module : mp.second) {
+				for (auto &area:  module.areas) {
+					if (area.name!="_XDATA_BANKED") continue;
+					if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
+					size += area.size;
+				}
+			}
+			if (size==0) continue;
+			if (size>0x4000) throw std::runtime_error("Module " + mp.first + " banked RAM too large to fit a segment");
+			bankedModules.emplace_back(size, mp.first);
+		}
+		std::sort(bankedModules.begin(), bankedModules.end());
+		std::reverse(bankedModules.begin(), bankedModules.end());
+
+		for (auto& [size, name]: bankedModules) {
+
+			uint32_t i;
+			for (i=0; i<ramSegmentsFree.size() and ramSegmentsFree[i]<size; i++);
+			if (i==ramSegmentsFree.size())
+				ramSegmentsFree.push_back(0x4000);
+			if (i>=count) throw std::runtime_error("Banked RAM does not fit in " + std::to_string(count) + " segments (___ML_CONFIG_RAM_SEGMENTS)");
+
+			ramSegments[name] = first + i;
+			for (auto &module : modules[name]) {
+				for (auto &area:  module.areas) {
+					if (area.name!="_XDATA_BANKED") continue;
+
+					area.addr = 0x8000 + 0x4000 - ramSegmentsFree[i];
+					area.rom_addr = uint32_t(-1);
+					ramSegmentsFree[i] -= area.size;
+
+					Log(2) << "Module: " << module.name << " banked RAM at: 0x" << std::hex << area.addr << std::dec << " (" << area.size << " bytes) in RAM segment " << first + i;
+				}
+			}
+		}
+
+		// The RAM window replaces pages C and D of the ROM.
+		std::map<std::string, std::string> bankedSymbols;
+		for (auto &mp : modules)
+			for (auto &module : mp.second)
+				for (auto &sym : module.symbols)
+					if (sym.type == Module::Symbol::DEF and sym.areaName == "_XDATA_BANKED")
+						bankedSymbols[sym.name] = mp.first;
+
+		for (auto &mp : modules)
+			for (auto &module : mp.second)
+				for (auto &sym : module.symbols)
+					if (sym.type == Module::Symbol::REF and bankedSymbols.count(sym.name) and module.page >= 2)
+						Log(3) << "Warning: Module " << module.name << " in page " << char('A' + module.page) << " uses banked RAM symbol " << sym.name << ", but its page is not available while the RAM window is enabled";
+	}
+
+	// CHECK OVERLAY GROUPS
+	std::vector<std::string> overlayReport;
+	{
+		struct RamRange { uint32_t begin, end; std::string module, area, group; };
+		std::vector<RamRange> ranges;
+		for (auto &mp : modules) {
+			std::string group = moduleOverlay.count(mp.first) ? moduleOverlay[mp.first] : "";
+			for (auto &module : mp.second) {
+				for (auto &area:  module.areas) {
+					if (area.size==0) continue;
+					if (area.name!="_HOME" and area.name!="_INITIALIZED" and area.name!="_DATA" and area.name!="_XDATA") continue;
+					ranges.push_back({area.addr, area.addr + area.size, module.name, area.name, group});
+				}
+			}
+		}
+		std::sort(ranges.begin(), ranges.end(), [](const RamRange &a, const RamRange &b) { return a.begin < b.begin; });
+
+		// Only areas from different overlay groups are allowed to share addresses.
+		for (size_t i=0; i<ranges.size(); i++) {
+			for (size_t j=i+1; j<ranges.size() and ranges[j].begin < ranges[i].end; j++) {
+				if (not ranges[i].group.empty() and not ranges[j].group.empty() and ranges[i].group != ranges[j].group) continue;
+				throw std::runtime_error("RAM areas overlap: " + ranges[i].module + ":" + ranges[i].area + " and " + ranges[j].module + ":" + ranges[j].area);
+			}
+		}
+
+		std::map<std::string, std::string> overlaySymbolGroup;
+		for (auto &mp : modules) {
+			if (moduleOverlay.count(mp.first)==0) continue;
+			for (auto &module : mp.second)
+				for (auto &sym : module.symbols)
+					if (sym.type == Module::Symbol::DEF and (sym.areaName=="_DATA" or sym.areaName=="_XDATA"))
+						overlaySymbolGroup[sym.name] = moduleOverlay[mp.first];
+		}
+
+		// A module that belongs to an overlay group can not use the RAM of another group: it is not live at the same time.
+		for (auto &mp : modules) {
+			if (moduleOverlay.count(mp.first)==0) continue;
+			for (auto &module : mp.second) {
+				for (auto &sym : module.symbols) {
+					if (sym.type != Module::Symbol::REF) continue;
+					if (overlaySymbolGroup.count(sym.name)==0) continue;
+					if (overlaySymbolGroup[sym.name] == moduleOverlay[mp.first]) continue;
+
+					overlayReport.push_back("Module " + module.name + " (group " + moduleOverlay[mp.first] + ") references " + sym.name + " (group " + overlaySymbolGroup[sym.name] + ")");
+					Log(3) << "Warning: " << overlayReport.back();
+				}
+			}
+		}
+	}
+
+	// ALLOCATE BANKABLE CODE AREAS
+	{	
+		std::vector<std::pair<uint32_t,std::string>> bankableModules;
+		
+		for (auto &mp : modules) {
+			bankableModules.emplace_back(0,mp.first);
+			for (auto &module : mp.second) {
+
+				for (auto &area:  module.areas) {
+					if (area.name.substr(0,5)!="_CABS") continue;
+					if (area.size==0) continue;
+					if (module.page<0) throw std::runtime_error(module.name + " used but not allocated a page");
+					if (area.type != Module::Area::ABSOLUTE) throw std::runtime_error(area.name + " not absolute CABS section in: " + module.filename);
+					
+					if (bankableModules.back().first > (area.addr % 0x2000)) 
+						throw std::runtime_error("Overlapping CABS sections in: " + module.filename);
+					
+					bankableModules.back().first = (area.addr % 0x2000) + area.size;
+				}
+
+
+				for (auto &area:  module.areas) {
+					if (area.name!="_CODE") continue;
+					if (area.size==0) continue;
+					if (module.page<0) throw std::runtime_error(module.name + " used but not allocated a page");
+					if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
+					
+					if (moduleAlignment.count(mp.first))
+						bankableModules.back().first = alignUp(bankableModules.back().first, moduleAlignment[mp.first]);
+					bankableModules.back().first += area.size;
+				}
+
+				
+				// If we have CABS areas we reserve an entire segment.
+				if (module.has_cabs_areas)
+					bankableModules.back().first = std::max(bankableModules.back().first, 0x2000U);
+			}		
+			if (bankableModules.back().first>0x2000) throw std::runtime_error("Module " + mp.first + " too large to fit a segment");
+		}
+		
+		std::sort(bankableModules.begin(), bankableModules.end());
+		std::reverse(bankableModules.begin(), bankableModules.end());
+
+		// Aligned modules are placed first, from the largest alignment, as they fit best at the start of empty segments.
+		auto alignmentOf = [&](const std::string &name) { return moduleAlignment.count(name) ? moduleAlignment[name] : 1; };
+		std::stable_sort(bankableModules.begin(), bankableModules.end(), [&](const std::pair<uint32_t,std::string> &a, const std::pair<uint32_t,std::string> &b) {
+			return alignmentOf(a.second) > alignmentOf(b.second);
+		});
+
+		std::vector<uint32_t> segments;
+		for (uint32_t end = 0x6000; end <= 0xC000 and (segments.empty() or segments.back()==0); end += 0x2000)
+			segments.push_back(rom_ptr < end ? std::min<uint32_t>(0x2000, end - rom_ptr) : 0);
+		if (segments.back()==0) throw std::runtime_error("Header too large");
+
+		// Copies of folded ranges kept by each segment: (segment, group) -> (module, part, offset).
+		std::map<std::pair<uint32_t, uint32_t>, std::tuple<std::string, uint32_t, uint32_t>> segmentCopies;
+
+		// Bytes taken by a module in segment i, including the padding required by its alignment,
+		// and excluding the folded ranges whose copy is already in the segment.
+		auto required = [&](const std::string &name, uint32_t size, uint32_t i) {
+			if (moduleAlignment.count(name)==0) {
+				for (uint32_t part=0; part<modules[name].size(); part++)
+					for (auto &[group, offset] : foldableRanges[{name, part}])
+						if (segmentCopies.count({i, group}))
+							size -= foldGroups[group].size;
+				return size;
+			}
+			uint32_t offset = 0x2000 - segments[i];
+			for (auto &module : modules[name])
+				for (auto &area:  module.areas)
+					if (area.name == "_CODE" and area.size)
+						offset = alignUp(offset, moduleAlignment[name]) + area.size;
+			return offset - (0x2000 - segments[i]);
+		};
+
+		auto allocate = [&](const std::string &name, uint32_t i) {
+			for (uint32_t part=0; part<modules[name].size(); part++) {
+				Module &module = modules[name][part];
+				module.segment = i;
+
+				for (auto &[group, offset] : foldableRanges[{name, part}]) {
+					if (segmentCopies.count({i, group})) {
+						auto &[copyName, copyPart, copyOffset] = segmentCopies[{i, group}];
+						module.folds.push_back({offset, foldGroups[group].size, copyName, "_CODE", copyPart, copyOffset});
+						for (auto &area : module.areas)
+							if (area.name == "_CODE")
+								area.size -= foldGroups[group].size;
+					} else {
+						segmentCopies[{i, group}] = std::make_tuple(name, part, offset);
+						foldGroups[group].copies++;
+					}
+				}
+			
+				for (auto &area:  module.areas) {
+					if (area.name.substr(0,5)!="_CABS") continue;
+					if (area.size==0) continue;
+
+					for (auto &symbol : module.symbols) {
+						if (symbol.type != Module::Symbol::DEF) continue;
+						if (symbol.areaName != area.name) continue;
+					
+						symbol.addr -= area.addr;
+					}
+						
+
+					//area.addr = 0x2000*(2+module.page) + 0x2000 - segments[i]; 
+				
+					Log(3) << "Addr: " << area.addr << " " << area.size;
+				
+					Log(3) << "Addr check: " << area.addr << " = " << 0x2000*(2+module.page)+(area.addr % 0x2000);
+				
+					area.rom_addr = 0x2000*(2+i) + (area.addr % 0x2000);
+
+					segments[i] = 0x2000 - (area.addr % 0x2000) - area.size;
+
+					Log(2) << "Module: " << module.name << " addressed at: 0x" << std::hex << area.addr << std::dec << " (" << area.size << " bytes) in page: " << module.page << " and segment " << module.segment;
+				}
+			
+				for (auto &area:  module.areas) {
+					if (area.name != "_CODE") continue;
+
+					if (area.size and moduleAlignment.count(name)) {
+						uint32_t offset = 0x2000 - segments[i];
+						uint32_t padding = alignUp(offset, moduleAlignment[name]) - offset;
+						segments[i] -= padding;
+						alignmentLost["CODE"] += padding;
+					}
+
+					area.addr = 0x2000*(2+module.page) + 0x2000 - segments[i]; 
+					area.rom_addr = 0x2000*(2+i) + 0x2000 - segments[i];
+
+					segments[i] -= area.size;
+
+					Log(2) << "Module: " << module.name << " addressed at: 0x" << std::hex << area.addr << std::dec << " (" << area.size << " bytes) in page: " << module.page << " and segment " << module.segment;
+				}
+			}
+		};
+
+		// The header is executed from the segments mapped at boot, which must not be moved.
+		for (uint32_t page=0; page<4; page++) {
+			std::string bootSymbol = "___ML_CONFIG_BOOT_SEGMENT_" + std::string(1, 'A' + page);
+			if (megalinkerSymbols.count(bootSymbol)==0) continue;
+			if (rom_ptr > 0x4000 + 0x2000*page and megalinkerSymbols[bootSymbol] != page)
+				throw std::runtime_error(bootSymbol + " must be " + std::to_string(page) + ", the header spans that page");
+		}
+
+		// Pinned modules are placed in the segment mapped at boot in their page.
+		for (auto &pm : pinnedModules) {
+			if (modules.count(pm.first)==0) continue;
+
+			std::string bootSymbol = "___ML_CONFIG_BOOT_SEGMENT_" + std::string(1, 'A' + pm.second);
+			uint32_t i = megalinkerSymbols.count(bootSymbol) ? megalinkerSymbols[bootSymbol] : pm.second;
+			while (segments.size() <= i)
+				segments.push_back(0x2000);
+
+			uint32_t size = 0;
+			for (auto &bm : bankableModules)
+				if (bm.second == pm.first)
+					size = bm.first;
+			if (segments[i] < required(pm.first, size, i)) throw std::runtime_error("Pinned module " + pm.first + " does not fit in boot segment " + std::to_string(i));
+
+			allocate(pm.first, i);
+		}
+
+		// The chunks of a stream are placed in consecutive empty segments, so it can be read by incrementing the segment.
+		std::set<std::string> streamChunks;
+		for (auto &st : streams) {
+			if (modules.count(st.first)==0) continue;
+
+			uint32_t first = 0;
+			for (uint32_t k=0; k<st.second.size(); k++) {
+				if (first+k < segments.size() and segments[first+k] != 0x2000) {
+					first += k+1;
+					k = -1;
+				}
+			}
+
+			while (segments.size() < first + st.second.size())
+				segments.push_back(0x2000);
+
+			for (uint32_t k=0; k<st.second.size(); k++) {
+				allocate(st.second[k], first+k);
+				streamChunks.insert(st.second[k]);
+			}
+			Log(2) << "Stream: " << st.first << " placed in segments " << first << " to " << first + st.second.size() - 1;
+		}
+
+		FirstFit fit;
+		for (uint32_t i=0; i<segments.size(); i++)
+			fit.set(i, segments[i]);
+
+		// With a previous layout, the modules are first kept in their previous segments, in their previous order, if they still fit.
+		// Only the modules that grew too much, or are new, are placed by first fit afterwards.
+		std::set<std::string> kept;
+		if (not options.previousRom.empty()) {
+
+			std::vector<std::pair<std::string, uint32_t>> previousSegments;
+			try {
+				std::istringstream isl(read(options.previousRom + ".layout"));
+				std::string name;
+				uint32_t segment;
+				while (isl >> name >> segment)
+					previousSegments.emplace_back(name, segment);
+			} catch (std::runtime_error &) {
+				Log(1) << "No previous layout for " << options.previousRom << ", the modules are placed by first fit";
+			}
+
+			std::map<std::string, uint32_t> sizes;
+			for (auto& [size, name]: bankableModules)
+				sizes[name] = size;
+
+			for (auto& [name, i]: previousSegments) {
+
+				if (sizes.count(name)==0 or pinnedModules.count(name) or streamChunks.count(name)) continue;
+				uint32_t size = sizes[name];
+
+				while (segments.size() <= i) {
+					fit.set(segments.size(), 0x2000);
+					segments.push_back(0x2000);
+				}
+				if (segments[i] < required(name, size, i)) continue;
+
+				allocate(name, i);
+				fit.set(i, segments[i]);
+				kept.insert(name);
+			}
+			Log(1) << "Layout: " << kept.size() << " of " << previousSegments.size() << " modules kept in their previous segments";
+		}
+
+		for (auto& [size, name]: bankableModules) {
+			
+			if (pinnedModules.count(name) or streamChunks.count(name) or kept.count(name)) continue;
+
+			// No segment with less free bytes than the module, once all its foldable ranges are removed, can hold it.
+			uint32_t least = size;
+			for (uint32_t part=0; part<modules[name].size(); part++)
+				for (auto &[group, offset] : foldableRanges[{name, part}])
+					least -= foldGroups[group].size;
+
+			uint32_t i;
+			for (i=fit.find(0, least); i!=uint32_t(-1) and segments[i]<required(name, size, i); i=fit.find(i+1, least));
+			if (i==uint32_t(-1)) {
+				i = segments.size();
+				segments.push_back(0x2000);
+			}
+
+			allocate(name, i);
+			fit.set(i, segments[i]);
+		}
+
+		// The boot data chunks take the space left by the modules, or new segments.
+		for (auto &chunk : initChunks) {
+			uint32_t i = fit.find(0, chunk.size);
+			if (i==uint32_t(-1)) {
+				i = segments.size();
+				segments.push_back(0x2000);
+			}
+			chunk.segment = i;
+			chunk.offset = 0x2000 - segments[i];
+			segments[i] -= chunk.size;
+			fit.set(i, segments[i]);
+		}
+
+		// _HOME and _INITIALIZER are moved to their chunks. _INITIALIZER is addressed in page D, where the crt reads it.
+		if (spillInit) {
+			for (auto &mp : modules) {
+				for (auto &module : mp.second) {
+					for (auto &area:  module.areas) {
+						if (area.size==0 or (area.name!="_HOME" and area.name!="_INITIALIZER")) continue;
+
+						auto chunk = std::prev(std::upper_bound(initChunks.begin(), initChunks.end(), area.rom_addr, [](uint32_t addr, const InitChunk &c) { return addr < c.start; }));
+						uint32_t offset = chunk->offset + area.rom_addr - chunk->start;
+						if (area.name=="_INITIALIZER")
+							area.addr = 0xA000 + offset;
+						area.rom_addr = 0x2000*(2+chunk->segment) + offset;
+					}
+				}
+			}
+
+			for (auto &module : modules["___ML_INIT_CHUNKS"]) {
+				module.generate = [initChunks, segmentBytes](const Module::Resolver &) {
+
+					std::string entry(1, char(initChunks.size()));
+					for (auto &chunk : initChunks) {
+						for (uint32_t j=0; j<segmentBytes; j++)
+							entry += char(chunk.segment >> (8*j));
+						entry += char(chunk.offset & 0xFF);
+						entry += char(chunk.offset >> 8);
+						entry += char(chunk.size & 0xFF);
+						entry += char(chunk.size >> 8);
+					}
+					return entry;
+				};
+			}
+		}
+
+		if (segments.size() > (1U << (8*segmentBytes)))
+			throw std::runtime_error("The ROM needs " + std::to_string(segments.size()) + " segments, more than ___ML_CONFIG_SEGMENT_BITS allows");
+
+		// Disk links load the segments through megalinker_disk.s, the runtime modules that write the mapper directly can not be used.
+		if (options.disk) {
+			if (segmentBytes != 1) throw std::runtime_error("Disk overlays require 8 bit segment numbers (___ML_CONFIG_SEGMENT_BITS)");
+			for (uint32_t page=0; page<4; page++) {
+				std::string bootSymbol = "___ML_CONFIG_BOOT_SEGMENT_" + std::string(1, 'A' + page);
+				if (megalinkerSymbols.count(bootSymbol) and megalinkerSymbols[bootSymbol] != page)
+					throw std::runtime_error("Disk overlays require " + bootSymbol + " to be " + std::to_string(page));
+			}
+			for (std::string name : {"megalinker_far", "megalinker_far_16", "megalinker_set", "megalinker_unpack", "megalinker_unpack_16", "megalinker_ram"})
+				if (modules.count(name))
+					throw std::runtime_error("Module " + name + " writes the mapper directly, it can not be used in a disk overlay");
+		}
+
+		// The layout of this link, read back by a next one with -p: the segment of each module, in ROM order.
+		// It is written by every ROM link, so the first patched link already keeps the layout of the released ROM.
+		if (not options.disk) {
+			std::set<std::tuple<uint32_t, uint32_t, std::string>> layout;
+			for (auto& [size, name]: bankableModules) {
+				uint32_t rom_addr = uint32_t(-1);
+				for (auto &module : modules[name])
+					for (auto &area : module.areas)
+						if (area.size and (area.name=="_CODE" or area.name.substr(0,5)=="_CABS"))
+							rom_addr = std::min(rom_addr, area.rom_addr);
+				layout.emplace(modules[name].front().segment, rom_addr, name);
+			}
+			std::ostringstream off;
+			for (auto &[segment, rom_addr, name] : layout)
+				off << name << " " << segment << std::endl;
+			output.files[options.romName + ".layout"] = off.str();
+		}
+	}
+
+	// Address and ROM address of an offset of the _CODE area of a module, as compiled.
+	// Offsets in a folded range lead to the copy, seen from the page of the module.
+	auto codeLocation = [&](const Module &module, uint32_t offset) -> std::pair<uint32_t, uint32_t> {
+
+		const Module *holder = &module;
+		std::string areaName = "_CODE";
+		if (auto f = findFold(module, offset)) {
+			if (f->module.empty()) throw std::runtime_error("Module " + module.name + " refers to its removed code");
+			holder = &modules[f->module][f->part];
+			areaName = f->area;
+			offset = f->copyOffset + offset - f->offset;
+		}
+		offset = foldedOffset(*holder, offset);
+
+		for (auto &area : holder->areas) {
+			if (area.name != areaName) continue;
+			if (areaName != "_CODE") return {area.addr + offset, area.rom_addr + offset};
+			return {0x2000*(2+module.page) + (area.addr + offset) % 0x2000, area.rom_addr + offset};
+		}
+		throw std::runtime_error("Module " + holder->name + " has no " + areaName + " area");
+	};
+
+	// ALLOCATE INSTRUMENTATION COUNTERS
+	// One 16 bit counter per segment and page, at the end of the RAM as its size depends on the number of segments.
+	{
+		uint32_t nSegments = 0;
+		for (auto &mp : modules)
+			for (auto &module : mp.second)
+				nSegments = std::max<uint32_t>(nSegments, module.segment+1);
+
+		megalinkerSymbols["___ML_CONFIG_INSTRUMENT_COUNTERS"] = ram_ptr;
+		megalinkerSymbols["___ML_CONFIG_INSTRUMENT_SIZE"] = 0;
+
+		if (options.instrument) {
+
+			megalinkerSymbols["___ML_CONFIG_INSTRUMENT_SIZE"] = nSegments * 4 * 2;
+			ram_ptr += nSegments * 4 * 2;
+			megalinkerSymbols["___ML_CONFIG_INIT_RAM_END"] = ram_ptr;
+			megalinkerSymbols["___ML_CONFIG_INIT_RAM_SIZE"] = ram_ptr - megalinkerSymbols["___ML_CONFIG_INIT_RAM_START"];
+
+			std::ostringstream off;
+			off << "INSTRUMENT MAP: counters at 0x" << std::hex << megalinkerSymbols["___ML_CONFIG_INSTRUMENT_COUNTERS"] << std::dec << ", 16 bits each" << std::endl;
+			off << "# SLOT # ADDR # SG # PAGE # MODULES" << std::endl;
+
+			std::vector<std::string> segmentNames(nSegments);
+			for (auto &mp : modules) {
+				for (auto &module : mp.second) {
+					std::string &names = segmentNames[module.segment];
+					if (module.page >= 0 and names.find(" " + module.name + ":") == std::string::npos)
+						names += " " + module.name + ":" + std::string(1, 'A' + module.page);
+				}
+			}
+
+			for (uint32_t i=0; i<nSegments; i++) {
+
+				const std::string &names = segmentNames[i];
+				for (uint32_t page=0; page<4; page++) {
+					char s[200];
+					snprintf(s,199,"# %4u # %04X # %2X #    %c #",i*4+page, megalinkerSymbols["___ML_CONFIG_INSTRUMENT_COUNTERS"] + (i*4+page)*2, i, 'A'+page);
+					off << s << names << std::endl;
+				}
+			}
+
+			output.files[options.romName + ".instrument.map"] = off.str();
+		} else {
+
+			for (auto &mp : modules)
+				for (auto &module : mp.second)
+					for (auto &sym : module.symbols)
+						if (sym.type == Module::Symbol::REF and sym.name == "___ML_CONFIG_INSTRUMENT_COUNTERS")
+							throw std::runtime_error("Module " + module.name + " is instrumented (ML_INSTRUMENT), but the link is not (-i)");
+		}
+	}
+	
+	
+	// Generate area map
+	{
+		std::ostringstream off;
+		off << "AREA MAP: " << std::endl;
+		off << "# SG #  MAP #  ROM  # SIZE #   NAME   #        HEADER        #        PAGE A        #        PAGE B        #        PAGE C        #        PAGE D        #" << std::endl;
+		off << "##########################################################################################################################################################" << std::endl;
+		// Lines of each segment, sorted by address.
+		std::map<int, std::multimap<uint32_t, std::string>> segmentLines;
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				auto &lines = segmentLines[module.segment];
+				for (auto &area:  module.areas) {
+					if (area.size==0) continue;
+						
+					std::ostringstream oss;
+					
+					char s[200];
+					if (area.rom_addr==uint32_t(-1)) {
+						snprintf(s,199,"#%3X # %04X # ----- # %04X # %8.8s #",module.segment, area.addr, area.size, area.name.substr(1).c_str());
+					} else {
+						snprintf(s,199,"#%3X # %04X # %05X # %04X # %8.8s #",module.segment, area.addr, area.rom_addr, area.size, area.name.substr(1).c_str());
+					}
+					oss << s;
+					for (int j=-1; j<module.page; j++) oss << "                      #";
+					snprintf(s,199," %20.20s #",module.name.c_str());
+					oss << s;	
+					for (int j=module.page+1; j<4; j++) oss << "                      #";
+					lines.emplace(area.addr,oss.str());
+					
+				}	
+			}
+		}
+
+		for (auto &sl : segmentLines) {
+			auto &lines = sl.second;
+			for (auto &&s : lines)
+				off << s.second << std::endl;
+			if (not lines.empty()) 
+				off << "##########################################################################################################################################################" << std::endl;
+
+		}
+
+		if (not moduleAlignment.empty()) {
+			off << std::endl << "ALIGNMENT MAP: " << std::endl;
+			off << "# ALIGN #        MODULE        #" << std::endl;
+			for (auto &ma : moduleAlignment) {
+				char s[200];
+				snprintf(s,199,"# %5u # %20.20s #",ma.second, ma.first.c_str());
+				off << s << std::endl;
+			}
+			off << "# LOST  #        REGION        #" << std::endl;
+			for (auto &al : alignmentLost) {
+				char s[200];
+				snprintf(s,199,"# %5u # %20.20s #",al.second, al.first.c_str());
+				off << s << std::endl;
+			}
+		}
+
+		if (not deadRanges.empty()) {
+			off << std::endl << "DEAD CODE MAP: " << std::endl;
+			off << "# SIZE #        MODULE        #        SYMBOL        #" << std::endl;
+			uint32_t removed = 0;
+			for (auto &[name, symbol, size] : deadRanges) {
+				char s[200];
+				snprintf(s,199,"# %04X # %20.20s # %20.20s #", size, name.c_str(), symbol.c_str());
+				off << s << std::endl;
+				removed += size;
+			}
+			off << "Dead code removed " << removed << " bytes of ROM" << std::endl;
+			Log(2) << "Dead code removed " << removed << " bytes of ROM";
+		}
+
+		if (not foldGroups.empty()) {
+			off << std::endl << "FOLDING MAP: " << std::endl;
+			off << "# SIZE # FOUND # KEPT # SAVED #  WHERE  # MODULES" << std::endl;
+			uint32_t saved = 0;
+			for (auto &group : foldGroups) {
+				std::string names;
+				for (auto &[name, part, offset] : group.members)
+					names += " " + name;
+
+				char s[200];
+				snprintf(s,199,"# %04X # %5u # %4u # %5u # %7s #", group.size, uint32_t(group.members.size()), group.copies, (uint32_t(group.members.size()) - group.copies) * group.size, group.home ? "HOME" : "SEGMENT");
+				off << s << names << std::endl;
+				saved += (group.members.size() - group.copies) * group.size;
+			}
+			off << "Folding saved " << saved << " bytes of ROM" << std::endl;
+			Log(2) << "Folding saved " << saved << " bytes of ROM";
+		}
+
+		if (not ramSegments.empty()) {
+			off << std::endl << "BANKED RAM MAP: " << std::endl;
+			off << "# SG # ADDR # SIZE #        MODULE        #" << std::endl;
+			for (auto &rs : ramSegments) {
+				for (auto &module : modules[rs.first]) {
+					for (auto &area:  module.areas) {
+						if (area.name!="_XDATA_BANKED" or area.size==0) continue;
+						char s[200];
+						snprintf(s,199,"#%3X # %04X # %04X # %20.20s #",rs.second, area.addr, area.size, module.name.c_str());
+						off << s << std::endl;
+					}
+				}
+			}
+		}
+
+		if (not overlayGroups.empty()) {
+			off << std::endl << "OVERLAY MAP: " << std::endl;
+			off << "# BASE # SIZE #        GROUP         # MODULES" << std::endl;
+			for (auto &og : overlayGroups) {
+				uint32_t begin = uint32_t(-1), end = 0;
+				std::string names;
+				for (auto &name : og.second) {
+					if (modules.count(name)==0) continue;
+					names += " " + name;
+					for (auto &module : modules[name]) {
+						for (auto &area:  module.areas) {
+							if (area.size==0) continue;
+							if (area.name!="_DATA" and area.name!="_XDATA") continue;
+							begin = std::min(begin, area.addr);
+							end = std::max(end, area.addr + area.size);
+						}
+					}
+				}
+				if (begin > end) begin = end;
+
+				char s[200];
+				snprintf(s,199,"# %04X # %04X # %20.20s #",begin, end - begin, og.first.c_str());
+				off << s << names << std::endl;
+			}
+			for (auto &&r : overlayReport)
+				off << "WARNING: " << r << std::endl;
+		}
+		output.files[options.romName + ".areas.map"] = off.str();
+	}
+
+	// Generate symbols map
+	{
+		std::ostringstream off;
+		off << "Symbols MAP: " << std::endl;
+		off << "# SG #  MAP #  ROM  #  MODULE  #        HEADER        #        PAGE A        #        PAGE B        #        PAGE C        #        PAGE D        #" << std::endl;
+		off << "###################################################################################################################################################" << std::endl;
+		// Lines of each segment, sorted by address.
+		std::map<int, std::multimap<uint32_t, std::string>> segmentLines;
+		for (auto &mp : modules) {
+			for (auto &module : mp.second) {
+				auto &lines = segmentLines[module.segment];
+				for (auto &area:  module.areas) {
+					if (area.size==0) continue;
+
+					for (auto &symbol : module.symbols) {
+						if (symbol.type != Module::Symbol::DEF) continue;
+						if (symbol.areaName != area.name) continue;
+						
+						std::ostringstream oss;
+						
+						uint32_t addr = area.addr + symbol.addr, rom_addr = area.rom_addr + symbol.addr;
+						auto f = area.name == "_CODE" ? findFold(module, symbol.addr) : nullptr;
+						if (f and f->module.empty()) continue;
+						if (area.name == "_CODE" and not module.folds.empty())
+							std::tie(addr, rom_addr) = codeLocation(module, symbol.addr);
+
+						char s[200];
+						if (area.rom_addr==uint32_t(-1)) {
+							snprintf(s,199,"#%3X # %04X # ----- # %-8.8s #",module.segment, addr, module.name.c_str());
+						} else {
+							snprintf(s,199,"#%3X # %04X # %05X # %-8.8s #",module.segment, addr, rom_addr, module.name.c_str());
+						}
+						oss << s;
+						for (int j=-1; j<module.page; j++) oss << "                      #";
+						snprintf(s,199," %-20.20s #",symbol.name.c_str());
+						oss << s;	
+						for (int j=module.page+1; j<4; j++) oss << "                      #";
+						lines.emplace(addr,oss.str());
+					
+					}
+				}	
+			}
+		}
+
+		for (auto &sl : segmentLines) {
+			auto &lines = sl.second;
+			for (auto &&s : lines)
+				off << s.second << std::endl;
+			if (not lines.empty()) 
+				off << "###################################################################################################################################################" << std::endl;
+
+		}
+		output.files[options.romName + ".symbols.map"] = off.str();
+	}
+
+	Log(2) << "Allocated: " << (rom_ptr-0x4000) << " bytes of ROM";
+	if (rom_ptr>0xC000) throw std::runtime_error("Main segment ROM doesn't fit 32KB");
+
+	Log(2) << "Allocated: " << (ram_ptr-megalinkerSymbols["___ML_CONFIG_RAM_START"]) << " bytes of RAM";		
+	uint32_t ram_limit = 0xF000;
+	uint32_t stack_reserve = 0xF380 - 0xF000;
+	megalinkerSymbols["___ML_CONFIG_HIMEM_MIN"] = 0;
+	if (options.stackAnnotations.empty()) {
+		if (ram_ptr>0xF000) throw std::runtime_error("Ram area dangerously close to stack.");
+	} else if (options.disk) {
+		// The stack grows down from the top of the TPA, only known at boot.
+		stack_reserve = computeStackBound(modules, read(options.stackAnnotations), output.files[options.romName + ".stack.map"]);
+		Log(2) << "Stack: " << stack_reserve << " bytes below the top of the TPA";
+	} else {
+		// The stack grows down from HIMEM, assumed not lower than ___ML_CONFIG_STACK_TOP. The crt checks it at boot.
+		if (not megalinkerSymbols.count("___ML_CONFIG_STACK_TOP")) throw std::runtime_error("___ML_CONFIG_STACK_TOP not defined, required by the stack analysis");
+		uint32_t stack_top = megalinkerSymbols["___ML_CONFIG_STACK_TOP"];
+		megalinkerSymbols["___ML_CONFIG_HIMEM_MIN"] = stack_top;
+		uint32_t stack_bound = computeStackBound(modules, read(options.stackAnnotations), output.files[options.romName + ".stack.map"]);
+
+		Log(2) << "Stack: " << stack_bound << " bytes below 0x" << std::hex << stack_top << std::dec;
+		if (ram_ptr + stack_bound > stack_top) throw std::runtime_error("Ram area collides with the worst case stack.");
+		ram_limit = stack_top - stack_bound;
+	}
+
+	// The TPA of MSX-DOS ends below 0xF000 and depends on the machine: disk programs stop at boot if its top
+	// leaves no room for the RAM areas and the stack.
+	megalinkerSymbols["___ML_CONFIG_TPA_MIN"] = ram_ptr + stack_reserve;
+
+	// GENERATE BUDGET REPORT
+	// One entry per line, so the report of a previous link can be read back by --diff.
+	if (options.budget) {
+
+		// Used bytes and intervals of each segment of the ROM.
+		std::map<uint32_t, std::vector<std::pair<uint32_t, uint32_t>>> segmentRanges;
+		for (auto &mp : modules)
+			for (auto &module : mp.second)
+				for (auto &area : module.areas)
+					if (area.size and area.rom_addr != uint32_t(-1))
+						for (uint32_t begin = area.rom_addr, end = area.rom_addr + area.size; begin < end; begin = (begin & ~0x1FFF) + 0x2000)
+							segmentRanges[(begin - 0x4000) / 0x2000].emplace_back(begin % 0x2000, std::min(end - (begin & ~0x1FFF), 0x2000U));
+
+		std::map<std::string, uint32_t> current; // Sizes compared by --diff
+		std::ostringstream off;
+		off << "{" << std::endl;
+		off << "  \"rom\": \"" << options.romName << "\"," << std::endl;
+		off << "  \"header\": {\"used\": " << rom_ptr - 0x4000 << ", \"limit\": " << 0x8000 << ", \"headroom\": " << 0xC000 - rom_ptr << "}," << std::endl;
+		off << "  \"ram\": {\"start\": " << megalinkerSymbols["___ML_CONFIG_RAM_START"] << ", \"end\": " << ram_ptr << ", \"limit\": " << ram_limit << ", \"headroom\": " << ram_limit - ram_ptr << "}," << std::endl;
+		current["header"] = rom_ptr - 0x4000;
+		current["ram"] = ram_ptr - megalinkerSymbols["___ML_CONFIG_RAM_START"];
+
+		// Free bytes of a segment are fragmentation if they are split in gaps smaller than the free total.
+		off << "  \"segments\": [" << std::endl;
+		for (auto it = segmentRanges.begin(); it != segmentRanges.end(); it++) {
+			auto &ranges = it->second;
+			std::sort(ranges.begin(), ranges.end());
+			uint32_t used = 0, gap = 0, ptr = 0;
+			for (auto &[begin, end] : ranges) {
+				gap = std::max(gap, begin > ptr ? begin - ptr : 0);
+				used += end - begin;
+				ptr = std::max(ptr, end);
+			}
+			gap = std::max(gap, 0x2000 - ptr);
+			off << "    {\"segment\": " << it->first << ", \"used\": " << used << ", \"free\": " << 0x2000 - used << ", \"largest_gap\": " << gap << "}" << (std::next(it) == segmentRanges.end() ? "" : ",") << std::endl;
+			current["segment " + std::to_string(it->first)] = used;
+		}
+		off << "  ]," << std::endl;
+
+		std::map<int, std::pair<uint32_t, uint32_t>> pages; // Modules and bytes of _CODE mapped in each page.
+		for (auto &mp : modules) {
+			if (mp.second.front().page < 0) continue;
+			pages[mp.second.front().page].first++;
+			for (auto &module : mp.second)
+				for (auto &area : module.areas)
+					if (area.name == "_CODE" or area.name.substr(0,5) == "_CABS")
+						pages[mp.second.front().page].second += area.size;
+		}
+		off << "  \"pages\": [" << std::endl;
+		for (auto it = pages.begin(); it != pages.end(); it++)
+			off << "    {\"page\": \"" << char('A' + it->first) << "\", \"modules\": " << it->second.first << ", \"bytes\": " << it->second.second << "}" << (std::next(it) == pages.end() ? "" : ",") << std::endl;
+		off << "  ]," << std::endl;
+
+		off << "  \"modules\": [" << std::endl;
+		for (auto it = modules.begin(); it != modules.end(); it++) {
+			std::map<std::string, uint32_t> sizes;
+			for (auto &module : it->second)
+				for (auto &area : module.areas)
+					if (area.size)
+						sizes[area.name] += area.size;
+			off << "    {\"module\": \"" << it->first << "\", \"segment\": " << it->second.front().segment << ", \"page\": \"" << (it->second.front().page < 0 ? '-' : char('A' + it->second.front().page)) << "\"";
+			for (auto &[name, size] : sizes) {
+				off << ", \"" << name << "\": " << size;
+				current["module " + it->first + " " + name] = size;
+			}
+			off << "}" << (std::next(it) == modules.end() ? "" : ",") << std::endl;
+		}
+		off << "  ]" << std::endl;
+		off << "}" << std::endl;
+		output.files[options.romName + ".budget.json"] = off.str();
+
+		// Reads back the sizes of a previous report, and lists what grew.
+		if (not options.budgetBaseline.empty()) {
+
+			std::istringstream isf(read(options.budgetBaseline));
+			std::map<std::string, uint32_t> previous;
+			std::string line;
+			while (std::getline(isf, line)) {
+
+				std::vector<std::pair<std::string, std::string>> fields;
+				static const std::regex field("\"([^\"]+)\": *(\"([^\"]*)\"|[0-9]+)");
+				for (std::sregex_iterator it(line.begin(), line.end(), field); it != std::sregex_iterator(); it++)
+					fields.emplace_back((*it)[1], (*it)[3].matched ? (*it)[3] : (*it)[2]);
+				if (fields.size() < 2) continue;
+
+				auto number = [](const std::string &value) { return uint32_t(std::stoul(value)); };
+				if (line.find("\"header\"") != std::string::npos) previous["header"] = number(fields[0].second);
+				if (line.find("\"ram\"") != std::string::npos) previous["ram"] = number(fields[1].second) - number(fields[0].second);
+				if (fields[0].first == "segment") previous["segment " + fields[0].second] = number(fields[1].second);
+				if (fields[0].first == "module")
+					for (size_t i=3; i<fields.size(); i++)
+						previous["module " + fields[0].second + " " + fields[i].first] = number(fields[i].second);
+			}
+
+			for (auto &[name, size] : current) {
+				uint32_t before = previous.count(name) ? previous[name] : 0;
+				if (size <= before) continue;
+				output.growth.push_back(name + " grew from " + std::to_string(before) + " to " + std::to_string(size) + " bytes (+" + std::to_string(size - before) + ")");
+			}
+		}
+	}
+	
+	// ANALYZE BANK SWITCHES
+	if (options.callGraph) {
+
+		auto errors = analyzeBankSwitches(modules, output.files[options.romName + ".calls.dot"], output.files[options.romName + ".calls.json"]);
+		if (not errors.empty()) {
+			std::string message = std::to_string(errors.size()) + " illegal bank switches:";
+			for (auto &error : errors)
+				message += "\n  " + error;
+			throw std::runtime_error(message);
+		}
+	}
+
+	// DO LABEL SYMBOL ADDRESSES
+	std::map<std::string,uint32_t> symbolsAddress;
+	for (auto &mp : modules) {
+		for (auto &module : mp.second) {
+			std::map<std::string, uint32_t> areaAddress;
+			for (auto &area:  module.areas) 
+				areaAddress[area.name] = area.addr;
+				
+			for (auto &symbol : module.symbols) {
+				if (symbol.type == Module::Symbol::DEF) {
+					// Symbols of dead code are left undefined.
+					auto f = symbol.areaName == "_CODE" ? findFold(module, symbol.addr) : nullptr;
+					if (f and f->module.empty()) continue;
+
+					symbolsAddress[symbol.name] = areaAddress[symbol.areaName] + symbol.addr;
+					if (symbol.areaName == "_CODE" and not module.folds.empty())
+						symbolsAddress[symbol.name] = codeLocation(module, symbol.addr).first;
+					symbol.absoluteAddress = symbolsAddress[symbol.name];
+					if (symbol.name[0]!='.') 
+						Log(2) << "Symbol: " << symbol.name << " defined at: 0x" << std::hex << symbol.absoluteAddress << std::dec << " at page: " << module.page;
+				}
+			}
+		}
+	}
+	
+	// Value of a symbol referenced by a module: an address, a segment, or a configuration value.
+	Module::Resolver resolveSymbol = [&](const Module::Symbol &symbol) -> uint32_t {
+
+		if (symbolsAddress.count(symbol.name)!=0) {
+
+			Log(3) << std::hex << "Symbol: " << symbol.name << " is in: " << symbolsAddress[symbol.name] << std::dec;
+			return symbolsAddress[symbol.name];
+
+		} else if (symbol.isSegmentSymbol()) {
+
+			std::string requestedModule = symbol.getSegmentName();
+			Log(3) << "Requested symbol: " << requestedModule;
+			return modules[requestedModule].front().segment;
+
+		} else if (symbol.isRamSegmentSymbol()) {
+
+			std::string requestedModule = symbol.getRamSegmentName();
+			if (ramSegments.count(requestedModule)==0) throw std::runtime_error("Module " + requestedModule + " has no banked RAM: " + symbol.name);
+			return ramSegments[requestedModule];
+
+		} else if (symbol.isConfigurationSymbol()) {
+
+			return megalinkerSymbols[symbol.name];
+		}
+
+		throw std::runtime_error("Undefined symbol: " + symbol.name);
+	};
+
+	// DO EXTRACT THE CODE
+	std::vector<uint8_t> rom(0x20000,0xff);
+	for (auto &mp : modules) {
+		for (auto &module : mp.second) {
+
+			// Binary modules are copied verbatim to the ROM address of their area.
+			if (module.binary) {
+
+				if (module.generate)
+					module.content = module.generate(resolveSymbol);
+
+				for (auto &area : module.areas) {
+					if (area.size==0) continue;
+					if (area.rom_addr==uint32_t(-1)) continue;
+					if (module.content.size() != area.size) throw std::runtime_error("Binary module " + module.name + " does not match the size of its area");
+
+					while (rom.size() < area.rom_addr - 0x4000 + area.size)
+						rom.resize(rom.size()+0x2000,0xff);
+
+					std::copy(module.content.begin(), module.content.end(), rom.begin() + area.rom_addr - 0x4000);
+				}
+				continue;
+			}
+		
+			std::istringstream isf(module.content);
+			std::string line;
+			
+			uint32_t current_area=0;
+			uint32_t code_area=module.areas.size();
+			std::vector<int> area_addr;
+			std::vector<int> area_rom_addr;
+			for (auto &area : module.areas) {
+				if (area.name == "_CODE" and not module.folds.empty())
+					code_area = &area - &module.areas[0];
+				if (area.type == Module::Area::RELATIVE) {
+					area_addr.push_back(area.addr); 
+					area_rom_addr.push_back(area.rom_addr); 
+				} else {
+					if (area.size)
+						Log(3) << "Module: " << module.name << " Area: " << area.name << " " << area.addr << " " << area.rom_addr;
+//					area_addr.push_back(area.addr); 
+					area_rom_addr.push_back(area.rom_addr & 0xFFFFE000); 
+					area_addr.push_back(0);
+//					area_rom_addr.push_back(0);
+				}
+			}
+				
+			uint32_t last_t_pos=0;
+			std::vector<uint8_t> T;
+			
+			while (std::getline(isf, line)) {
+				
+				std::istringstream isl(line);
+				std::string type;
+				isl >> type;
+
+				if (type=="XL2") { // HEADER
+				} else if (type=="XL3") { // NOT HERE
+				} else if (type=="XL4") { // NOT HERE
+				} else if (type=="M") { // NOT HERE
+				} else if (type=="O") { // NOT NEEDED
+				} else if (type=="H") { // NOT NEEDED
+				} else if (type=="S") { // NOT HERE
+				} else if (type=="A") { // NOT HERE
+				} else if (type=="T") { // HERE
+					
+					uint32_t xx0, xx1, xx2, xx3;
+					isl >> HEX(xx0,HEX::TWO_NIBBLES) >> HEX(xx1,HEX::TWO_NIBBLES);
+					
+					if (module.version==3) {
+						isl >> HEX(xx2,HEX::TWO_NIBBLES);
+						if (xx2 != 0) throw std::runtime_error("We don't support sdcc explicit banking");
+					}
+
+					if (module.version==4) {
+						isl >> HEX(xx2,HEX::TWO_NIBBLES);
+						if (xx2 != 0) throw std::runtime_error("We don't support sdcc explicit banking");
+						isl >> HEX(xx3,HEX::TWO_NIBBLES);
+						if (xx3 != 0) throw std::runtime_error("We don't support sdcc explicit banking");
+					}
+
+					last_t_pos = xx1*0x100 + xx0;
+					
+					T.clear();
+					uint32_t nn;
+					while (isl >> HEX(nn,HEX::TWO_NIBBLES))
+						T.push_back(nn);
+					
+				} else if (type=="R") { // HERE
+
+					uint32_t aa0, aa1;
+					isl >> AR("00") >> AR("00") >> HEX2(aa0) >> HEX2(aa1);
+					current_area = aa1*0x100 + aa0;
+
+					uint32_t n1, n2, xx0, xx1;
+					
+					uint32_t n2Adjust = 2;
+					if (module.version==3) n2Adjust = 3;
+					if (module.version==4) n2Adjust = 4;
+										
+					while (isl >> HEX2(n1) >> HEX2(n2) >> HEX2(xx0) >> HEX2(xx1)) {
+
+						uint32_t idx = xx1*0x100 + xx0;
+						uint32_t address = 0;
+						
+						if (n2 <n2Adjust) 
+							throw std::runtime_error("n2 < n2Adjust??");
+						n2-=n2Adjust;
+
+						// Fields of removed ranges are dropped with their bytes, they are not resolved.
+						if (current_area == code_area and findFold(module, last_t_pos + n2)) {
+
+							n1 &= ~R3_SYM;
+
+						} else if ( n1 & R3_SYM ) {
+							
+							address = resolveSymbol(module.symbols[idx]);
+							
+							if (symbolsAddress.count(module.symbols[idx].name)==0 and module.symbols[idx].isSegmentSymbol()) {
+								
+								std::string requestedModule = module.symbols[idx].getSegmentName();
+								
+								Log(2) << "Current area: " << module.areas[current_area].name << " (" << module.page << ") is loading " << module.symbols[idx].name << " (" << modules[requestedModule].front().page << ")" ;
+								if (module.areas[current_area].name == "_CODE" and module.page == modules[requestedModule].front().page) 
+									Log(3) << "Warning: In module " << module.name << " and area: " << module.areas[current_area].name << " (" << module.page << ") is loading " << module.symbols[idx].name << " (" << modules[requestedModule].front().page << ")" ;
+							}
+							
+							Log(3) << module.symbols[idx].name << " " << std::hex << address;
+							
+							n1 -= R3_SYM;
+						} else  {
+						
+							address = area_addr[idx];
+
+							// Offsets into a folded _CODE area skip the removed ranges, or lead to their copies.
+							if (idx == code_area) {
+								uint32_t offset = T[n2+0] + T[n2+1]*0x100;
+								address = codeLocation(module, offset).first - offset;
+							}
+						}
+						
+						
+						if        (n1 == R3_WORD ) {
+
+							address += T[n2+0] + T[n2+1]*0x100;
+							
+							T[n2+0] = address & 0xFF;
+							T[n2+1] = address >> 8;
+						
+						} else if (n1 == R3_BYTE + R3_BYTX + R3_LSB) {
+							
+							address += T[n2+0] + T[n2+1]*0x100;
+
+							for (uint32_t i=n2+1; i<T.size(); i++) 
+								T[i-1] = T[i];
+							T.pop_back();
+							n2Adjust++;
+							
+							if (module.version==3) {
+								for (uint32_t i=n2+1; i<T.size(); i++) 
+									T[i-1] = T[i];
+								T.pop_back();								
+								n2Adjust++;
+							}
+
+							if (module.version==4) {
+								for (uint32_t i=n2+2; i<T.size(); i++) 
+									T[i-2] = T[i];
+								T.pop_back();								
+								T.pop_back();								
+								n2Adjust+=2;
+							}
+
+							T[n2+0] = address & 0xFF;
+							
+							
+						} else if (n1 == R3_BYTE + R3_BYTX + R3_MSB) {
+							
+							address += T[n2+0] + T[n2+1]*0x100;
+
+							for (uint32_t i=n2+1; i<T.size(); i++) 
+								T[i-1] = T[i];
+							T.pop_back();
+							n2Adjust++;
+
+							if (module.version==3) {
+								for (uint32_t i=n2+1; i<T.size(); i++) 
+									T[i-1] = T[i];
+								T.pop_back();								
+								n2Adjust++;
+							}
+
+							if (module.version==4) {
+								for (uint32_t i=n2+2; i<T.size(); i++) 
+									T[i-2] = T[i];
+								T.pop_back();								
+								T.pop_back();								
+								n2Adjust+=2;
+							}
+
+							T[n2+0] = (address>>8) & 0xFF;
+
+						} else {
+							Log(3) << "N1: 0x"<< std::hex << n1 << std::dec;
+							throw std::runtime_error("Unsupported relocation flag combination");
+						}
+					}	
+
+					if (last_t_pos > 0x2000) {
+						Log(4) << "XX " << current_area << " " << std::hex << last_t_pos << " " << area_rom_addr[current_area] << std::dec;
+					}
+
+
+					if (T.size())
+						while (rom.size() < last_t_pos + area_rom_addr[current_area] - 0x4000 + T.size()) 
+							rom.resize(rom.size()+0x2000,0xff);
+
+					for (auto &t : T) {
+						uint32_t pos = last_t_pos++;
+						if (current_area == code_area) {
+							if (findFold(module, pos)) continue;
+							pos = foldedOffset(module, pos);
+						}
+						rom[area_rom_addr[current_area] - 0x4000 + (pos % 0x2000)] = t;
+					}
+
+				} else if (not type.empty()) {
+					
+					std::runtime_error("Unrecognized type: " + type);
+				}
+			}
+		}
+	}
+
+
+	// COMPARE WITH THE PREVIOUS ROM
+	if (not options.previousRom.empty()) {
+
+		std::string previous;
+		try {
+			previous = read(options.previousRom);
+		} catch (std::runtime_error &) {
+			Log(1) << "No previous rom " << options.previousRom << ", no patch is generated";
+		}
+
+		if (not previous.empty()) {
+			std::ostringstream off;
+			off << "CHANGED SEGMENTS: " << std::endl;
+			off << "# SG #  ROM  #" << std::endl;
+			uint32_t count = (std::max(rom.size(), previous.size()) + 0x1FFF) / 0x2000;
+			for (uint32_t i=0; i<count; i++) {
+				bool changed = false;
+				for (uint32_t j=i*0x2000; not changed and j<(i+1)*0x2000 and j<std::max(rom.size(), previous.size()); j++)
+					changed = j >= rom.size() or j >= previous.size() or uint8_t(previous[j]) != rom[j];
+				if (not changed) continue;
+
+				output.changedSegments.push_back(i);
+				char s[200];
+				snprintf(s,199,"#%3X # %05X #", i, 0x4000 + 0x2000*i);
+				off << s << std::endl;
+			}
+			off << output.changedSegments.size() << " of " << count << " segments changed" << std::endl;
+			Log(1) << output.changedSegments.size() << " of " << count << " segments changed since " << options.previousRom;
+
+			output.files[options.romName + ".changes.map"] = off.str();
+			output.patch = makeIPS(previous, rom);
+		}
+	}
+
+	// DO BUILD THE DISK OVERLAY
+	// The boot segments become an MSX-DOS program, which copies them to 0x4000 and jumps to the entry of the header.
+	// Every segment is also written to the overlay, thus it can be loaded in any page. The overlay starts with a table:
+	// "MLOV", the number of segments and their size (16 bit), and the offset (32 bit) and used bytes (16 bit) of each one.
+	if (options.disk) {
+
+		std::vector<uint32_t> used;
+		for (auto &mp : modules)
+			for (auto &module : mp.second)
+				for (auto &area : module.areas)
+					if (area.size and area.rom_addr != uint32_t(-1))
+						for (uint32_t begin = area.rom_addr, end = area.rom_addr + area.size; begin < end; begin = (begin & ~0x1FFF) + 0x2000) {
+							uint32_t i = (begin - 0x4000) / 0x2000;
+							if (used.size() <= i) used.resize(i+1, 0);
+							used[i] = std::max(used[i], std::min(end - (begin & ~0x1FFF), 0x2000U));
+						}
+		if (used.size() > 0xFF) throw std::runtime_error("The disk overlay has " + std::to_string(used.size()) + " segments, its loader handles up to 255");
+
+		uint32_t payload = 0;
+		for (uint32_t i=0; i<4 and i<used.size(); i++)
+			if (used[i])
+				payload = i*0x2000 + used[i];
+
+		auto word = [](std::vector<uint8_t> &v, uint32_t value) { v.push_back(value & 0xFF); v.push_back((value >> 8) & 0xFF); };
+
+		std::vector<uint8_t> program;
+		program.push_back(0x21); word(program, 0x100 + 15 + payload - 1); // ld hl, end of the payload
+		program.push_back(0x11); word(program, 0x4000 + payload - 1);     // ld de, end of its copy
+		program.push_back(0x01); word(program, payload);                  // ld bc, size of the payload
+		program.insert(program.end(), {0xED, 0xB8});                      // lddr
+		program.insert(program.end(), {0x2A, 0x02, 0x40});                // ld hl, (0x4002)
+		program.push_back(0xE9);                                          // jp (hl)
+		program.insert(program.end(), rom.begin(), rom.begin() + payload);
+
+		output.overlay = {'M', 'L', 'O', 'V'};
+		word(output.overlay, used.size());
+		word(output.overlay, 0x2000);
+		uint32_t offset = 8 + 6*used.size();
+		for (auto &u : used) {
+			word(output.overlay, offset);
+			word(output.overlay, offset >> 16);
+			word(output.overlay, u);
+			offset += u;
+		}
+		for (uint32_t i=0; i<used.size(); i++)
+			output.overlay.insert(output.overlay.end(), rom.begin() + i*0x2000, rom.begin() + i*0x2000 + used[i]);
+
+		Log(2) << "Disk: program of " << program.size() << " bytes, overlay of " << used.size() << " segments and " << output.overlay.size() << " bytes";
+		rom = program;
+	}
+
+	// DO RETURN THE ROM
+	output.rom = rom;
+	output.symbols = symbolsAddress;
+	for (auto &mp : modules)
+		for (auto &module : mp.second)
+			for (auto &area : module.areas)
+				if (area.size)
+					output.areas.push_back({module.name, area.name, module.segment, module.page, area.addr, area.rom_addr, area.size});
+	output.ramStart = megalinkerSymbols["___ML_CONFIG_INIT_RAM_START"];
+	output.ramEnd = megalinkerSymbols["___ML_CONFIG_INIT_RAM_END"];
+	return output;
+}
+
+// diskFileName returns the name of a file of a disk link: the rom name, with another extension.
+std::string diskFileName(const std::string &romName, const std::string &extension) {
+
+	size_t dot = romName.find_last_of('.');
+	if (dot == std::string::npos or romName.find_first_of("/\\", dot) != std::string::npos) return romName + extension;
+	return romName.substr(0, dot) + extension;
+}
+
+// writeOutput writes the rom (or the program and overlay of a disk link), its patch and the maps of a link.
+void writeOutput(const LinkOptions &options, const LinkOutput &output) {
+
+	{
+		std::ofstream off(options.disk ? diskFileName(options.romName, ".com") : options.romName, std::ios::binary);
+		off.write((const char *)&output.rom[0x0000],output.rom.size()-0x0000);
+	}
+
+	if (options.disk) {
+		std::ofstream off(diskFileName(options.romName, ".ovl"), std::ios::binary);
+		off.write((const char *)output.overlay.data(), output.overlay.size());
+	}
+
+	if (not output.patch.empty()) {
+		std::ofstream off(options.romName + ".ips", std::ios::binary);
+		off.write((const char *)output.patch.data(), output.patch.size());
+	}
+
+	for (auto &file : output.files) {
+		std::ofstream off(file.first);
+		off << file.second;
+	}
+}
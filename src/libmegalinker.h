@@ -0,0 +1,405 @@
+////////////////////////////////////////////////////////////////////////
+// Linker for MSX Megaroms: library interface
+//
+// Manuel Martinez (salutte@gmail.com)
+//
+// A link runs in memory: inputs are read through a FileReader, and link returns the rom,
+// its maps and the placement of every area and symbol. The megalinker command is a thin wrapper.
+
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <functional>
+#include <cstdint>
+#include <mutex>
+
+// MiniLog
+class Log {
+	int level;
+	std::stringstream * const sstr;
+public:
+	static int &reportLevel() { static int rl = 0; return rl; };
+	static int reportLevel(int l) { return reportLevel()=l; };
+
+	// Messages are printed, unless a Capture of their thread is alive.
+	static std::vector<std::string> *&captured() { thread_local std::vector<std::string> *list = nullptr; return list; }
+	struct Capture {
+		std::vector<std::string> *previous;
+		Capture(std::vector<std::string> *list) : previous(captured()) { captured() = list; }
+		~Capture() { captured() = previous; }
+	};
+
+	Log (int level) : level(level), sstr(level>=reportLevel()?new std::stringstream():nullptr) {}
+	~Log() {
+		if (sstr and captured()) {
+			captured()->push_back("L" + std::to_string(level) + " " + sstr->str());
+			delete sstr;
+		} else if (sstr) {
+			static std::mutex mutex;
+			std::lock_guard<std::mutex> lock(mutex);
+			if (level==0) std::cerr << "\x1b[34;1m";
+			if (level==1 or level==-2) std::cerr << "\x1b[32;1m";
+			if (level>=2 or level==-1) std::cerr << "\x1b[31;1m";
+			std::cerr << "L" << level << " ";				
+
+			std::cerr << sstr->str() << std::endl;
+			std::cerr << "\x1b[0m";
+			delete sstr;
+		}
+	}
+	template<typename T> Log &operator<<(const T &v) { if (sstr) *sstr << v; return *this; }
+	void operator<<(std::nullptr_t) {}
+};
+
+struct Module {
+	
+	struct Area {
+		
+		std::string name;
+		uint32_t size;
+		uint32_t addr;
+		uint32_t rom_addr;
+		enum { ABSOLUTE, RELATIVE} type;
+		
+	};
+
+	struct Symbol {
+
+		// Configuration Symbol
+        const std::string prefix_configuration = "___ML_CONFIG_";
+        bool isConfigurationSymbol() const { 
+            
+            if (name.substr(0,prefix_configuration.size()) != prefix_configuration) return false;
+            return true;
+        }
+
+		// Module Segment Symbol
+        const std::string prefix_segment = "___ML_SEGMENT_";
+        bool isSegmentSymbol() const { 
+            
+            if (name.substr(0,prefix_segment.size()) != prefix_segment) return false;
+            if (type == DEF) throw std::runtime_error("A program should not define a Megalinker Segment Symbol: " + name);
+            
+            if (name.size() < prefix_segment.size()+2) throw std::runtime_error("Short Megalinker Segment Symbol: " + name);
+            if (name[prefix_segment.size()+1]!='_') throw std::runtime_error("Malformed Megalinker Segment Symbol: " + name);
+            if (name[prefix_segment.size()] < 'A' or name[prefix_segment.size()] > 'D') throw std::runtime_error("Module Symbol: " + name + " requires a wrong page");
+            return true;
+        }
+
+        std::string getSegmentName() const { 
+			if (not isSegmentSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not a segment symbol");
+			return name.substr(prefix_segment.size()+2); 
+		}
+		
+        int getSegmentPage() const { 
+			if (not isSegmentSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not a segment symbol");
+			return name[prefix_segment.size()]-'A'; 
+		}
+
+		// RAM Segment Symbol
+        const std::string prefix_ram_segment = "___ML_RAM_SEGMENT_";
+        bool isRamSegmentSymbol() const {
+
+            if (name.substr(0,prefix_ram_segment.size()) != prefix_ram_segment) return false;
+            if (type == DEF) throw std::runtime_error("A program should not define a Megalinker RAM Segment Symbol: " + name);
+            if (name.size() == prefix_ram_segment.size()) throw std::runtime_error("Short Megalinker RAM Segment Symbol: " + name);
+            return true;
+        }
+
+        std::string getRamSegmentName() const {
+			if (not isRamSegmentSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not a RAM segment symbol");
+			return name.substr(prefix_ram_segment.size());
+		}
+
+		// Move Symbols Symbol
+        const std::string prefix_move = "___ML_MOVE_SYMBOLS_TO_";
+        bool isMoveSymbol() const { 
+            
+            if (name.substr( 0, prefix_move.size()) != prefix_move) return false;
+            if (type == REF) throw std::runtime_error("A program should not refer to a Megalinker Segment Symbol: " + name);
+
+			size_t pos = name.find("_FROM_");
+			if (pos == std::string::npos) throw std::runtime_error("Move Symbol: " + name + " has no _FROM_ token");
+			if (name.find("_FROM_",pos+1) != std::string::npos) throw std::runtime_error("Move Symbol: " + name + " has more than one _FROM_ tokens");
+			
+            return true;
+        }
+
+        std::string getMoveTarget() const { 
+
+			if (not isMoveSymbol()) throw std::runtime_error("Module Symbol: " + name + " is not a module append symbol");						
+			return name.substr(prefix_move.size(), name.find("_FROM_") - prefix_move.size()); 
+        }
+
+        std::string getMoveSource() const { 
+
+			if (not isMoveSymbol()) throw std::runtime_error("Module Symbol: " + name + " is not a module append symbol");						
+			return name.substr(name.find("_FROM_")+6);
+        }
+
+		// Overlay Group Symbol
+        const std::string prefix_overlay = "___ML_OVERLAY_";
+        bool isOverlaySymbol() const {
+
+            if (name.substr( 0, prefix_overlay.size()) != prefix_overlay) return false;
+            if (type == REF) throw std::runtime_error("A program should not refer to a Megalinker Overlay Symbol: " + name);
+
+			size_t pos = name.find("_MODULE_");
+			if (pos == std::string::npos) throw std::runtime_error("Overlay Symbol: " + name + " has no _MODULE_ token");
+			if (name.find("_MODULE_",pos+1) != std::string::npos) throw std::runtime_error("Overlay Symbol: " + name + " has more than one _MODULE_ tokens");
+
+            return true;
+        }
+
+        std::string getOverlayGroup() const {
+
+			if (not isOverlaySymbol()) throw std::runtime_error("Module Symbol: " + name + " is not an overlay symbol");
+			return name.substr(prefix_overlay.size(), name.find("_MODULE_") - prefix_overlay.size());
+        }
+
+        std::string getOverlayModule() const {
+
+			if (not isOverlaySymbol()) throw std::runtime_error("Module Symbol: " + name + " is not an overlay symbol");
+			return name.substr(name.find("_MODULE_")+8);
+        }
+
+		// Far Pointer Symbol
+        const std::string prefix_far = "___ML_FAR_";
+        bool isFarSymbol() const {
+
+            if (name.substr(0,prefix_far.size()) != prefix_far) return false;
+
+            if (name.size() < prefix_far.size()+3) throw std::runtime_error("Short Megalinker Far Symbol: " + name);
+            if (name[prefix_far.size()+1]!='_') throw std::runtime_error("Malformed Megalinker Far Symbol: " + name);
+            if (name[prefix_far.size()] < 'A' or name[prefix_far.size()] > 'D') throw std::runtime_error("Far Symbol: " + name + " requires a wrong page");
+            return true;
+        }
+
+        std::string getFarFunction() const {
+			if (not isFarSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not a far symbol");
+			return "_" + name.substr(prefix_far.size()+2);
+		}
+
+        int getFarPage() const {
+			if (not isFarSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not a far symbol");
+			return name[prefix_far.size()]-'A';
+		}
+
+		// Pinned Module Symbol
+        const std::string prefix_pin = "___ML_PIN_";
+        bool isPinSymbol() const {
+
+            if (name.substr(0,prefix_pin.size()) != prefix_pin) return false;
+            if (type == REF) throw std::runtime_error("A program should not refer to a Megalinker Pin Symbol: " + name);
+
+            if (name.size() < prefix_pin.size()+3) throw std::runtime_error("Short Megalinker Pin Symbol: " + name);
+            if (name[prefix_pin.size()+1]!='_') throw std::runtime_error("Malformed Megalinker Pin Symbol: " + name);
+            if (name[prefix_pin.size()] < 'A' or name[prefix_pin.size()] > 'D') throw std::runtime_error("Pin Symbol: " + name + " requires a wrong page");
+            return true;
+        }
+
+        std::string getPinModule() const {
+			if (not isPinSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not a pin symbol");
+			return name.substr(prefix_pin.size()+2);
+		}
+
+        int getPinPage() const {
+			if (not isPinSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not a pin symbol");
+			return name[prefix_pin.size()]-'A';
+		}
+
+		// Alignment Symbol
+        const std::string prefix_align = "___ML_ALIGN_";
+        bool isAlignSymbol() const {
+
+            if (name.substr(0,prefix_align.size()) != prefix_align) return false;
+            if (type == REF) throw std::runtime_error("A program should not refer to a Megalinker Align Symbol: " + name);
+
+            size_t pos = name.find('_', prefix_align.size());
+            if (pos == std::string::npos or pos == prefix_align.size() or pos+1 == name.size()) throw std::runtime_error("Malformed Megalinker Align Symbol: " + name);
+            if (name.find_first_not_of("0123456789", prefix_align.size()) != pos) throw std::runtime_error("Align Symbol: " + name + " requires a decimal alignment");
+            return true;
+        }
+
+        std::string getAlignModule() const {
+			if (not isAlignSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not an align symbol");
+			return name.substr(name.find('_', prefix_align.size())+1);
+		}
+
+        uint32_t getAlignBytes() const {
+			if (not isAlignSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not an align symbol");
+			return std::stoul(name.substr(prefix_align.size()));
+		}
+
+		// Segment Set Member Symbol
+        const std::string prefix_in_set = "___ML_IN_SET_";
+        bool isSetMemberSymbol() const {
+
+            if (name.substr(0,prefix_in_set.size()) != prefix_in_set) return false;
+            if (type == REF) throw std::runtime_error("A program should not refer to a Megalinker Set Member Symbol: " + name);
+
+			size_t pos = name.find("_PAGE_");
+			if (pos == std::string::npos) throw std::runtime_error("Set Member Symbol: " + name + " has no _PAGE_ token");
+			if (name.find("_PAGE_",pos+1) != std::string::npos) throw std::runtime_error("Set Member Symbol: " + name + " has more than one _PAGE_ tokens");
+			if (name.size() < pos+9 or name[pos+7]!='_') throw std::runtime_error("Malformed Set Member Symbol: " + name);
+			if (name[pos+6] < 'A' or name[pos+6] > 'D') throw std::runtime_error("Set Member Symbol: " + name + " requires a wrong page");
+            return true;
+        }
+
+        std::string getSetName() const {
+			if (not isSetMemberSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not a set member symbol");
+			return name.substr(prefix_in_set.size(), name.find("_PAGE_") - prefix_in_set.size());
+		}
+
+        int getSetPage() const {
+			if (not isSetMemberSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not a set member symbol");
+			return name[name.find("_PAGE_")+6]-'A';
+		}
+
+        std::string getSetModule() const {
+			if (not isSetMemberSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not a set member symbol");
+			return name.substr(name.find("_PAGE_")+8);
+		}
+
+		// Interrupt Handler Symbol: ___ML_INTERRUPT_[page_]order_function, without page for __nonbanked handlers
+        const std::string prefix_interrupt = "___ML_INTERRUPT_";
+        bool isInterruptSymbol() const {
+
+            if (name.substr(0,prefix_interrupt.size()) != prefix_interrupt) return false;
+            if (type == REF) throw std::runtime_error("A program should not refer to a Megalinker Interrupt Symbol: " + name);
+
+			size_t pos = prefix_interrupt.size();
+			if (name.size() > pos+1 and name[pos] >= 'A' and name[pos] <= 'D' and name[pos+1] == '_') pos += 2;
+			size_t end = name.find('_', pos);
+			if (end == std::string::npos or end == pos or end+1 == name.size()) throw std::runtime_error("Malformed Megalinker Interrupt Symbol: " + name);
+			if (name.find_first_not_of("0123456789", pos) != end) throw std::runtime_error("Interrupt Symbol: " + name + " requires a decimal order");
+            return true;
+        }
+
+        int getInterruptPage() const {
+			if (not isInterruptSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not an interrupt symbol");
+			char c = name[prefix_interrupt.size()];
+			return c >= 'A' and c <= 'D' ? c - 'A' : -1;
+		}
+
+        uint32_t getInterruptOrder() const {
+			if (not isInterruptSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not an interrupt symbol");
+			return std::stoul(name.substr(prefix_interrupt.size() + (getInterruptPage() < 0 ? 0 : 2)));
+		}
+
+        std::string getInterruptFunction() const {
+			if (not isInterruptSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not an interrupt symbol");
+			return "_" + name.substr(name.find('_', prefix_interrupt.size() + (getInterruptPage() < 0 ? 0 : 2)) + 1);
+		}
+
+		std::string name;
+		uint32_t addr;
+		enum { DEF, REF} type;
+		std::string areaName;
+		
+		uint32_t absoluteAddress;
+	};
+	
+	int version = -1;
+	
+	std::string filename, name, content;
+	std::string source; // Input file the module was read from, empty if generated by the linker
+	std::vector<Area> areas;
+	std::vector<Symbol> symbols;
+	
+	// Binary modules hold the raw bytes of their only area in content, instead of REL records.
+	// Modules generated by the linker fill their content once all symbols can be resolved.
+	typedef std::function<uint32_t(const Symbol &)> Resolver;
+	bool binary = false;
+	std::function<std::string(const Resolver &)> generate;
+
+	// Ranges of the _CODE area removed by dead code elimination (-g) or by folding (-f).
+	// A folded range is replaced by an identical copy, held by the area of another module (or of the same one)
+	// at the given offset, as compiled. A dead range has no copy (empty module).
+	struct Fold {
+		uint32_t offset, size;
+		std::string module, area;
+		uint32_t part, copyOffset;
+	};
+	std::vector<Fold> folds;
+
+	bool enabled = false;
+	int page = -1;
+	int segment = 0;
+	bool has_cabs_areas = false;
+};
+
+// Returns the contents of a file. Links from memory supply their own reader.
+typedef std::function<std::string(const std::string &)> FileReader;
+
+// readFile returns the raw contents of a file.
+std::string readFile(const std::string &filename);
+
+// Options of a link, set from the command line.
+struct LinkOptions {
+	std::string romName = "out.rom";
+	std::string stackAnnotations;
+	bool instrument = false;
+	bool fold = false;
+	bool gc = false;
+	std::map<std::string, uint32_t> overrides; // New values of absolute symbols
+	bool quiet = false; // Diagnostics are returned in LinkOutput instead of printed
+	std::string dependencyFile; // Make rule listing the files that contribute to the rom, and their fingerprint
+	std::string previousRom; // Rom of a previous link: its layout is kept when possible, and the changes are patched
+	bool budget = false; // Writes ROM_FILE.budget.json, the ROM and RAM usage by segment, page and module
+	std::string budgetBaseline; // Budget report of a previous link, to list what grew
+	bool disk = false; // Writes an MSX-DOS program with the boot segments, and an overlay with all the segments, instead of a rom
+	bool callGraph = false; // Writes the references between modules as ROM_FILE.calls.dot and .json, and fails on illegal bank switches
+	std::vector<std::string> inputs; // Input files in the order given, only used to fingerprint the link
+};
+
+// Modules read from one input file, and the streams it declares.
+// files lists every file read, as an asset manifest also reads the assets it names.
+struct Input {
+	std::vector<Module> modules;
+	std::map<std::string, std::vector<std::string>> streams;
+	std::vector<std::string> files;
+};
+
+// Result of a link. files holds the maps, by file name.
+struct LinkOutput {
+	struct Placement {
+		std::string module, area;
+		int segment, page;
+		uint32_t addr, rom_addr, size;
+	};
+
+	std::vector<uint8_t> rom;
+	std::vector<uint8_t> overlay; // Disk links: the table of the segments and the segments, rom holds the MSX-DOS program
+	std::vector<uint8_t> patch; // IPS patch from the previous rom, if any
+	std::vector<uint32_t> changedSegments; // Segments that differ from the previous rom
+	std::vector<std::string> growth; // Modules, segments, header and RAM larger than in the budget baseline
+	std::map<std::string, std::string> files;
+	std::vector<Placement> areas;
+	std::map<std::string, uint32_t> symbols;
+	uint32_t ramStart = 0, ramEnd = 0;
+	std::vector<std::string> diagnostics;
+};
+
+// readInput reads a .rel, .lib, .bin or .assets file. Other files are ignored.
+Input readInput(const std::string &arg, const FileReader &read = readFile);
+
+// addInput adds the modules of an input to the link. A .rel file supplied twice is only added once.
+void addInput(std::map<std::string, std::vector<Module>> &modules, std::map<std::string, std::vector<std::string>> &streams, const Input &input, const std::string &arg);
+
+// link arranges the modules in the megarom, and returns the rom and its maps. Errors throw std::runtime_error.
+LinkOutput link(const LinkOptions &options, std::map<std::string, std::vector<Module>> modules, std::map<std::string, std::vector<std::string>> streams, const FileReader &read = readFile);
+
+// fingerprint hashes the options of a link and the contents of the named modules. Returns 0 if a module is missing.
+uint64_t fingerprint(const LinkOptions &options, const std::map<std::string, std::vector<Module>> &modules, const std::set<std::string> &names, const FileReader &read = readFile);
+
+// diskFileName returns the name of a file of a disk link: the rom name, with another extension.
+std::string diskFileName(const std::string &romName, const std::string &extension);
+
+// writeOutput writes the rom (or the program and overlay of a disk link), its patch and the maps of a link.
+void writeOutput(const LinkOptions &options, const LinkOutput &output);
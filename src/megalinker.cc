@@ -1,351 +1,169 @@
 ////////////////////////////////////////////////////////////////////////
-// Linker for MSX Megaroms
+// Linker for MSX Megaroms: command line
 //
 // Manuel Martinez (salutte@gmail.com)
 //
-// FLAGS: -std=c++14 -O0
+// FLAGS: -std=c++17 -O0
 
-#include <iostream>
-#include <sstream>
-#include <fstream>
-#include <map>
-#include <set>
-#include <vector>
-#include <functional>
-#include <algorithm>
-#include <cstdint>
-
-namespace { // MiniLog
-	class Log {
-		int level;
-		std::stringstream * const sstr;
-	public:
-		static int &reportLevel() { static int rl = 0; return rl; };
-		static int reportLevel(int l) { return reportLevel()=l; };
-		Log (int level) : level(level), sstr(level>=reportLevel()?new std::stringstream():nullptr) {}
-		~Log() {
-			if (sstr) {
-				if (level==0) std::cerr << "\x1b[34;1m";
-				if (level==1 or level==-2) std::cerr << "\x1b[32;1m";
-				if (level>=2 or level==-1) std::cerr << "\x1b[31;1m";
-				std::cerr << "L" << level << " ";				
-
-				std::cerr << sstr->str() << std::endl;
-				std::cerr << "\x1b[0m";
-				delete sstr;
-			}
-		}
-		template<typename T> Log &operator<<(const T &v) { if (sstr) *sstr << v; return *this; }
-		void operator<<(std::nullptr_t) {}
-	};
-}
+#include "libmegalinker.h"
 
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <filesystem>
+#include <atomic>
 
-struct AR { //ASSERT READ;
-	
-	std::string expected;
-	AR(std::string expected) : expected(expected) {}
-	
-	friend std::istream & operator>>(std::istream &is, const AR& ar) {
-		std::string read;
-		is >> read;
-		if (read != ar.expected) 
-			throw std::runtime_error("Read: " + read + ", expected: " + ar.expected);
-		return is;
-	}
-};
-
-struct HEX { //READ HEXADECIMAL VALUE
-	
-	enum FORMAT {
-		
-		PLAIN, TWO_NIBBLES
-	};
-	
-	struct HEX2DEC : std::vector<int> {
-		HEX2DEC() {
-			resize(256,0);
-			for (int i='0'; i<='9'; i++)
-				at(i) = i-'0';
-				
-			for (int i='A'; i<='F'; i++)
-				at(i) = 10+ i-'A';
+// upToDate checks whether a rom exists, and the modules it linked (listed in its dependency file) and the options are unchanged.
+bool upToDate(const LinkOptions &options, const std::map<std::string, std::vector<Module>> &modules) {
 
-			for (int i='a'; i<='f'; i++)
-				at(i) = 10+ i-'a';
-		}
-	};
-	
-	static uint32_t Hex2Dec(int v) {
-		static HEX2DEC HD;
-		return HD[v];
-	}
-	
-	uint32_t &value;
-	FORMAT format;
-	
-	HEX(uint32_t &value, FORMAT format) : value(value), format(format) {}
-	
-	friend std::istream &operator>>(std::istream &is, HEX&& hex) {
-		
-		hex.value = 0;
-		
-		if (hex.format==TWO_NIBBLES) {
-			
-			std::string s;
-			if (not (is >> s)) return is;
-			if (s.size()!=2) throw std::runtime_error("Not an hex byte");
-			
-			hex.value += Hex2Dec(s[0])<<4;
-			hex.value += Hex2Dec(s[1])<<0;
+	if (options.dependencyFile.empty() or not std::ifstream(options.disk ? diskFileName(options.romName, ".com") : options.romName)) return false;
 
-		} else if (hex.format==PLAIN) {
-			
-			std::string s;
-			if (not (is >> s)) throw std::runtime_error("Could not read expected value");
+	std::ifstream isf(options.dependencyFile);
+	std::set<std::string> names;
+	uint64_t stored = 0;
+	std::string line;
+	while (std::getline(isf, line)) {
 
-			for (auto &c : s)
-				hex.value = hex.value * 16 + Hex2Dec(c);
-		}
-		return is;
+		std::istringstream isl(line);
+		std::string comment, key, name;
+		if (not (isl >> comment >> key) or comment != "#") continue;
+		if (key == "modules:")
+			while (isl >> name)
+				names.insert(name);
+		if (key == "fingerprint:")
+			isl >> std::hex >> stored;
 	}
-};
-
-struct HEX2 : public HEX { HEX2(uint32_t &value) : HEX(value, HEX::TWO_NIBBLES) {} };
-
-struct Module {
-	
-	struct Area {
-		
-		std::string name;
-		uint32_t size;
-		uint32_t addr;
-		uint32_t rom_addr;
-		enum { ABSOLUTE, RELATIVE} type;
-		
-	};
+	return stored and fingerprint(options, modules, names) == stored;
+}
 
-	struct Symbol {
-
-		// Configuration Symbol
-        const std::string prefix_configuration = "___ML_CONFIG_";
-        bool isConfigurationSymbol() const { 
-            
-            if (name.substr(0,prefix_configuration.size()) != prefix_configuration) return false;
-            return true;
-        }
-
-		// Module Segment Symbol
-        const std::string prefix_segment = "___ML_SEGMENT_";
-        bool isSegmentSymbol() const { 
-            
-            if (name.substr(0,prefix_segment.size()) != prefix_segment) return false;
-            if (type == DEF) throw std::runtime_error("A program should not define a Megalinker Segment Symbol: " + name);
-            
-            if (name.size() < prefix_segment.size()+2) throw std::runtime_error("Short Megalinker Segment Symbol: " + name);
-            if (name[prefix_segment.size()+1]!='_') throw std::runtime_error("Malformed Megalinker Segment Symbol: " + name);
-            if (name[prefix_segment.size()] < 'A' or name[prefix_segment.size()] > 'D') throw std::runtime_error("Module Symbol: " + name + " requires a wrong page");
-            return true;
-        }
-
-        std::string getSegmentName() const { 
-			if (not isSegmentSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not a segment symbol");
-			return name.substr(prefix_segment.size()+2); 
+// linkRom links a rom, writes it with its maps, and reports its RAM usage.
+// With skipUnchanged, roms that are up to date are neither linked nor written.
+void linkRom(const LinkOptions &options, const std::map<std::string, std::vector<Module>> &modules, const std::map<std::string, std::vector<std::string>> &streams, bool skipUnchanged = false) {
+
+	if (skipUnchanged and upToDate(options, modules)) {
+		// The outputs are touched, so make sees them newer than the prerequisites that were rebuilt without changes.
+		std::vector<std::string> outputs = { options.dependencyFile };
+		if (options.disk) {
+			outputs.push_back(diskFileName(options.romName, ".com"));
+			outputs.push_back(diskFileName(options.romName, ".ovl"));
+		} else {
+			outputs.push_back(options.romName);
 		}
-		
-        int getSegmentPage() const { 
-			if (not isSegmentSymbol()) throw std::runtime_error("Megalinker Symbol: " + name + " is not a segment symbol");
-			return name[prefix_segment.size()]-'A'; 
+		for (auto &file : outputs) {
+			std::error_code ec;
+			std::filesystem::last_write_time(file, std::filesystem::file_time_type::clock::now(), ec);
 		}
+		printf("%s is up to date.\n", options.romName.c_str());
+		return;
+	}
 
-		// Move Symbols Symbol
-        const std::string prefix_move = "___ML_MOVE_SYMBOLS_TO_";
-        bool isMoveSymbol() const { 
-            
-            if (name.substr( 0, prefix_move.size()) != prefix_move) return false;
-            if (type == REF) throw std::runtime_error("A program should not refer to a Megalinker Segment Symbol: " + name);
-
-			size_t pos = name.find("_FROM_");
-			if (pos == std::string::npos) throw std::runtime_error("Move Symbol: " + name + " has no _FROM_ token");
-			if (name.find("_FROM_",pos+1) != std::string::npos) throw std::runtime_error("Move Symbol: " + name + " has more than one _FROM_ tokens");
-			
-            return true;
-        }
-
-        std::string getMoveTarget() const { 
-
-			if (not isMoveSymbol()) throw std::runtime_error("Module Symbol: " + name + " is not a module append symbol");						
-			return name.substr(prefix_move.size(), name.find("_FROM_") - prefix_move.size()); 
-        }
+	LinkOutput output = link(options, modules, streams);
+	writeOutput(options, output);
+	printf("Using %u bytes of ram, from 0x%04X to 0x%04X.\n", output.ramEnd - output.ramStart, output.ramStart, output.ramEnd);
+	for (auto &growth : output.growth)
+		printf("Budget: %s.\n", growth.c_str());
+	if (not output.patch.empty())
+		printf("%zu segments changed since %s, patched by %s.ips.\n", output.changedSegments.size(), options.previousRom.c_str(), options.romName.c_str());
+}
 
-        std::string getMoveSource() const { 
+// linkBatch links the variants listed in a batch manifest. Each line reads: ROM_FILE [INPUT_FILES] [SYMBOL=VALUE].
+// Paths are relative to the manifest. The shared inputs are linked in every variant, before the inputs of the variant.
+// Each input is read once, and the variants are linked in parallel. Returns the number of variants that failed.
+int linkBatch(const LinkOptions &options, const std::vector<std::string> &shared, const std::string &manifest, bool skipUnchanged) {
 
-			if (not isMoveSymbol()) throw std::runtime_error("Module Symbol: " + name + " is not a module append symbol");						
-			return name.substr(name.find("_FROM_")+6);
-        }
-        
-		std::string name;
-		uint32_t addr;
-		enum { DEF, REF} type;
-		std::string areaName;
-		
-		uint32_t absoluteAddress;
-	};
-	
-	int version = -1;
-	
-	std::string filename, name, content;
-	std::vector<Area> areas;
-	std::vector<Symbol> symbols;
-	
-	bool enabled = false;
-	int page = -1;
-	int segment = 0;
-	bool has_cabs_areas = false;
-};
-
-// preprocessModule makes a 1st pass scan through the REL file of a module.
-// It determines the module name, its symbols, and its areas.
-void preprocessModule(Module &module) {
-
-	std::set<std::string> known_areas = { 
-		"_HEADER0",     // Fixed to segment 0, contains megarom initialization
-		"_CODE",        // Banked code and const data
-		"_DATA",        // Ram that does not need initialization
-		"_XDATA",       // External Ram that does not need initialization
-		"_GSINIT",      // Initialization code to be executed before calling main, sits in segment 0,
-		"_GSFINAL",     // After code is initialized, it only remains to call main,
-		"_INITIALIZED", // RAM that must be initialized
-		"_INITIALIZER", // Contents to initialize RAM, sits in segment 0
-		"_HOME",        // Non banked code that will be copied to RAM on initialization
-		"_CABS#"        // ROM segment at a fixed address
+	struct Variant {
+		LinkOptions options;
+		std::vector<std::string> inputs;
+		std::string error;
 	};
-	
-	std::istringstream isf(module.content);
-	std::string line;
-
-	module.name = "";
-	// If the module comes from a rel file, the module name defaults to the filename.
-	if (module.filename.find(".rel") != std::string::npos) {
-		module.name = module.filename.substr(0, module.filename.find(".rel"));
-		for (auto &&c : module.name) 
-			if (c=='.') 
-				c='_';
+	std::vector<Variant> variants;
+	{
+		std::ifstream isf(manifest);
+		if (not isf) throw std::runtime_error("Could not open batch manifest: " + manifest);
+
+		std::string dir = manifest.find_last_of("/\\") == std::string::npos ? "" : manifest.substr(0, manifest.find_last_of("/\\")+1);
+
+		std::string line;
+		while (std::getline(isf, line)) {
+
+			std::istringstream isl(line.substr(0, line.find('#')));
+			Variant variant;
+			variant.options = options;
+			variant.inputs = shared;
+			if (not (isl >> variant.options.romName)) continue;
+			if (variant.options.romName[0]!='/') variant.options.romName = dir + variant.options.romName;
+			if (not options.dependencyFile.empty()) variant.options.dependencyFile = variant.options.romName + ".d";
+
+			std::string word;
+			while (isl >> word) {
+				if (word.find('=') != std::string::npos) {
+					std::string name = word.substr(0, word.find('='));
+					try {
+						variant.options.overrides[name] = std::stoul(word.substr(word.find('=')+1), nullptr, 0);
+					} catch (std::exception &) {
+						throw std::runtime_error("Wrong value of " + name + " for " + variant.options.romName + " in: " + manifest);
+					}
+				} else {
+					variant.inputs.push_back(word[0]=='/' ? word : dir + word);
+				}
+			}
+			variant.options.inputs = variant.inputs;
+			variants.push_back(variant);
+		}
 	}
 
-	Log(2) << "File name: " << module.filename << " (" << module.name << ")"; 
-		
-	
-	while (std::getline(isf, line)) {
-		
-		std::istringstream isl(line);
-		std::string type;
-		isl >> type;
-
-		if (type=="XL2") { // HEADER
-			
-			module.version = 2;
-
-		} else if (type=="XL3") {
-			
-			module.version = 3;
-
-		} else if (type=="XL4") {
-			
-			module.version = 4;
-
-		} else if (type=="M") {
-			
-			// The module name is implicitly declared.
-			isl >> module.name;
-			Log(1) << "Module name: " << module.name << " (" << module.filename << ")"; 
-			
-		} else if (type=="O") { // NOT NEEDED
-		} else if (type=="H") { // NOT NEEDED
-		} else if (type=="S") {
-			
-			Module::Symbol symbol;
-			std::string st = "   ";
-			
-			isl >> symbol.name >> st[0] >> st[1] >> st[2] >> HEX(symbol.addr, HEX::PLAIN);
-			
-				
-			if (st=="Def") {
-				symbol.type = Module::Symbol::DEF;
-			} else if (st=="Ref") {
-				symbol.type = Module::Symbol::REF;
-			} else throw std::runtime_error("Symbol type unexpected");
-			
-			if (not module.areas.empty())
-				symbol.areaName = module.areas.back().name;
-			
-			module.symbols.push_back(symbol);
-			
-			if (module.name.empty() and symbol.type == Module::Symbol::DEF and symbol.name.size()>1 and symbol.name[0]=='_') {
-				module.name = symbol.name.substr(1);
-				Log(1) << "Rel named after symbol" << module.name << " (" << module.filename << ")"; 
-			}
-			
-		} else if (type=="A") {
-			
-			Module::Area area;
-			
-			uint32_t flags;
-			isl >> area.name >> AR("size") >> HEX(area.size,HEX::PLAIN) 
-				>> AR("flags") >> flags 
-				>> AR("addr") >> HEX(area.addr,HEX::PLAIN);
-				
-			if (area.name.size()>0 and area.name[0]!='_')
-				area.name = '_' + area.name;
-							
-			if (flags==0) {
-				area.type = Module::Area::RELATIVE;
-			} else if (flags==8) {
-				area.type = Module::Area::ABSOLUTE;
-			} else throw std::runtime_error("Unexpected flag");
-			
-			
-			if (area.size>0) {
-				
-				Log(1) << "Found area: " << area.name << " of size: " << area.size;
-				
-				if (area.name.substr(0,5) == "_CABS") {
-					known_areas.insert(area.name);
-					module.has_cabs_areas = true;
-				}
-				
-				if (known_areas.count(area.name) == 0) 
-					throw std::runtime_error("Area " + area.name +" unknown");
+	std::map<std::string, Input> cache;
+	for (auto &variant : variants)
+		for (auto &arg : variant.inputs)
+			if (not cache.count(arg))
+				cache.emplace(arg, readInput(arg));
+
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		for (size_t i = next++; i < variants.size(); i = next++) {
+			auto &variant = variants[i];
+			try {
+				std::map<std::string, std::vector<Module>> modules;
+				std::map<std::string, std::vector<std::string>> streams;
+				for (auto &arg : variant.inputs)
+					addInput(modules, streams, cache.at(arg), arg);
+
+				linkRom(variant.options, modules, streams, skipUnchanged);
+			} catch (std::exception &e) {
+				variant.error = e.what();
 			}
-			
-			// NOTE: if the _HEADER0 area is defined, the module must be enabled. Other modules will be enabled on demand.
-			if (area.name=="_HEADER0") module.enabled=true;
+		}
+	};
 
-			module.areas.push_back(area);
-			
-		} else if (type=="T") { // NOT NOW
-		} else if (type=="R") { // NOT NOW
-		} else if (not type.empty()) {
-			
-			throw std::runtime_error("Unrecognized type: " + type);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < std::max(1U, std::thread::hardware_concurrency()) and i < variants.size(); i++)
+		threads.emplace_back(worker);
+	for (auto &thread : threads)
+		thread.join();
+
+	int failed = 0;
+	for (auto &variant : variants) {
+		if (variant.error.empty()) {
+			Log(1) << "Linked: " << variant.options.romName;
+		} else {
+			Log(3) << "Failed: " << variant.options.romName << ": " << variant.error;
+			failed++;
 		}
 	}
-
-	if (module.name.empty()) throw std::runtime_error("Module not given a name, and we could not determine a name for it: " + module.filename);
-	if (module.version < 0) throw std::runtime_error("Object format not recognized.");
+	return failed;
 }
 
-
-////////////////////////////////////////////////////////////////////////
-
 int main(int argc, char *argv[]) {
 	
 	Log::reportLevel(10);
 	
-	std::string romName = "out.rom";
-	std::map<std::string, std::vector<Module>> modules;
+	LinkOptions options;
+	bool watch = false;
+	std::string batch;
+	bool dependencies = false, skipUnchanged = false;
+	std::vector<std::string> inputs;
 	
-	// PREPROCESS ARGUMENTS AND INPUT FILES
+	// PREPROCESS ARGUMENTS
 	for (int i=1; i<argc; i++) {
 		
 		std::string arg = argv[i];
@@ -361,852 +179,206 @@ int main(int argc, char *argv[]) {
 				if (sscanf(argv[i], "%i", &level) != 1) throw std::runtime_error("Unrecognized level" + arg);
 				Log::reportLevel(level);
 				
-			} else if (arg == "-h" or arg == "--help") {
-			
-				std::cout << "Megalinker: linker to build of Megaroms for MSX using SDCC" << std::endl;
-				std::cout << "Usage: megalinker [OPTION] [ROM_FILE] [REL_FILES] [LIB_FILES]" << std::endl;
-				std::cout << "  Option: -l N sets the debug level to N (default is 3)" << std::endl;
-				std::cout << "  Option: -h prints this help message" << std::endl;
-				std::cout << "  *.rom: the output rom file (only the last one counts)" << std::endl;
-				std::cout << "  *.rel: any number of compiled relocatable files from sdcc. Only the required files will be used." << std::endl;
-				std::cout << "  *.lib: any number of sdcc library files that contain relocatable files from sdcc. Those are processed as if they were individually supplied to the linker" << std::endl << std::endl;
-				
-				std::cout << "for more documentation: https://github.com/MartinezTorres/megalinker " << std::endl;
-				return 1;
-				
-			} else throw std::runtime_error("Unknown flag " + arg);
-			
-			
-		} else if (arg.substr(arg.find_last_of(".")) == ".rom") {
+			} else if (arg == "-s" or arg == "--stack") {
 
-			Log(1) << "Rom name: " << arg;
-			romName = arg;
-			
-		} else if (arg.substr(arg.find_last_of(".")) == ".rel") {	
-			
-			Log(1) << "Processing: " << arg;
-			Module module;
-			module.filename = arg;
-			
-			std::ifstream isf(arg);
-			std::stringstream buffer;
-			buffer << isf.rdbuf();
-			module.content = buffer.str();
-			
-			preprocessModule(module);
-			if (modules.count(module.name) == 0) {
+				if (i==argc-1) throw std::runtime_error("Stack annotation file required but not specified");
+				i++;
 
-				modules[module.name].push_back(module);
+				options.stackAnnotations = argv[i];
 
-			} else if (modules[module.name].front().filename != module.filename) {
-				throw std::runtime_error("File " + arg + " declares a module already defined in: " + modules[module.name].front().filename);
-			}
+			} else if (arg == "-i" or arg == "--instrument") {
 
-		} else if (arg.substr(arg.find_last_of(".")) == ".lib") {	
+				options.instrument = true;
 
-			Log(1) << "Processing: " << arg;
-			std::ifstream isf(arg);
-			
-			std::string ar_signature = "!<arch>\n"; 
-			isf.read(&ar_signature[0],8); 
-			if (ar_signature != "!<arch>\n") throw std::runtime_error("Wrong signature in archive: " + arg);
-			
-			while (isf) {
-				std::string ar_file_name(16+1,0);
-				isf.read(&ar_file_name[0],16); 
-				
-				if (!isf) break;
+			} else if (arg == "-g" or arg == "--gc") {
 
-				std::string ar_buffer(12+6+6+8+1,0);
-				isf.read(&ar_buffer[0],12+6+6+8); 
+				options.gc = true;
 
-				std::string ar_size(10+1,0);
-				isf.read(&ar_size[0],10); 
-				std::istringstream issize(ar_size);
-				size_t ar_file_size;
-				issize >> ar_file_size;
-				
-				isf.read(&ar_buffer[0],2); 
+			} else if (arg == "-f" or arg == "--fold") {
 
-				Log(1) << "Found in archive: " << ar_file_name << "(" << ar_file_size << ")";
+				options.fold = true;
 
-				if (!isf) throw std::runtime_error("library terminates before reading full file");
-				
-				Module module;
-				module.filename = ar_file_name;
-				module.content.resize(ar_file_size);
-				isf.read(&module.content[0],ar_file_size); 
+			} else if (arg == "-b" or arg == "--batch") {
 
-				if (!isf) break;
-				if (!isf) throw std::runtime_error("library terminates before reading entire file");
-				
-				
-				if (module.content.size()>10 and module.content.substr(0,2)=="XL") {
-					
-					preprocessModule(module);
-					if (modules.count(module.name)) throw std::runtime_error("File " + arg + " declares a module already defined in: " + modules[module.name].front().filename);
-					modules[module.name].push_back(module);
-
-				} else {
-					
-					Log(2) << "File " << ar_file_name << " not a relocatable object file";
-				} 
-				
-				if (ar_file_size % 2 == 1) isf.get(); // Align to 2
-			}
-		}
-	}
-			
-	// PROCESS THE MOVE_TO_ DIRECTIVE
-	{
-		std::map<std::string, std::string > moveDirectives;
-
-		for (auto &mp : modules) {
-			for (auto &module : mp.second) {
-				for (auto &sym : module.symbols) {
-					if (not sym.isMoveSymbol()) continue;
-					std::string source = sym.getMoveSource();
-					std::string target = sym.getMoveTarget();
-					
-					if (moveDirectives.count(source) and moveDirectives[source] != target) throw std::runtime_error("Module symbols can not be send to more than one target: (" + source + " -> " + target + ")" );
-					if (modules.count(source)==0) throw std::runtime_error("Unknown source module: " + source );
-					
-					moveDirectives[source] = target;
-				}
-			}
-		}
-		
-		for (auto &md : moveDirectives) {
-
-			if (moveDirectives.count(md.second)) 
-				throw std::runtime_error("Moving symbols functionality does not support chains (yet)" );
-			
-			for (auto &mp : modules[md.first]) {
-				Log(3) << "Moving module: " << mp.name << " to " << md.second;
-				modules[md.second].push_back(mp);
-			}
-			modules.erase(md.first);
-		}
-	}
-	
-	// ENABLE ALL REQUIRED FILES / MODULES
-	for (;;) {
-		
-		bool updated = false;
-
-		std::map<std::string,int> referencedSymbols;
+				if (i==argc-1) throw std::runtime_error("Batch manifest required but not specified");
+				i++;
 
-		for (auto &mp : modules) {
-			for (auto &module : mp.second) {
-				
-				if (not module.enabled) continue;
-				
-				for (auto &sym : module.symbols) {
-					
-					if (sym.type != Module::Symbol::REF) continue;
-					
-					if (sym.isConfigurationSymbol()) continue;
-					
-					if (sym.isSegmentSymbol()) {
-						
-						std::string requiredModule = sym.getSegmentName(); 
-						
-						if (modules.count(requiredModule)==0) throw std::runtime_error("Module: " + module.name + " requires unknown module: " + requiredModule );
-
-						for (auto &m : modules[requiredModule]) {
-							if (m.enabled == false) {
-								m.enabled = true;
-								updated = true;
-							}
-						}
-
-						continue;
-					}
-					
-					referencedSymbols[sym.name] = 0;
-				}
-			}
-		}
+				batch = argv[i];
 
-		for (auto &mp : modules) {
-			for (auto &module : mp.second) {
-				for (auto &sym : module.symbols) {
-					
-					if (sym.type != Module::Symbol::DEF) continue;
-
-					if (sym.isConfigurationSymbol()) continue;
-						
-					if (not module.enabled and referencedSymbols.count(sym.name)) {
-						module.enabled = true;
-						updated = true;
-					}
-					
-					if (module.enabled and referencedSymbols.count(sym.name)) {
-						
-						if (referencedSymbols[sym.name]>0) throw std::runtime_error("Symbol: " + sym.name + " defined multiple times");
-						referencedSymbols[sym.name]++;
-					}
-				}
-			}
-		}
-		
-		for (auto &ref : referencedSymbols) {
-
-			if (ref.second==0) {
-
-				std::string errorString = std::string("Referenced Symbol: ") + ref.first + " not defined. Required by the following modules: ";
-
-				for (auto &mp : modules) {
-					for (auto &module : mp.second) {
-						
-						if (not module.enabled) continue;
-						
-						for (auto &sym : module.symbols) {
-							
-							if (sym.name != ref.first) continue;
-							
-							if (sym.type != Module::Symbol::REF) continue;
-							
-							if (sym.isConfigurationSymbol()) continue;
-							
-							if (sym.isSegmentSymbol()) continue;
-							
-							errorString += module.name;
-							errorString += " ";
-						}
-					}
-				}				
+			} else if (arg == "-MD") {
 
-				throw std::runtime_error(errorString);
-			}
-		}
-				
-		if (not updated) break;
-	}
+				dependencies = true;
 
-	// REMOVE NON ENABLED SUB-MODULES
-	for (auto &mp : modules) {
-		auto &m = mp.second;
-		auto it =  std::remove_if(m.begin(), m.end(), [](const Module &item) { return not item.enabled; });
-		m.erase(it, m.end());
-	}
+			} else if (arg == "-MF") {
 
-	// REMOVE MODULES WITHOUT ACTIVE SUB-MODULES
-	for (auto it = modules.begin(); it != modules.end(); ) {
-        if (it->second.empty())
-			it = modules.erase(it);
-        else
-            ++it;
-    }
- 
-	// PAGE ALLOCATION AND ERROR CHECKING
-	{
-		for (auto &mp : modules) {
-			for (auto &module : mp.second) {
-				for (auto &sym : module.symbols) {
-					if (not sym.isSegmentSymbol()) continue;
-					
-					std::string requiredModule = sym.getSegmentName(); 
-					int requiredPage = sym.getSegmentPage();
-					
-					for (auto &m : modules[requiredModule]) {
-						if (m.page == -1)
-							m.page = requiredPage;
-					
-						if (m.page != requiredPage)
-							throw std::runtime_error("Module " + requiredModule + " required at different pages");
-					}
-				}
-			}
-		}
-	}
-	
-	std::map<std::string, uint32_t> megalinkerSymbols;
-	// FIND ALL MEGALINKER DEFINED CONFIGURATION SYMBOLS
-	{
-		for (auto &mp : modules) {
-			for (auto &module : mp.second) {
-				for (auto &sym : module.symbols) {
-					if (sym.type != Module::Symbol::DEF) continue;
-					if (not sym.isConfigurationSymbol()) continue;
-										
-					if (megalinkerSymbols.count(sym.name) and megalinkerSymbols[sym.name] != sym.addr)
-						throw std::runtime_error("Conflicting definitions of: " + sym.name );
-						
-					megalinkerSymbols[sym.name] = sym.addr;
-				}
-			}
-		}
-	}
-	
-	uint32_t rom_ptr = -1;
-	uint32_t ram_ptr = -1;
-	if (megalinkerSymbols.count("___ML_CONFIG_RAM_START")==0) throw std::runtime_error("___ML_CONFIG_RAM_START not defined");
-	ram_ptr = megalinkerSymbols["___ML_CONFIG_RAM_START"];
-	
-	// ALLOCATE ALL NON BANKABLE AREAS
-	{
-
-		for (auto &mp : modules) {
-			for (auto &module : mp.second) {
-				for (auto &area:  module.areas) {
-					if (area.name!="_HEADER0") continue;
-					if (rom_ptr!=uint32_t(-1)) throw std::runtime_error(area.name + " defined more than once: " + module.filename);
-					if (area.type != Module::Area::ABSOLUTE) throw std::runtime_error(area.name + " not absolute: " + module.filename);
-					if (area.addr != 0x4000) throw std::runtime_error("HEADER not at 0x4000: " + module.filename);
-		
-					rom_ptr = area.addr;
-					area.rom_addr = area.addr;
-					rom_ptr += area.size;
-				}
-			}
-		}
-		
-		for (auto &mp : modules) {
-			for (auto &module : mp.second) {
-				for (auto &area:  module.areas) {
-					if (area.name!="_GSINIT") continue;
-					if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
-
-					area.addr = rom_ptr;
-					area.rom_addr = area.addr;
-					rom_ptr += area.size;
-				}
-			}
-		}
+				if (i==argc-1) throw std::runtime_error("Dependency file required but not specified");
+				i++;
 
-		for (auto &mp : modules) {
-			for (auto &module : mp.second) {
-				for (auto &area:  module.areas) {
-					if (area.name!="_GSFINAL") continue;
-					if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
+				options.dependencyFile = argv[i];
 
-					area.addr = rom_ptr;
-					area.rom_addr = area.addr;
-					rom_ptr += area.size;
-				}
-			}
-		}
+			} else if (arg == "-u" or arg == "--skip-unchanged") {
 
-		megalinkerSymbols["___ML_CONFIG_INIT_ROM_START"] = rom_ptr;
-		megalinkerSymbols["___ML_CONFIG_INIT_RAM_START"] = ram_ptr;
+				skipUnchanged = true;
 
-		for (auto &mp : modules) {
-			for (auto &module : mp.second) {
-				for (auto &area:  module.areas) {
-					if (area.name!="_HOME") continue;
-					if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
+			} else if (arg == "-p" or arg == "--previous") {
 
-					area.addr = ram_ptr;
-					area.rom_addr = rom_ptr;
-					rom_ptr += area.size;
-					ram_ptr += area.size;
-				}
-			}
-		}
+				if (i==argc-1) throw std::runtime_error("Previous rom required but not specified");
+				i++;
 
+				options.previousRom = argv[i];
 
-		for (auto &mp : modules) {
-			for (auto &module : mp.second) {
-				for (auto &area:  module.areas) {
-					if (area.name!="_INITIALIZER") continue;
-					if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
+			} else if (arg == "-r" or arg == "--report") {
 
-					area.addr = rom_ptr;
-					area.rom_addr = area.addr;
-					rom_ptr += area.size;
-				}
-			}
-		}
-		megalinkerSymbols["___ML_CONFIG_INIT_SIZE"] = rom_ptr - megalinkerSymbols["___ML_CONFIG_INIT_ROM_START"];
+				options.budget = true;
 
-		for (auto &mp : modules) {
-			for (auto &module : mp.second) {
-				for (auto &area:  module.areas) {
-					if (area.name!="_INITIALIZED") continue;
-					if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
+			} else if (arg == "--diff") {
 
-					area.addr = ram_ptr;
-					area.rom_addr = uint32_t(-1);
-					ram_ptr += area.size;
-				}
-			}
-		}
-
-		for (auto &mp : modules) {
-			for (auto &module : mp.second) {
-				for (auto &area:  module.areas) {
-					if (area.name!="_DATA") continue;
-					if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
+				if (i==argc-1) throw std::runtime_error("Previous budget report required but not specified");
+				i++;
 
-					area.addr = ram_ptr;
-					area.rom_addr = uint32_t(-1);
-					ram_ptr += area.size;
-				}
-			}
-		}
+				options.budget = true;
+				options.budgetBaseline = argv[i];
 
-		for (auto &mp : modules) {
-			for (auto &module : mp.second) {
-				for (auto &area:  module.areas) {
-					if (area.name!="_XDATA") continue;
-					if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
+			} else if (arg == "-c" or arg == "--calls") {
 
-					area.addr = ram_ptr;
-					area.rom_addr = uint32_t(-1);
-					ram_ptr += area.size;
-				}
-			}
-		}
+				options.callGraph = true;
 
-		megalinkerSymbols["___ML_CONFIG_INIT_RAM_END"] = ram_ptr;
-		megalinkerSymbols["___ML_CONFIG_INIT_RAM_SIZE"] = ram_ptr - megalinkerSymbols["___ML_CONFIG_INIT_RAM_START"];
-	}
+			} else if (arg == "-d" or arg == "--disk") {
 
-	// ALLOCATE BANKABLE CODE AREAS
-	{	
-		std::vector<std::pair<uint32_t,std::string>> bankableModules;
-		
-		for (auto &mp : modules) {
-			bankableModules.emplace_back(0,mp.first);
-			for (auto &module : mp.second) {
-
-				for (auto &area:  module.areas) {
-					if (area.name.substr(0,5)!="_CABS") continue;
-					if (area.size==0) continue;
-					if (module.page<0) throw std::runtime_error(module.name + " used but not allocated a page");
-					if (area.type != Module::Area::ABSOLUTE) throw std::runtime_error(area.name + " not absolute CABS section in: " + module.filename);
-					
-					if (bankableModules.back().first > (area.addr % 0x2000)) 
-						throw std::runtime_error("Overlapping CABS sections in: " + module.filename);
-					
-					bankableModules.back().first = (area.addr % 0x2000) + area.size;
-				}
+				options.disk = true;
 
+			} else if (arg == "-w" or arg == "--watch") {
 
-				for (auto &area:  module.areas) {
-					if (area.name!="_CODE") continue;
-					if (area.size==0) continue;
-					if (module.page<0) throw std::runtime_error(module.name + " used but not allocated a page");
-					if (area.type != Module::Area::RELATIVE) throw std::runtime_error(area.name + " not relative: " + module.filename);
-					
-					bankableModules.back().first += area.size;
-				}
+				watch = true;
 
+			} else if (arg == "-h" or arg == "--help") {
+			
+				std::cout << "Megalinker: linker to build of Megaroms for MSX using SDCC" << std::endl;
+				std::cout << "Usage: megalinker [OPTION] [ROM_FILE] [REL_FILES] [LIB_FILES] [ASSET_FILES]" << std::endl;
+				std::cout << "  Option: -l N sets the debug level to N (default is 3)" << std::endl;
+				std::cout << "  Option: -s FILE computes the worst case stack usage using the annotations in FILE, and checks it against the RAM usage" << std::endl;
+				std::cout << "  Option: -i allocates the bank switch counters used by megalinker.h when compiled with ML_INSTRUMENT" << std::endl;
+				std::cout << "  Option: -g removes the functions and data of _CODE that are not reachable from the referenced symbols" << std::endl;
+				std::cout << "  Option: -f keeps a single copy of the identical relocation free ranges of _CODE (constant data and leaf code)" << std::endl;
+				std::cout << "  Option: -b FILE links the variants listed in FILE, one \"ROM_FILE [INPUT_FILES] [SYMBOL=VALUE]\" per line, adding the inputs of the command line to each one" << std::endl;
+				std::cout << "  Option: -MD writes ROM_FILE.d, a make rule with the files and library members that contribute to the rom" << std::endl;
+				std::cout << "  Option: -MF FILE writes the dependency rule to FILE" << std::endl;
+				std::cout << "  Option: -u skips the link if the rom exists and the modules listed in its dependency file are unchanged" << std::endl;
+				std::cout << "  Option: -p FILE keeps the modules in their segments of the previous link of FILE, and writes ROM_FILE.ips, a patch from FILE" << std::endl;
+				std::cout << "  Option: -r writes ROM_FILE.budget.json, the ROM and RAM usage by segment, page and module" << std::endl;
+				std::cout << "  Option: --diff FILE writes the budget report, and lists the modules and segments that grew since the report FILE" << std::endl;
+				std::cout << "  Option: -c writes ROM_FILE.calls.dot and ROM_FILE.calls.json, the references between modules with their segments, pages and mapper writes, and fails on illegal bank switches" << std::endl;
+				std::cout << "  Option: -d writes an MSX-DOS program (ROM_FILE with extension .com) with the boot segments, and an overlay (.ovl) with all the segments, loaded by megalinker_disk.s; each bank switch copies 8KB (about 3 frames)" << std::endl;
+				std::cout << "  Option: -w keeps running, and links again whenever an input file changes" << std::endl;
+				std::cout << "  Option: -h prints this help message" << std::endl;
+				std::cout << "  *.rom: the output rom file (only the last one counts)" << std::endl;
+				std::cout << "  *.rel: any number of compiled relocatable files from sdcc. Only the required files will be used." << std::endl;
+				std::cout << "  *.lib: any number of sdcc library files that contain relocatable files from sdcc. Those are processed as if they were individually supplied to the linker" << std::endl;
+				std::cout << "  *.bin: any number of binary assets, each one becomes a module named after the file" << std::endl;
+				std::cout << "  *.assets: any number of asset manifests, with one \"name path [options]\" asset per line" << std::endl << std::endl;
 				
-				// If we have CABS areas we reserve an entire segment.
-				if (module.has_cabs_areas)
-					bankableModules.back().first = std::max(bankableModules.back().first, 0x2000U);
-			}		
-			if (bankableModules.back().first>0x2000) throw std::runtime_error("Module " + mp.first + " too large to fit a segment");
-		}
-		
-		std::sort(bankableModules.begin(), bankableModules.end());
-		std::reverse(bankableModules.begin(), bankableModules.end());
-
-		std::vector<uint32_t> segments;
-		segments.push_back(std::max(0U, 0x6000-rom_ptr));
-		if (segments.back()==0) segments.push_back(std::max(0U, 0x8000-rom_ptr));
-		if (segments.back()==0) segments.push_back(std::max(0U, 0xA000-rom_ptr));
-		if (segments.back()==0) segments.push_back(std::max(0U, 0xC000-rom_ptr));
-		if (segments.back()==0) throw std::runtime_error("Header too large");
+				std::cout << "for more documentation: https://github.com/MartinezTorres/megalinker " << std::endl;
+				return 1;
 				
-		for (auto& [size, name]: bankableModules) {
+			} else throw std::runtime_error("Unknown flag " + arg);
 			
-			uint32_t i;
-			for (i=0; i<segments.size() and segments[i]<size; i++);
-			if (i==segments.size()) 
-				segments.push_back(0x2000);
+			
+		} else if (arg.substr(arg.find_last_of(".")) == ".rom") {
 
-			for (auto &module : modules[name]) {
-				module.segment = i;
-				
-				for (auto &area:  module.areas) {
-					if (area.name.substr(0,5)!="_CABS") continue;
-					if (area.size==0) continue;
-
-					for (auto &symbol : module.symbols) {
-						if (symbol.type != Module::Symbol::DEF) continue;
-						if (symbol.areaName != area.name) continue;
-						
-						symbol.addr -= area.addr;
-					}
-							
+			Log(1) << "Rom name: " << arg;
+			options.romName = arg;
 
-					//area.addr = 0x2000*(2+module.page) + 0x2000 - segments[i]; 
-					
-					Log(3) << "Addr: " << area.addr << " " << area.size;
-					
-					Log(3) << "Addr check: " << area.addr << " = " << 0x2000*(2+module.page)+(area.addr % 0x2000);
-					
-					area.rom_addr = 0x2000*(2+i) + (area.addr % 0x2000);
+		} else {
 
-					segments[i] = 0x2000 - (area.addr % 0x2000) - area.size;
+			inputs.push_back(arg);
+		}
+	}
 
-					Log(2) << "Module: " << module.name << " addressed at: 0x" << std::hex << area.addr << std::dec << " (" << area.size << " bytes) in page: " << module.page << " and segment " << module.segment;
-				}
-				
-				for (auto &area:  module.areas) {
-					if (area.name != "_CODE") continue;
+	if (options.disk and not options.previousRom.empty())
+		throw std::runtime_error("A disk link has no rom to patch, -p can not be combined with -d");
 
-					area.addr = 0x2000*(2+module.page) + 0x2000 - segments[i]; 
-					area.rom_addr = 0x2000*(2+i) + 0x2000 - segments[i];
+	options.inputs = inputs;
 
-					segments[i] -= area.size;
+	if (dependencies and options.dependencyFile.empty())
+		options.dependencyFile = options.romName + ".d";
+	if (skipUnchanged and options.dependencyFile.empty())
+		throw std::runtime_error("Skipping unchanged roms requires a dependency file (-MD or -MF)");
 
-					Log(2) << "Module: " << module.name << " addressed at: 0x" << std::hex << area.addr << std::dec << " (" << area.size << " bytes) in page: " << module.page << " and segment " << module.segment;
-				}
-			}
-		}
-	}
-	
-	
-	// Generate area map
-	{
-		std::ofstream off(romName + ".areas.map");
-		off << "AREA MAP: " << std::endl;
-		off << "# SG #  MAP #  ROM  # SIZE #   NAME   #        HEADER        #        PAGE A        #        PAGE B        #        PAGE C        #        PAGE D        #" << std::endl;
-		off << "##########################################################################################################################################################" << std::endl;
-		for (uint32_t i=0; i<256; i++) {
-			
-			std::multimap<uint32_t, std::string> lines;
-			
-			for (auto &mp : modules) {
-				for (auto &module : mp.second) {
-					if (module.segment != (int)i) continue;
-					for (auto &area:  module.areas) {
-						if (area.size==0) continue;
-							
-						std::ostringstream oss;
-						
-						char s[200];
-						if (area.rom_addr==uint32_t(-1)) {
-							snprintf(s,199,"#%3X # %04X # ----- # %04X # %8.8s #",module.segment, area.addr, area.size, area.name.substr(1).c_str());
-						} else {
-							snprintf(s,199,"#%3X # %04X # %05X # %04X # %8.8s #",module.segment, area.addr, area.rom_addr, area.size, area.name.substr(1).c_str());
-						}
-						oss << s;
-						for (int j=-1; j<module.page; j++) oss << "                      #";
-						snprintf(s,199," %20.20s #",module.name.c_str());
-						oss << s;	
-						for (int j=module.page+1; j<4; j++) oss << "                      #";
-						lines.emplace(area.addr,oss.str());
-						
-					}	
-				}
-			}
-			for (auto &&s : lines)
-				off << s.second << std::endl;
-			if (not lines.empty()) 
-				off << "##########################################################################################################################################################" << std::endl;
+	if (not batch.empty()) {
 
-		}
+		if (watch) throw std::runtime_error("Watch mode links a single ROM, it can not be combined with a batch");
+		if (not options.budgetBaseline.empty()) throw std::runtime_error("A budget report belongs to a single ROM, it can not be combined with a batch");
+		if (not options.previousRom.empty()) throw std::runtime_error("A previous rom belongs to a single ROM, it can not be combined with a batch");
+		if (not dependencies and not options.dependencyFile.empty()) throw std::runtime_error("Each variant of a batch has its own dependency file, use -MD instead of -MF");
+		return linkBatch(options, inputs, batch, skipUnchanged) ? 1 : 0;
 	}
 
-	// Generate symbols map
-	{
-		std::ofstream off(romName + ".symbols.map");
-		off << "Symbols MAP: " << std::endl;
-		off << "# SG #  MAP #  ROM  #  MODULE  #        HEADER        #        PAGE A        #        PAGE B        #        PAGE C        #        PAGE D        #" << std::endl;
-		off << "###################################################################################################################################################" << std::endl;
-		for (uint32_t i=0; i<256; i++) {
-			
-			std::multimap<uint32_t, std::string> lines;
-			
-			for (auto &mp : modules) {
-				for (auto &module : mp.second) {
-					if (module.segment != (int)i) continue;
-					for (auto &area:  module.areas) {
-						if (area.size==0) continue;
-
-						for (auto &symbol : module.symbols) {
-							if (symbol.type != Module::Symbol::DEF) continue;
-							if (symbol.areaName != area.name) continue;
-							
-							std::ostringstream oss;
-							
-							char s[200];
-							if (area.rom_addr==uint32_t(-1)) {
-								snprintf(s,199,"#%3X # %04X # ----- # %-8.8s #",module.segment, area.addr + symbol.addr, module.name.c_str());
-							} else {
-								snprintf(s,199,"#%3X # %04X # %05X # %-8.8s #",module.segment, area.addr + symbol.addr, area.rom_addr + symbol.addr, module.name.c_str());
-							}
-							oss << s;
-							for (int j=-1; j<module.page; j++) oss << "                      #";
-							snprintf(s,199," %-20.20s #",symbol.name.c_str());
-							oss << s;	
-							for (int j=module.page+1; j<4; j++) oss << "                      #";
-							lines.emplace(area.addr,oss.str());
-						
-						}
-					}	
-				}
-			}
-			for (auto &&s : lines)
-				off << s.second << std::endl;
-			if (not lines.empty()) 
-				off << "###################################################################################################################################################" << std::endl;
+	if (not watch) {
 
-		}
-	}
+		std::map<std::string, std::vector<Module>> modules;
+		std::map<std::string, std::vector<std::string>> streams;
+		for (auto &arg : inputs)
+			addInput(modules, streams, readInput(arg), arg);
 
-	Log(2) << "Allocated: " << (rom_ptr-0x4000) << " bytes of ROM";
-	if (rom_ptr>0xC000) throw std::runtime_error("Main segment ROM doesn't fit 32KB");
+		linkRom(options, modules, streams, skipUnchanged);
+		return 0;
+	}
 
-	Log(2) << "Allocated: " << (ram_ptr-megalinkerSymbols["___ML_CONFIG_RAM_START"]) << " bytes of RAM";		
-	if (ram_ptr>0xF000) throw std::runtime_error("Ram area dangerously close to stack.");
-	
-	// DO LABEL SYMBOL ADDRESSES
-	std::map<std::string,uint32_t> symbolsAddress;
-	for (auto &mp : modules) {
-		for (auto &module : mp.second) {
-			std::map<std::string, uint32_t> areaAddress;
-			for (auto &area:  module.areas) 
-				areaAddress[area.name] = area.addr;
-				
-			for (auto &symbol : module.symbols) {
-				if (symbol.type == Module::Symbol::DEF) {
-					symbolsAddress[symbol.name] = areaAddress[symbol.areaName] + symbol.addr;
-					symbol.absoluteAddress = symbolsAddress[symbol.name];
-					if (symbol.name[0]!='.') 
-						Log(2) << "Symbol: " << symbol.name << " defined at: 0x" << std::hex << symbol.absoluteAddress << std::dec << " at page: " << module.page;
-				}
+	// WATCH THE INPUT FILES
+	// Inputs are kept in memory, and only read again when one of their files changes.
+	// Thus relinking after an edit does not parse the unchanged libraries again.
+	{
+		auto stampOf = [](const std::vector<std::string> &files) {
+			std::vector<std::filesystem::file_time_type> stamp;
+			for (auto &file : files) {
+				std::error_code ec;
+				stamp.push_back(std::filesystem::last_write_time(file, ec));
 			}
-		}
-	}
-	
-	// DO EXTRACT THE CODE
-	std::vector<uint8_t> rom(0x20000,0xff);
-	for (auto &mp : modules) {
-		for (auto &module : mp.second) {
-		
-			std::istringstream isf(module.content);
-			std::string line;
-			
-			uint32_t current_area=0;
-			std::vector<int> area_addr;
-			std::vector<int> area_rom_addr;
-			for (auto &area : module.areas) {
-				if (area.type == Module::Area::RELATIVE) {
-					area_addr.push_back(area.addr); 
-					area_rom_addr.push_back(area.rom_addr); 
-				} else {
-					if (area.size)
-						Log(3) << "Module: " << module.name << " Area: " << area.name << " " << area.addr << " " << area.rom_addr;
-//					area_addr.push_back(area.addr); 
-					area_rom_addr.push_back(area.rom_addr & 0xFFFFE000); 
-					area_addr.push_back(0);
-//					area_rom_addr.push_back(0);
-				}
+			return stamp;
+		};
+
+		std::map<std::string, Input> cache;
+		std::map<std::string, std::vector<std::filesystem::file_time_type>> cacheStamps;
+		std::vector<std::filesystem::file_time_type> lastStamp;
+		while (true) {
+
+			std::vector<std::string> watched;
+			for (auto &arg : inputs)
+				for (auto &file : (cache.count(arg) ? cache.at(arg).files : std::vector<std::string>{arg}))
+					watched.push_back(file);
+			if (not options.stackAnnotations.empty())
+				watched.push_back(options.stackAnnotations);
+
+			std::vector<std::filesystem::file_time_type> stamp = stampOf(watched);
+			if (stamp == lastStamp) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(200));
+				continue;
 			}
-				
-			uint32_t last_t_pos=0;
-			std::vector<uint8_t> T;
-			
-			while (std::getline(isf, line)) {
-				
-				std::istringstream isl(line);
-				std::string type;
-				isl >> type;
-
-				if (type=="XL2") { // HEADER
-				} else if (type=="XL3") { // NOT HERE
-				} else if (type=="XL4") { // NOT HERE
-				} else if (type=="M") { // NOT HERE
-				} else if (type=="O") { // NOT NEEDED
-				} else if (type=="H") { // NOT NEEDED
-				} else if (type=="S") { // NOT HERE
-				} else if (type=="A") { // NOT HERE
-				} else if (type=="T") { // HERE
-					
-					uint32_t xx0, xx1, xx2, xx3;
-					isl >> HEX(xx0,HEX::TWO_NIBBLES) >> HEX(xx1,HEX::TWO_NIBBLES);
-					
-					if (module.version==3) {
-						isl >> HEX(xx2,HEX::TWO_NIBBLES);
-						if (xx2 != 0) throw std::runtime_error("We don't support sdcc explicit banking");
-					}
-
-					if (module.version==4) {
-						isl >> HEX(xx2,HEX::TWO_NIBBLES);
-						if (xx2 != 0) throw std::runtime_error("We don't support sdcc explicit banking");
-						isl >> HEX(xx3,HEX::TWO_NIBBLES);
-						if (xx3 != 0) throw std::runtime_error("We don't support sdcc explicit banking");
-					}
-
-					last_t_pos = xx1*0x100 + xx0;
-					
-					T.clear();
-					uint32_t nn;
-					while (isl >> HEX(nn,HEX::TWO_NIBBLES))
-						T.push_back(nn);
-					
-				} else if (type=="R") { // HERE
-
-					uint32_t aa0, aa1;
-					isl >> AR("00") >> AR("00") >> HEX2(aa0) >> HEX2(aa1);
-					current_area = aa1*0x100 + aa0;
-
-					uint32_t n1, n2, xx0, xx1;
-					
-					uint32_t n2Adjust = 2;
-					if (module.version==3) n2Adjust = 3;
-					if (module.version==4) n2Adjust = 4;
-										
-					while (isl >> HEX2(n1) >> HEX2(n2) >> HEX2(xx0) >> HEX2(xx1)) {
-
-						enum { 
-							R3_WORD=0x00, R3_BYTE=0x01, 
-							R3_AREA=0x00, R3_SYM =0x02, 
-							R3_NORM=0x00, R3_PCR =0x04, 
-							R3_BYT1=0x00, R3_BYTX=0x08, 
-							R3_SGND=0x00, R3_USGN=0x10,
-							R3_LSB =0x00, R3_MSB =0x80
-						};
-						
-						uint32_t idx = xx1*0x100 + xx0;
-						uint32_t address = 0;
-						
-						if (n2 <n2Adjust) 
-							throw std::runtime_error("n2 < n2Adjust??");
-						n2-=n2Adjust;
-
-						
-						if ( n1 & R3_SYM ) {
-							
-							if (symbolsAddress.count(module.symbols[idx].name)!=0)  {
-
-								address = symbolsAddress[module.symbols[idx].name];
-								
-								Log(3) << std::hex << "Symbol: " << module.symbols[idx].name << " is in: " << address;
-								
-							} else if (module.symbols[idx].isSegmentSymbol()) {
-								
-								std::string requestedModule = module.symbols[idx].getSegmentName();
-								Log(3) << "Requested symbol: " << requestedModule;
-								
-								address = modules[requestedModule].front().segment;
-								
-								Log(2) << "Current area: " << module.areas[current_area].name << " (" << module.page << ") is loading " << module.symbols[idx].name << " (" << modules[requestedModule].front().page << ")" ;
-								if (module.areas[current_area].name == "_CODE" and module.page == modules[requestedModule].front().page) 
-									Log(3) << "Warning: In module " << module.name << " and area: " << module.areas[current_area].name << " (" << module.page << ") is loading " << module.symbols[idx].name << " (" << modules[requestedModule].front().page << ")" ;
-								
-							
-							} else if (module.symbols[idx].isConfigurationSymbol()) {
-							
-								address = megalinkerSymbols[module.symbols[idx].name];
-							} else {
-							
-								throw std::runtime_error("Undefined symbol: " + module.symbols[idx].name); 
-							}
-							
-							Log(3) << module.symbols[idx].name << " " << std::hex << address;
-							
-							n1 -= R3_SYM;
-						} else  {
-						
-							address = area_addr[idx];
-						}
-						
-						
-						if        (n1 == R3_WORD ) {
-
-							address += T[n2+0] + T[n2+1]*0x100;
-							
-							T[n2+0] = address & 0xFF;
-							T[n2+1] = address >> 8;
-						
-						} else if (n1 == R3_BYTE + R3_BYTX + R3_LSB) {
-							
-							address += T[n2+0] + T[n2+1]*0x100;
-
-							for (uint32_t i=n2+1; i<T.size(); i++) 
-								T[i-1] = T[i];
-							T.pop_back();
-							n2Adjust++;
-							
-							if (module.version==3) {
-								for (uint32_t i=n2+1; i<T.size(); i++) 
-									T[i-1] = T[i];
-								T.pop_back();								
-								n2Adjust++;
-							}
-
-							if (module.version==4) {
-								for (uint32_t i=n2+2; i<T.size(); i++) 
-									T[i-2] = T[i];
-								T.pop_back();								
-								T.pop_back();								
-								n2Adjust+=2;
-							}
-
-							T[n2+0] = address & 0xFF;
-							
-							
-						} else if (n1 == R3_BYTE + R3_BYTX + R3_MSB) {
-							
-							address += T[n2+0] + T[n2+1]*0x100;
-
-							for (uint32_t i=n2+1; i<T.size(); i++) 
-								T[i-1] = T[i];
-							T.pop_back();
-							n2Adjust++;
-
-							if (module.version==3) {
-								for (uint32_t i=n2+1; i<T.size(); i++) 
-									T[i-1] = T[i];
-								T.pop_back();								
-								n2Adjust++;
-							}
-
-							if (module.version==4) {
-								for (uint32_t i=n2+2; i<T.size(); i++) 
-									T[i-2] = T[i];
-								T.pop_back();								
-								T.pop_back();								
-								n2Adjust+=2;
-							}
-
-							T[n2+0] = (address>>8) & 0xFF;
-
-						} else {
-							Log(3) << "N1: 0x"<< std::hex << n1 << std::dec;
-							throw std::runtime_error("Unsupported relocation flag combination");
-						}
-					}	
-
-					if (last_t_pos > 0x2000) {
-						Log(4) << "XX " << current_area << " " << std::hex << last_t_pos << " " << area_rom_addr[current_area] << std::dec;
+			lastStamp = stamp;
+
+			auto start = std::chrono::steady_clock::now();
+			try {
+				uint32_t nRead = 0;
+				std::map<std::string, std::vector<Module>> modules;
+				std::map<std::string, std::vector<std::string>> streams;
+				for (auto &arg : inputs) {
+					if (not cache.count(arg) or stampOf(cache.at(arg).files) != cacheStamps[arg]) {
+						cache.erase(arg);
+						cache.emplace(arg, readInput(arg));
+						cacheStamps[arg] = stampOf(cache.at(arg).files);
+						nRead++;
 					}
+					addInput(modules, streams, cache.at(arg), arg);
+				}
 
+				linkRom(options, modules, streams);
 
-					if (T.size())
-						while (rom.size() < last_t_pos + area_rom_addr[current_area] - 0x4000 + T.size()) 
-							rom.resize(rom.size()+0x2000,0xff);
-
-					for (auto &t : T) rom[area_rom_addr[current_area] - 0x4000 + ((last_t_pos++) % 0x2000)] = t;
+				auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+				std::cout << "Linked " << options.romName << " in " << ms << " ms (" << nRead << " of " << inputs.size() << " inputs read)" << std::endl;
 
-				} else if (not type.empty()) {
-					
-					std::runtime_error("Unrecognized type: " + type);
-				}
+			} catch (std::exception &e) {
+				Log(3) << "Link failed: " << e.what();
 			}
 		}
 	}
-
-
-	// DO WRITE THE ROM
-	{
-		std::ofstream off(romName);
-		off.write((const char *)&rom[0x0000],rom.size()-0x0000);
-	}
-		
-    {
-        printf("Using %u bytes of ram, from 0x%04X to 0x%04X.\n", 
-			uint32_t(megalinkerSymbols["___ML_CONFIG_INIT_RAM_SIZE"]),
-			uint32_t(megalinkerSymbols["___ML_CONFIG_INIT_RAM_START"]), 
-			uint32_t(megalinkerSymbols["___ML_CONFIG_INIT_RAM_END"]));
-    }
-
-	return 0;
 }
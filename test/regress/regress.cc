@@ -0,0 +1,176 @@
+////////////////////////////////////////////////////////////////////////
+// Regression tests of the megalinker
+//
+// Links the checked-in fixtures through libmegalinker, without SDCC, and
+// compares the rom, its patch, its overlay and its maps with golden files.
+// Run with -u to write the golden files again, once a change of the outputs is reviewed.
+//
+// FLAGS: -std=c++17 -O2
+
+#include "libmegalinker.h"
+
+#include <fstream>
+#include <filesystem>
+#include <cstdio>
+
+// hexDump prints 16 bytes per line. Runs of identical lines are printed once, followed by "*".
+std::string hexDump(const std::vector<uint8_t> &data) {
+
+	std::ostringstream oss;
+	std::string previous;
+	bool skipped = false;
+	for (size_t i=0; i<data.size(); i+=16) {
+
+		std::string line;
+		for (size_t j=i; j<i+16 and j<data.size(); j++) {
+			char s[4];
+			snprintf(s, sizeof(s), " %02X", data[j]);
+			line += s;
+		}
+
+		if (line == previous) {
+			if (not skipped) oss << "*" << std::endl;
+			skipped = true;
+			continue;
+		}
+
+		char address[24];
+		snprintf(address, sizeof(address), "%05zX:", i);
+		oss << address << line << std::endl;
+		previous = line;
+		skipped = false;
+	}
+	char size[24];
+	snprintf(size, sizeof(size), "%05zX", data.size());
+	oss << size << std::endl;
+	return oss.str();
+}
+
+// Each line of the case list reads: NAME [OPTIONS] [INPUT_FILES] [SYMBOL=VALUE].
+// The rom of a case is NAME.rom. Its outputs stay in memory, so later cases can use them (e.g., -p NAME.rom).
+// The result of a case is the rom and maps of its link, or the error it throws, and is compared with golden/NAME.txt.
+int main(int argc, char *argv[]) {
+
+	Log::reportLevel(10);
+
+	bool update = false;
+	std::string caseList = "cases.txt";
+	for (int i=1; i<argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "-u" or arg == "--update") {
+			update = true;
+		} else if (arg == "-h" or arg == "--help") {
+			std::cout << "Usage: regress [-u] [CASE_LIST]" << std::endl;
+			std::cout << "  Option: -u writes the golden files instead of comparing with them" << std::endl;
+			return 1;
+		} else {
+			caseList = arg;
+		}
+	}
+
+	std::map<std::string, std::string> generated;
+	FileReader read = [&generated](const std::string &filename) {
+		if (generated.count(filename)) return generated.at(filename);
+		return readFile(filename);
+	};
+
+	std::ifstream isf(caseList);
+	if (not isf) { std::cerr << "Could not open case list: " << caseList << std::endl; return 1; }
+
+	int nCases = 0, failed = 0;
+	std::string line;
+	while (std::getline(isf, line)) {
+
+		std::istringstream isl(line.substr(0, line.find('#')));
+		std::string name;
+		if (not (isl >> name)) continue;
+		nCases++;
+
+		LinkOptions options;
+		options.romName = name + ".rom";
+		options.quiet = true;
+
+		std::ostringstream result;
+		try {
+			std::vector<std::string> inputs;
+			std::string word;
+			while (isl >> word) {
+				auto next = [&]() {
+					if (not (isl >> word)) throw std::runtime_error("Option " + word + " requires an argument in case " + name);
+					return word;
+				};
+				if (word == "-g") options.gc = true;
+				else if (word == "-f") options.fold = true;
+				else if (word == "-i") options.instrument = true;
+				else if (word == "-r") options.budget = true;
+				else if (word == "-c") options.callGraph = true;
+				else if (word == "-d") options.disk = true;
+				else if (word == "-s") options.stackAnnotations = next();
+				else if (word == "-p") options.previousRom = next();
+				else if (word == "--diff") options.budget = true, options.budgetBaseline = next();
+				else if (word[0] == '-') throw std::runtime_error("Unknown option " + word + " in case " + name);
+				else if (word.find('=') != std::string::npos) options.overrides[word.substr(0, word.find('='))] = std::stoul(word.substr(word.find('=')+1), nullptr, 0);
+				else inputs.push_back(word);
+			}
+			options.inputs = inputs;
+
+			std::map<std::string, std::vector<Module>> modules;
+			std::map<std::string, std::vector<std::string>> streams;
+			for (auto &arg : inputs)
+				addInput(modules, streams, readInput(arg, read), arg);
+
+			LinkOutput output = link(options, modules, streams, read);
+
+			generated[options.romName] = std::string(output.rom.begin(), output.rom.end());
+			for (auto &file : output.files)
+				generated[file.first] = file.second;
+
+			result << "== rom" << std::endl << hexDump(output.rom);
+			if (not output.overlay.empty())
+				result << "== overlay" << std::endl << hexDump(output.overlay);
+			if (not output.patch.empty()) {
+				result << "== patch" << std::endl << hexDump(output.patch);
+				result << "== changed segments" << std::endl;
+				for (auto &segment : output.changedSegments)
+					result << segment << std::endl;
+			}
+			if (not output.growth.empty()) {
+				result << "== growth" << std::endl;
+				for (auto &growth : output.growth)
+					result << growth << std::endl;
+			}
+			for (auto &file : output.files)
+				result << "== " << file.first << std::endl << file.second;
+
+		} catch (std::exception &e) {
+			result << "== error" << std::endl << e.what() << std::endl;
+		}
+
+		std::string golden = "golden/" + name + ".txt";
+		if (update) {
+			std::filesystem::create_directories("golden");
+			std::ofstream(golden) << result.str();
+			std::cout << "Updated: " << golden << std::endl;
+			continue;
+		}
+
+		std::string expected;
+		try {
+			expected = readFile(golden);
+		} catch (std::runtime_error &) {}
+
+		if (expected != result.str()) {
+			std::filesystem::create_directories("out");
+			std::ofstream("out/" + name + ".txt") << result.str();
+			std::cerr << "Failed: " << name << ", compare " << golden << " with out/" << name << ".txt" << std::endl;
+			failed++;
+		}
+	}
+
+	if (failed) {
+		std::cerr << failed << " of " << nCases << " cases failed" << std::endl;
+		return 1;
+	}
+	std::cout << nCases << " cases passed" << std::endl;
+	return 0;
+}
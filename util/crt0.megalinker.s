@@ -1,166 +1,305 @@
-    .module crt0_megalinker
-
-; crt0 for MSX ROM of 32KB, starting at 0x4000
-;------------------------------------------------
-
-.globl  _main
-
-.globl  ___ML_CONFIG_RAM_START
-
-.globl  ___ML_CONFIG_INIT_ROM_START
-.globl  ___ML_CONFIG_INIT_RAM_START
-.globl  ___ML_CONFIG_INIT_SIZE
-
-.globl  ___ML_current_segment_a
-.globl  ___ML_current_segment_b
-.globl  ___ML_current_segment_c
-.globl  ___ML_current_segment_d
-.globl  ___ML_address_d
-.globl  ___ML_address_c
-.globl  ___ML_address_b
-.globl  ___ML_address_a
-
-
-
-.area _DATA
-;--------------------------------------------------------
-; MSX BIOS CALLS
-;--------------------------------------------------------
-ENASLT = 0x0024
-RSLREG = 0x0138
-
-;--------------------------------------------------------
-; MSX BIOS WORK AREA
-;--------------------------------------------------------
-HIMEM = 0xFC4A
-EXPTBL = 0xFCC1
-
-;--------------------------------------------------------
-; MSX BIOS SYSTEM HOOKS
-;--------------------------------------------------------
-HTIMI = 0xFD9F
-
-;--------------------------------------------------------
-; DATA
-;--------------------------------------------------------
-.area _DATA
-___ML_CONFIG_RAM_START =   0xC000
-
-___ML_address_a =   0x5000
-___ML_address_b =   0x7000
-___ML_address_c =   0x9000
-___ML_address_d =   0xb000
-___ML_current_segment_a::
-    .ds 1
-___ML_current_segment_b::
-    .ds 1
-___ML_current_segment_c::
-    .ds 1
-___ML_current_segment_d::
-    .ds 1
-
-;--------------------------------------------------------
-; HEADER
-;--------------------------------------------------------
-
-.area _HEADER (ABS)
-; Reset vector
-    .org 0x4000
-    .db  0x41
-    .db  0x42
-    .dw  init
-    .dw  0x0000
-    .dw  0x0000
-    .dw  0x0000
-    .dw  0x0000
-    .dw  0x0000
-    .dw  0x0000
-;
-;   .ascii "END ROMHEADER"
-;
-
-init:
-;   Disables Interruptions
-    di
-
-;   We initialize the mapper repeatedly, to trigger correctly megaflashrom and openmsx mapper detection.
-    xor a
-    ld  (___ML_current_segment_a),a
-    ld  (___ML_address_a),a
-    ld  (___ML_address_a),a
-    inc a
-    ld  (___ML_current_segment_b),a
-    ld  (___ML_address_b),a
-    ld  (___ML_address_b),a
-    inc a
-    ld  (___ML_current_segment_c),a
-    ld  (___ML_address_c),a
-    ld  (___ML_address_c),a
-    inc a
-    ld  (___ML_current_segment_d),a
-    ld  (___ML_address_d),a
-    ld  (___ML_address_d),a
-
-;   Sets the stack at the top of the memory.
-    ld sp,(0xfc4a)
-
-; Detection and set of ROM page 2 (0x8000 - 0xbfff)
-; based on a snippet taken from: http://karoshi.auic.es/index.php?topic=117.msg1465
-    ; Primary slot
-    call RSLREG
-    di
-    rrca
-    rrca
-    and #0x03
-    ; Secondary slot
-    ld c, a
-    ld hl, #EXPTBL
-    add a, l
-    ld l, a
-    ld a, (hl)
-    and #0x80
-    or c
-    ld c, a
-    inc l
-    inc l
-    inc l
-    inc l
-    ld a, (hl)
-    and #0x0c
-    or c
-    ld h, #0x80
-    call ENASLT     
-    di
-    
-;   copies intial values to RAM
-    ld de, #___ML_CONFIG_INIT_RAM_START
-    ld hl, #___ML_CONFIG_INIT_ROM_START
-    ld bc, #___ML_CONFIG_INIT_SIZE
-	ldir
-    
-.area _NONE
-.area _GSINIT
-.area _GSFINAL
-
-;   enables interruptions and calls main
-    ei
-    call    _main 
-    
-    jp      init
-
-
-;--------------------------------------------------------
-; HOME
-;--------------------------------------------------------
-
-    .area   _HOME
-    
-___sdcc_call_hl::
-    jp  (hl)
-    
-___sdcc_call_ix::
-    jp  (ix)
-    
-___sdcc_call_iy::
-    jp  (iy)
-    
+    .module crt0_megalinker
+
+; crt0 for MSX ROM of 32KB, starting at 0x4000
+;------------------------------------------------
+
+.globl  _main
+
+.globl  ___ML_CONFIG_RAM_START
+.globl  ___ML_CONFIG_STACK_TOP
+.globl  ___ML_CONFIG_HIMEM_MIN
+
+.globl  ___ML_CONFIG_BOOT_SEGMENT_A
+.globl  ___ML_CONFIG_BOOT_SEGMENT_B
+.globl  ___ML_CONFIG_BOOT_SEGMENT_C
+.globl  ___ML_CONFIG_BOOT_SEGMENT_D
+
+.globl  ___ML_CONFIG_RAM_SEGMENT_FIRST
+.globl  ___ML_CONFIG_RAM_SEGMENTS
+
+.globl  ___ML_CONFIG_INIT_ROM_START
+.globl  ___ML_CONFIG_INIT_RAM_START
+.globl  ___ML_CONFIG_INIT_SIZE
+.globl  ___ML_CONFIG_INIT_RAM_END
+.globl  ___ML_CONFIG_INIT_CHUNKS
+
+.globl  ___ML_CONFIG_INSTRUMENT_SIZE
+
+.globl  ___ML_CONFIG_INTERRUPT_HOOK
+
+.globl  ___ML_CONFIG_SEGMENT_BITS
+
+.globl  ___ML_current_segment_a
+.globl  ___ML_current_segment_b
+.globl  ___ML_current_segment_c
+.globl  ___ML_current_segment_d
+.globl  ___ML_address_d
+.globl  ___ML_address_c
+.globl  ___ML_address_b
+.globl  ___ML_address_a
+.globl  ___ML_address_hi_d
+.globl  ___ML_address_hi_c
+.globl  ___ML_address_hi_b
+.globl  ___ML_address_hi_a
+
+
+
+.area _DATA
+;--------------------------------------------------------
+; MSX BIOS CALLS
+;--------------------------------------------------------
+ENASLT = 0x0024
+RSLREG = 0x0138
+
+;--------------------------------------------------------
+; MSX BIOS WORK AREA
+;--------------------------------------------------------
+HIMEM = 0xFC4A
+EXPTBL = 0xFCC1
+
+;--------------------------------------------------------
+; MSX BIOS SYSTEM HOOKS
+;--------------------------------------------------------
+HTIMI = 0xFD9F
+
+;--------------------------------------------------------
+; DATA
+;--------------------------------------------------------
+.area _DATA
+___ML_CONFIG_RAM_START =   0xC000
+
+; Lowest HIMEM supported, where the stack starts at boot. The linker checks RAM and the worst case stack (-s)
+; against it, and ROMs linked with -s stop at boot on machines with a lower HIMEM.
+; HIMEM is 0xF380 on a machine without disk drives, and lower with disk drives.
+___ML_CONFIG_STACK_TOP =   0xF380
+
+; Hook where the linker installs the dispatcher of the interrupt handlers (ML_INTERRUPT), if any.
+___ML_CONFIG_INTERRUPT_HOOK =   HTIMI
+
+; Segments mapped at boot. Pinned modules are placed in these segments.
+; Pages used by the header must keep their default segment.
+___ML_CONFIG_BOOT_SEGMENT_A =   0
+___ML_CONFIG_BOOT_SEGMENT_B =   1
+___ML_CONFIG_BOOT_SEGMENT_C =   2
+___ML_CONFIG_BOOT_SEGMENT_D =   3
+
+; Segments of the MSX2 memory mapper used for banked RAM (_XDATA_BANKED).
+; Segments 0 to 3 are mapped at boot, thus 4 segments are free in a 128KB mapper.
+___ML_CONFIG_RAM_SEGMENT_FIRST =   4
+___ML_CONFIG_RAM_SEGMENTS =   4
+
+; 1 to copy _HOME and _INITIALIZER at boot from the banked segments listed by the linker in ___ML_INIT_CHUNKS,
+; instead of from the header. It frees the header for boot code, which must then end before page D.
+___ML_CONFIG_INIT_CHUNKS =   0
+
+; Width of the segment numbers: 8 for up to 256 segments, 16 for larger megaroms.
+; Must match ML_SEGMENT_BITS in megalinker.h.
+___ML_CONFIG_SEGMENT_BITS =   8
+
+___ML_address_a =   0x5000
+___ML_address_b =   0x7000
+___ML_address_c =   0x9000
+___ML_address_d =   0xb000
+
+; Registers of the high byte of the segment numbers, only written with 16 bit segment numbers.
+; They depend on the cartridge; these addresses are ignored by the Konami SCC mapper.
+___ML_address_hi_a =   0x4800
+___ML_address_hi_b =   0x6800
+___ML_address_hi_c =   0x8800
+___ML_address_hi_d =   0xa800
+
+___ML_current_segment_a::
+    .ds ___ML_CONFIG_SEGMENT_BITS / 8
+___ML_current_segment_b::
+    .ds ___ML_CONFIG_SEGMENT_BITS / 8
+___ML_current_segment_c::
+    .ds ___ML_CONFIG_SEGMENT_BITS / 8
+___ML_current_segment_d::
+    .ds ___ML_CONFIG_SEGMENT_BITS / 8
+
+;--------------------------------------------------------
+; HEADER
+;--------------------------------------------------------
+
+.area _HEADER (ABS)
+; Reset vector
+    .org 0x4000
+    .db  0x41
+    .db  0x42
+    .dw  init
+    .dw  0x0000
+    .dw  0x0000
+    .dw  0x0000
+    .dw  0x0000
+    .dw  0x0000
+    .dw  0x0000
+;
+;   .ascii "END ROMHEADER"
+;
+
+init:
+;   Disables Interruptions
+    di
+
+;   We initialize the mapper repeatedly, to trigger correctly megaflashrom and openmsx mapper detection.
+    ld  a,#___ML_CONFIG_BOOT_SEGMENT_A
+    ld  (___ML_current_segment_a),a
+    ld  (___ML_address_a),a
+    ld  (___ML_address_a),a
+    ld  a,#___ML_CONFIG_BOOT_SEGMENT_B
+    ld  (___ML_current_segment_b),a
+    ld  (___ML_address_b),a
+    ld  (___ML_address_b),a
+    ld  a,#___ML_CONFIG_BOOT_SEGMENT_C
+    ld  (___ML_current_segment_c),a
+    ld  (___ML_address_c),a
+    ld  (___ML_address_c),a
+    ld  a,#___ML_CONFIG_BOOT_SEGMENT_D
+    ld  (___ML_current_segment_d),a
+    ld  (___ML_address_d),a
+    ld  (___ML_address_d),a
+.if ___ML_CONFIG_SEGMENT_BITS - 8
+    xor a
+    ld  (___ML_current_segment_a+1),a
+    ld  (___ML_address_hi_a),a
+    ld  (___ML_current_segment_b+1),a
+    ld  (___ML_address_hi_b),a
+    ld  (___ML_current_segment_c+1),a
+    ld  (___ML_address_hi_c),a
+    ld  (___ML_current_segment_d+1),a
+    ld  (___ML_address_hi_d),a
+.endif
+
+;   Sets the stack at the top of the memory.
+    ld sp,(HIMEM)
+
+;   stops if HIMEM is below the stack top checked by the linker (0 if not checked)
+    ld hl,(HIMEM)
+    ld de,#___ML_CONFIG_HIMEM_MIN
+    or a
+    sbc hl,de
+    jr nc,init_himem_ok
+    halt
+init_himem_ok:
+
+; Detection and set of ROM page 2 (0x8000 - 0xbfff)
+; based on a snippet taken from: http://karoshi.auic.es/index.php?topic=117.msg1465
+    ; Primary slot
+    call RSLREG
+    di
+    rrca
+    rrca
+    and #0x03
+    ; Secondary slot
+    ld c, a
+    ld hl, #EXPTBL
+    add a, l
+    ld l, a
+    ld a, (hl)
+    and #0x80
+    or c
+    ld c, a
+    inc l
+    inc l
+    inc l
+    inc l
+    ld a, (hl)
+    and #0x0c
+    or c
+    ld h, #0x80
+    call ENASLT     
+    di
+    
+.if ___ML_CONFIG_INIT_CHUNKS
+.globl  ___ML_INIT_CHUNKS
+;   copies intial values to RAM, chunk by chunk, mapping the segment of each chunk in page D
+    ld de, #___ML_CONFIG_INIT_RAM_START
+    ld hl, #___ML_INIT_CHUNKS
+    ld b, (hl)
+    inc hl
+    inc b
+    jr init_chunks_next
+init_chunks_loop:
+    push bc
+    ld a, (hl)
+    inc hl
+    ld (___ML_address_d), a
+.if ___ML_CONFIG_SEGMENT_BITS - 8
+    ld a, (hl)
+    inc hl
+    ld (___ML_address_hi_d), a
+.endif
+    ld c, (hl)
+    inc hl
+    ld a, (hl)
+    inc hl
+    add a, #0xA0
+    ld b, a
+    push bc
+    ld c, (hl)
+    inc hl
+    ld b, (hl)
+    inc hl
+    ex (sp), hl
+    ldir
+    pop hl
+    pop bc
+init_chunks_next:
+    djnz init_chunks_loop
+
+;   maps back the boot segment of page D
+    ld a, #___ML_CONFIG_BOOT_SEGMENT_D
+    ld (___ML_address_d), a
+.if ___ML_CONFIG_SEGMENT_BITS - 8
+    xor a
+    ld (___ML_address_hi_d), a
+.endif
+.else
+;   copies intial values to RAM
+    ld de, #___ML_CONFIG_INIT_RAM_START
+    ld hl, #___ML_CONFIG_INIT_ROM_START
+    ld bc, #___ML_CONFIG_INIT_SIZE
+	ldir
+.endif
+
+;   clears the bank switch counters, placed at the end of the RAM on instrumented links
+    ld bc, #___ML_CONFIG_INSTRUMENT_SIZE
+    ld a, b
+    or c
+    jr z, init_counters_done
+    ld hl, #___ML_CONFIG_INIT_RAM_END
+    sbc hl, bc
+    ld d, h
+    ld e, l
+    inc de
+    ld (hl), #0
+    dec bc
+    ldir
+init_counters_done:
+    
+.area _NONE
+.area _GSINIT
+.area _GSFINAL
+
+;   enables interruptions and calls main
+    ei
+    call    _main 
+    
+    jp      init
+
+
+;--------------------------------------------------------
+; HOME
+;--------------------------------------------------------
+
+    .area   _HOME
+    
+___sdcc_call_hl::
+    jp  (hl)
+    
+___sdcc_call_ix::
+    jp  (ix)
+    
+___sdcc_call_iy::
+    jp  (iy)
+    
@@ -0,0 +1,200 @@
+    .module crt0_megalinker_disk
+
+; crt0 for MSX-DOS 2 programs linked as a disk overlay (megalinker -d).
+; The program written by the linker copies the boot segments to 0x4000 and jumps to init.
+; The other segments are loaded from the overlay file by megalinker_disk.s.
+;------------------------------------------------
+
+.globl  _main
+
+.globl  ___ML_CONFIG_RAM_START
+
+.globl  ___ML_CONFIG_BOOT_SEGMENT_A
+.globl  ___ML_CONFIG_BOOT_SEGMENT_B
+.globl  ___ML_CONFIG_BOOT_SEGMENT_C
+.globl  ___ML_CONFIG_BOOT_SEGMENT_D
+
+.globl  ___ML_CONFIG_DISK_CACHE_SLOTS
+
+.globl  ___ML_CONFIG_INIT_ROM_START
+.globl  ___ML_CONFIG_INIT_RAM_START
+.globl  ___ML_CONFIG_INIT_SIZE
+.globl  ___ML_CONFIG_INIT_RAM_END
+
+.globl  ___ML_CONFIG_INSTRUMENT_SIZE
+
+.globl  ___ML_CONFIG_TPA_MIN
+
+.globl  ___ML_CONFIG_SEGMENT_BITS
+
+.globl  ___ML_current_segment_a
+.globl  ___ML_current_segment_b
+.globl  ___ML_current_segment_c
+.globl  ___ML_current_segment_d
+
+.globl  ___ML_disk_overlay
+.globl  ___ML_disk_tags
+.globl  ___ML_disk_segments
+.globl  ___ML_disk_open
+.globl  ___ML_disk_close
+
+
+
+.area _DATA
+;--------------------------------------------------------
+; MSX-DOS
+;--------------------------------------------------------
+BDOS = 0x0005
+TPA_TOP = 0x0006
+_TERM0 = 0x00
+_TERM = 0x62
+
+; Error code of MSX-DOS 2: not enough memory
+_NORAM = 0xDE
+
+;--------------------------------------------------------
+; DATA
+;--------------------------------------------------------
+.area _DATA
+; The RAM of page 3 below the MSX-DOS system area, the stack grows down from its top.
+; The program ends at boot if the top of the TPA is below ___ML_CONFIG_TPA_MIN, set by the linker
+; to the end of the RAM areas plus the stack (the worst case stack with -s, 896 bytes otherwise).
+___ML_CONFIG_RAM_START =   0xC000
+
+; Segments in the RAM of pages A to D at boot: the program copies segments 0 to 3 there.
+___ML_CONFIG_BOOT_SEGMENT_A =   0
+___ML_CONFIG_BOOT_SEGMENT_B =   1
+___ML_CONFIG_BOOT_SEGMENT_C =   2
+___ML_CONFIG_BOOT_SEGMENT_D =   3
+
+; Slots of the cache of loaded segments, two per segment of the memory mapper. The mapper segments are allocated
+; from MSX-DOS 2 at boot, and freed on exit; the program ends if there are not enough free segments.
+; The cache must have at least 2 slots.
+___ML_CONFIG_DISK_CACHE_SLOTS =   8
+
+; Disk overlays use 8 bit segment numbers. Must match ML_SEGMENT_BITS in megalinker.h.
+___ML_CONFIG_SEGMENT_BITS =   8
+
+___ML_current_segment_a::
+    .ds 1
+___ML_current_segment_b::
+    .ds 1
+___ML_current_segment_c::
+    .ds 1
+___ML_current_segment_d::
+    .ds 1
+
+; Segment cached in each slot, 0xFF if empty.
+___ML_disk_tags::
+    .ds ___ML_CONFIG_DISK_CACHE_SLOTS
+
+; Mapper segment of each pair of slots.
+___ML_disk_segments::
+    .ds (___ML_CONFIG_DISK_CACHE_SLOTS + 1) / 2
+
+;--------------------------------------------------------
+; HEADER
+;--------------------------------------------------------
+
+.area _HEADER (ABS)
+; The program reads the entry point at 0x4002, as in a rom header.
+    .org 0x4000
+    .db  0x41
+    .db  0x42
+    .dw  init
+    .dw  0x0000
+    .dw  0x0000
+    .dw  0x0000
+    .dw  0x0000
+    .dw  0x0000
+    .dw  0x0000
+;
+;   .ascii "END ROMHEADER"
+;
+
+; Name of the overlay file, as written by the linker next to the program.
+___ML_disk_overlay::
+    .asciz "GAME.OVL"
+
+init:
+;   Disables Interruptions
+    di
+
+;   The boot segments are already in the RAM of their pages.
+    ld  a,#___ML_CONFIG_BOOT_SEGMENT_A
+    ld  (___ML_current_segment_a),a
+    ld  a,#___ML_CONFIG_BOOT_SEGMENT_B
+    ld  (___ML_current_segment_b),a
+    ld  a,#___ML_CONFIG_BOOT_SEGMENT_C
+    ld  (___ML_current_segment_c),a
+    ld  a,#___ML_CONFIG_BOOT_SEGMENT_D
+    ld  (___ML_current_segment_d),a
+
+;   Sets the stack at the top of the TPA.
+    ld sp,(TPA_TOP)
+
+;   ends the program if the TPA can not hold the RAM areas and the stack
+    ld hl,(TPA_TOP)
+    ld de,#___ML_CONFIG_TPA_MIN
+    or a
+    sbc hl,de
+    jr nc,init_tpa_ok
+    ld b,#_NORAM
+    ld c,#_TERM
+    jp BDOS
+init_tpa_ok:
+
+;   copies intial values to RAM
+    ld de, #___ML_CONFIG_INIT_RAM_START
+    ld hl, #___ML_CONFIG_INIT_ROM_START
+    ld bc, #___ML_CONFIG_INIT_SIZE
+	ldir
+
+;   clears the bank switch counters, placed at the end of the RAM on instrumented links
+    ld bc, #___ML_CONFIG_INSTRUMENT_SIZE
+    ld a, b
+    or c
+    jr z, init_counters_done
+    ld hl, #___ML_CONFIG_INIT_RAM_END
+    sbc hl, bc
+    ld d, h
+    ld e, l
+    inc de
+    ld (hl), #0
+    dec bc
+    ldir
+init_counters_done:
+
+;   opens the overlay, MSX-DOS ends the program if it can not be opened
+    ld  de,#___ML_disk_overlay
+    call ___ML_disk_open
+
+.area _NONE
+.area _GSINIT
+.area _GSFINAL
+
+;   enables interruptions and calls main
+    ei
+    call    _main
+
+;   frees the cache, and returns to MSX-DOS
+    call ___ML_disk_close
+    ld  c,#_TERM0
+    jp  BDOS
+
+
+;--------------------------------------------------------
+; HOME
+;--------------------------------------------------------
+
+    .area   _HOME
+
+___sdcc_call_hl::
+    jp  (hl)
+
+___sdcc_call_ix::
+    jp  (ix)
+
+___sdcc_call_iy::
+    jp  (iy)
+
@@ -9,18 +9,44 @@
 // PUBLIC INTERFACE
 //
 
+// Width of the segment numbers, must match ___ML_CONFIG_SEGMENT_BITS in the crt (8 or 16).
+#ifndef ML_SEGMENT_BITS
+	#define ML_SEGMENT_BITS 8
+#endif
+
+// Disk overlays (megalinker -d, crt0.megalinker_disk.s) load the segments into RAM, define ML_DISK to build for them.
+#if defined(ML_DISK) && ML_SEGMENT_BITS != 8
+	#error "Disk overlays use 8 bit segment numbers"
+#endif
+
+#if ML_SEGMENT_BITS == 16
+	typedef uint16_t ML_Segment;
+#else
+	typedef uint8_t ML_Segment;
+#endif
+
 #define ML_MOVE_SYMBOLS_TO(target_module, source_module) const uint8_t __at 0x0000 __ML_MOVE_SYMBOLS_TO_ ## target_module ## _FROM_ ## source_module 
 
+#define ML_OVERLAY_GROUP(group, module) const uint8_t __at 0x0000 __ML_OVERLAY_ ## group ## _MODULE_ ## module 
+
+#define ML_PIN_A(module) const uint8_t __at 0x0000 __ML_PIN_A_ ## module
+#define ML_PIN_B(module) const uint8_t __at 0x0000 __ML_PIN_B_ ## module
+#define ML_PIN_C(module) const uint8_t __at 0x0000 __ML_PIN_C_ ## module
+#define ML_PIN_D(module) const uint8_t __at 0x0000 __ML_PIN_D_ ## module
+
+#define ML_ALIGN(module, bytes) const uint8_t __at 0x0000 __ML_ALIGN_ ## bytes ## _ ## module
+
 #define ML_REQUEST_A(module) extern const uint8_t __ML_SEGMENT_A_## module
 #define ML_REQUEST_B(module) extern const uint8_t __ML_SEGMENT_B_## module
 #define ML_REQUEST_C(module) extern const uint8_t __ML_SEGMENT_C_## module
 #define ML_REQUEST_D(module) extern const uint8_t __ML_SEGMENT_D_## module
 
-#define ML_SEGMENT_A(module) ((const uint8_t)&__ML_SEGMENT_A_ ## module)
-#define ML_SEGMENT_B(module) ((const uint8_t)&__ML_SEGMENT_B_ ## module)
-#define ML_SEGMENT_C(module) ((const uint8_t)&__ML_SEGMENT_C_ ## module)
-#define ML_SEGMENT_D(module) ((const uint8_t)&__ML_SEGMENT_D_ ## module)
+#define ML_SEGMENT_A(module) ((const ML_Segment)&__ML_SEGMENT_A_ ## module)
+#define ML_SEGMENT_B(module) ((const ML_Segment)&__ML_SEGMENT_B_ ## module)
+#define ML_SEGMENT_C(module) ((const ML_Segment)&__ML_SEGMENT_C_ ## module)
+#define ML_SEGMENT_D(module) ((const ML_Segment)&__ML_SEGMENT_D_ ## module)
 
+// Raw segment loads are not checked by the linker: they must not be used on a pinned page (ML_PIN_X).
 #define ML_LOAD_SEGMENT_A(segment) __ML_LOAD_SEGMENT_A(segment);
 #define ML_LOAD_SEGMENT_B(segment) __ML_LOAD_SEGMENT_B(segment);
 #define ML_LOAD_SEGMENT_C(segment) __ML_LOAD_SEGMENT_C(segment);
@@ -36,10 +62,85 @@
 #define ML_RESTORE_C(segment) __ML_RESTORE_C(segment);
 #define ML_RESTORE_D(segment) __ML_RESTORE_D(segment);
 
-#define ML_EXECUTE_A(module, code) do { ML_REQUEST_A(module); uint8_t old = ML_LOAD_MODULE_A(module); { code; } ML_RESTORE_A(old); } while (0)
-#define ML_EXECUTE_B(module, code) do { ML_REQUEST_B(module); uint8_t old = ML_LOAD_MODULE_B(module); { code; } ML_RESTORE_B(old); } while (0)
-#define ML_EXECUTE_C(module, code) do { ML_REQUEST_C(module); uint8_t old = ML_LOAD_MODULE_C(module); { code; } ML_RESTORE_C(old); } while (0)
-#define ML_EXECUTE_D(module, code) do { ML_REQUEST_D(module); uint8_t old = ML_LOAD_MODULE_D(module); { code; } ML_RESTORE_D(old); } while (0)
+#define ML_EXECUTE_A(module, code) do { ML_REQUEST_A(module); ML_Segment old = ML_LOAD_MODULE_A(module); { code; } ML_RESTORE_A(old); } while (0)
+#define ML_EXECUTE_B(module, code) do { ML_REQUEST_B(module); ML_Segment old = ML_LOAD_MODULE_B(module); { code; } ML_RESTORE_B(old); } while (0)
+#define ML_EXECUTE_C(module, code) do { ML_REQUEST_C(module); ML_Segment old = ML_LOAD_MODULE_C(module); { code; } ML_RESTORE_C(old); } while (0)
+#define ML_EXECUTE_D(module, code) do { ML_REQUEST_D(module); ML_Segment old = ML_LOAD_MODULE_D(module); { code; } ML_RESTORE_D(old); } while (0)
+
+typedef struct { ML_Segment segment; uint8_t page; void (*function)(void); } ML_FarPointer;
+
+#define ML_REQUEST_FAR_A(function) extern const ML_FarPointer __ML_FAR_A_## function
+#define ML_REQUEST_FAR_B(function) extern const ML_FarPointer __ML_FAR_B_## function
+#define ML_REQUEST_FAR_C(function) extern const ML_FarPointer __ML_FAR_C_## function
+#define ML_REQUEST_FAR_D(function) extern const ML_FarPointer __ML_FAR_D_## function
+
+#define ML_FAR_POINTER_A(function) (&__ML_FAR_A_ ## function)
+#define ML_FAR_POINTER_B(function) (&__ML_FAR_B_ ## function)
+#define ML_FAR_POINTER_C(function) (&__ML_FAR_C_ ## function)
+#define ML_FAR_POINTER_D(function) (&__ML_FAR_D_ ## function)
+
+#if ML_SEGMENT_BITS == 16
+	#define ML_FAR_CALL(far_pointer) __ML_far_call_16(far_pointer)
+#else
+	#define ML_FAR_CALL(far_pointer) __ML_far_call(far_pointer)
+#endif
+
+#define ML_SET_A(set, module) const uint8_t __at 0x0000 __ML_IN_SET_ ## set ## _PAGE_A_ ## module
+#define ML_SET_B(set, module) const uint8_t __at 0x0000 __ML_IN_SET_ ## set ## _PAGE_B_ ## module
+#define ML_SET_C(set, module) const uint8_t __at 0x0000 __ML_IN_SET_ ## set ## _PAGE_C_ ## module
+#define ML_SET_D(set, module) const uint8_t __at 0x0000 __ML_IN_SET_ ## set ## _PAGE_D_ ## module
+
+#define ML_REQUEST_SET(set) extern const uint8_t __ML_SET_## set
+#define ML_LOAD_SET(set) __ML_load_set(&__ML_SET_ ## set)
+#define ML_RESTORE_SET(segments) __ML_restore_set(segments)
+#define ML_EXECUTE_SET(set, code) do { ML_REQUEST_SET(set); uint32_t old = ML_LOAD_SET(set); { code; } ML_RESTORE_SET(old); } while (0)
+
+// Interrupt handlers are called on every interrupt, in increasing order, by the dispatcher generated by the linker.
+// ML_INTERRUPT_X handlers are banked and mapped in page X, ML_INTERRUPT handlers must be __nonbanked.
+#define ML_INTERRUPT(order, function) const uint8_t __at 0x0000 __ML_INTERRUPT_ ## order ## _ ## function
+#define ML_INTERRUPT_A(order, function) const uint8_t __at 0x0000 __ML_INTERRUPT_A_ ## order ## _ ## function
+#define ML_INTERRUPT_B(order, function) const uint8_t __at 0x0000 __ML_INTERRUPT_B_ ## order ## _ ## function
+#define ML_INTERRUPT_C(order, function) const uint8_t __at 0x0000 __ML_INTERRUPT_C_ ## order ## _ ## function
+#define ML_INTERRUPT_D(order, function) const uint8_t __at 0x0000 __ML_INTERRUPT_D_ ## order ## _ ## function
+
+#define ML_REQUEST_RAM(module) extern const uint8_t __ML_RAM_SEGMENT_## module
+#define ML_RAM_SEGMENT(module) ((const uint8_t)&__ML_RAM_SEGMENT_ ## module)
+#define ML_LOAD_RAM_SEGMENT(segment) __ML_LOAD_RAM_SEGMENT(segment);
+#define ML_LOAD_RAM_MODULE(module) ML_LOAD_RAM_SEGMENT(ML_RAM_SEGMENT(module))
+#define ML_RESTORE_RAM(segment) __ML_LOAD_RAM_SEGMENT(segment);
+#define ML_RAM_WINDOW_ON() __ML_ram_window_on()
+#define ML_RAM_WINDOW_OFF() __ML_ram_window_off()
+#define ML_EXECUTE_RAM(module, code) do { ML_REQUEST_RAM(module); uint8_t old = ML_LOAD_RAM_MODULE(module); { code; } ML_RESTORE_RAM(old); } while (0)
+
+#define ML_ASSET(name) extern const uint8_t name[]; extern const uint8_t name ## _size[]
+#define ML_ASSET_SIZE(name) ((uint16_t)name ## _size)
+#define ML_PACKED_ASSET(name) ML_ASSET(name); extern const uint8_t name ## _unpacked_size[]
+#define ML_ASSET_UNPACKED_SIZE(name) ((uint16_t)name ## _unpacked_size)
+#if ML_SEGMENT_BITS == 16
+	#define ML_UNPACK(src, dst) __ML_unpack_16(((uint32_t)(uint16_t)(dst) << 16) | (uint16_t)(src))
+#else
+	#define ML_UNPACK(src, dst) __ML_unpack(((uint32_t)(uint16_t)(dst) << 16) | (uint16_t)(src))
+#endif
+
+typedef struct { ML_Segment segment; uint16_t offset; uint16_t length; } ML_StreamChunk;
+typedef struct { uint32_t length; uint8_t chunks; ML_StreamChunk chunk[]; } ML_Stream;
+
+#define ML_REQUEST_STREAM(name) extern const ML_Stream name
+
+#define ML_LOAD_STREAM_CHUNK_A(stream, i) __ML_LOAD_STREAM_CHUNK_A(&(stream), i)
+#define ML_LOAD_STREAM_CHUNK_B(stream, i) __ML_LOAD_STREAM_CHUNK_B(&(stream), i)
+#define ML_LOAD_STREAM_CHUNK_C(stream, i) __ML_LOAD_STREAM_CHUNK_C(&(stream), i)
+#define ML_LOAD_STREAM_CHUNK_D(stream, i) __ML_LOAD_STREAM_CHUNK_D(&(stream), i)
+
+#define ML_EXECUTE_STREAM_A(stream, data, size, code) do { ML_Segment old = ML_LOAD_SEGMENT_A((stream).chunk[0].segment); for (uint8_t i = 0; i < (stream).chunks; i++) { const uint8_t *data = ML_LOAD_STREAM_CHUNK_A(stream, i); uint16_t size = (stream).chunk[i].length; { code; } } ML_RESTORE_A(old); } while (0)
+#define ML_EXECUTE_STREAM_B(stream, data, size, code) do { ML_Segment old = ML_LOAD_SEGMENT_B((stream).chunk[0].segment); for (uint8_t i = 0; i < (stream).chunks; i++) { const uint8_t *data = ML_LOAD_STREAM_CHUNK_B(stream, i); uint16_t size = (stream).chunk[i].length; { code; } } ML_RESTORE_B(old); } while (0)
+#define ML_EXECUTE_STREAM_C(stream, data, size, code) do { ML_Segment old = ML_LOAD_SEGMENT_C((stream).chunk[0].segment); for (uint8_t i = 0; i < (stream).chunks; i++) { const uint8_t *data = ML_LOAD_STREAM_CHUNK_C(stream, i); uint16_t size = (stream).chunk[i].length; { code; } } ML_RESTORE_C(old); } while (0)
+#define ML_EXECUTE_STREAM_D(stream, data, size, code) do { ML_Segment old = ML_LOAD_SEGMENT_D((stream).chunk[0].segment); for (uint8_t i = 0; i < (stream).chunks; i++) { const uint8_t *data = ML_LOAD_STREAM_CHUNK_D(stream, i); uint16_t size = (stream).chunk[i].length; { code; } } ML_RESTORE_D(old); } while (0)
+
+#define ML_UNPACK_STREAM_A(stream, dst) do { ML_Segment old = ML_LOAD_SEGMENT_A((stream).chunk[0].segment); ML_UNPACK(ML_LOAD_STREAM_CHUNK_A(stream, 0), dst); ML_RESTORE_A(old); } while (0)
+#define ML_UNPACK_STREAM_B(stream, dst) do { ML_Segment old = ML_LOAD_SEGMENT_B((stream).chunk[0].segment); ML_UNPACK(ML_LOAD_STREAM_CHUNK_B(stream, 0), dst); ML_RESTORE_B(old); } while (0)
+#define ML_UNPACK_STREAM_C(stream, dst) do { ML_Segment old = ML_LOAD_SEGMENT_C((stream).chunk[0].segment); ML_UNPACK(ML_LOAD_STREAM_CHUNK_C(stream, 0), dst); ML_RESTORE_C(old); } while (0)
+#define ML_UNPACK_STREAM_D(stream, dst) do { ML_Segment old = ML_LOAD_SEGMENT_D((stream).chunk[0].segment); ML_UNPACK(ML_LOAD_STREAM_CHUNK_D(stream, 0), dst); ML_RESTORE_D(old); } while (0)
 
 ////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////
@@ -48,15 +149,69 @@
 //
 
 #ifdef __SDCC
+
+	// Instrumented builds count every bank switch in a table allocated by the linker (-i).
+	// Counter (segment*4 + page) holds the number of times segment was mapped in page.
+	#ifdef ML_INSTRUMENT
+		extern volatile uint16_t __ML_CONFIG_INSTRUMENT_COUNTERS[];
+		#define __ML_INSTRUMENT(segment, page) __ML_CONFIG_INSTRUMENT_COUNTERS[((segment)<<2) | (page)]++
+	#else
+		#define __ML_INSTRUMENT(segment, page)
+	#endif
     
-	inline uint8_t __ML_LOAD_SEGMENT_A(uint8_t segment) { extern volatile uint8_t __ML_current_segment_a, __ML_address_a; register uint8_t old = __ML_current_segment_a; __ML_address_a = __ML_current_segment_a = segment; return old; }
-	inline uint8_t __ML_LOAD_SEGMENT_B(uint8_t segment) { extern volatile uint8_t __ML_current_segment_b, __ML_address_b; register uint8_t old = __ML_current_segment_b; __ML_address_b = __ML_current_segment_b = segment; return old; }
-	inline uint8_t __ML_LOAD_SEGMENT_C(uint8_t segment) { extern volatile uint8_t __ML_current_segment_c, __ML_address_c; register uint8_t old = __ML_current_segment_c; __ML_address_c = __ML_current_segment_c = segment; return old; }
-	inline uint8_t __ML_LOAD_SEGMENT_D(uint8_t segment) { extern volatile uint8_t __ML_current_segment_d, __ML_address_d; register uint8_t old = __ML_current_segment_d; __ML_address_d = __ML_current_segment_d = segment; return old; }
-
-	inline void __ML_RESTORE_A(uint8_t segment) { extern volatile uint8_t __ML_current_segment_a, __ML_address_a; __ML_address_a = __ML_current_segment_a = segment; }
-	inline void __ML_RESTORE_B(uint8_t segment) { extern volatile uint8_t __ML_current_segment_b, __ML_address_b; __ML_address_b = __ML_current_segment_b = segment; }
-	inline void __ML_RESTORE_C(uint8_t segment) { extern volatile uint8_t __ML_current_segment_c, __ML_address_c; __ML_address_c = __ML_current_segment_c = segment; }
-	inline void __ML_RESTORE_D(uint8_t segment) { extern volatile uint8_t __ML_current_segment_d, __ML_address_d; __ML_address_d = __ML_current_segment_d = segment; }
+	#if defined(ML_DISK)
+		// Disk overlays copy the segment into the RAM of the page (megalinker_disk.s).
+		void __ML_disk_map_a(uint8_t segment) __z88dk_fastcall;
+		void __ML_disk_map_b(uint8_t segment) __z88dk_fastcall;
+		void __ML_disk_map_c(uint8_t segment) __z88dk_fastcall;
+		void __ML_disk_map_d(uint8_t segment) __z88dk_fastcall;
+		#define __ML_MAP(x, segment) __ML_disk_map_ ## x(segment)
+		#define __ML_MAPPER_DECLARE(x) extern volatile uint8_t __ML_current_segment_ ## x
+	#elif ML_SEGMENT_BITS == 16
+		// 16 bit segment numbers are written to two mapper registers: the low byte to __ML_address_x and the high byte to __ML_address_hi_x.
+		#define __ML_MAP(x, segment) __ML_address_ ## x = (uint8_t)(segment); __ML_address_hi_ ## x = (uint8_t)((segment) >> 8)
+		#define __ML_MAPPER_DECLARE(x) extern volatile uint16_t __ML_current_segment_ ## x; extern volatile uint8_t __ML_address_ ## x, __ML_address_hi_ ## x
+	#else
+		#define __ML_MAP(x, segment) __ML_address_ ## x = (segment)
+		#define __ML_MAPPER_DECLARE(x) extern volatile uint8_t __ML_current_segment_ ## x, __ML_address_ ## x
+	#endif
+
+	inline ML_Segment __ML_LOAD_SEGMENT_A(ML_Segment segment) { __ML_INSTRUMENT(segment, 0); __ML_MAPPER_DECLARE(a); register ML_Segment old = __ML_current_segment_a; __ML_current_segment_a = segment; __ML_MAP(a, segment); return old; }
+	inline ML_Segment __ML_LOAD_SEGMENT_B(ML_Segment segment) { __ML_INSTRUMENT(segment, 1); __ML_MAPPER_DECLARE(b); register ML_Segment old = __ML_current_segment_b; __ML_current_segment_b = segment; __ML_MAP(b, segment); return old; }
+	inline ML_Segment __ML_LOAD_SEGMENT_C(ML_Segment segment) { __ML_INSTRUMENT(segment, 2); __ML_MAPPER_DECLARE(c); register ML_Segment old = __ML_current_segment_c; __ML_current_segment_c = segment; __ML_MAP(c, segment); return old; }
+	inline ML_Segment __ML_LOAD_SEGMENT_D(ML_Segment segment) { __ML_INSTRUMENT(segment, 3); __ML_MAPPER_DECLARE(d); register ML_Segment old = __ML_current_segment_d; __ML_current_segment_d = segment; __ML_MAP(d, segment); return old; }
+
+	inline void __ML_RESTORE_A(ML_Segment segment) { __ML_INSTRUMENT(segment, 0); __ML_MAPPER_DECLARE(a); __ML_current_segment_a = segment; __ML_MAP(a, segment); }
+	inline void __ML_RESTORE_B(ML_Segment segment) { __ML_INSTRUMENT(segment, 1); __ML_MAPPER_DECLARE(b); __ML_current_segment_b = segment; __ML_MAP(b, segment); }
+	inline void __ML_RESTORE_C(ML_Segment segment) { __ML_INSTRUMENT(segment, 2); __ML_MAPPER_DECLARE(c); __ML_current_segment_c = segment; __ML_MAP(c, segment); }
+	inline void __ML_RESTORE_D(ML_Segment segment) { __ML_INSTRUMENT(segment, 3); __ML_MAPPER_DECLARE(d); __ML_current_segment_d = segment; __ML_MAP(d, segment); }
+
+	// The address of the page is resolved by the linker, which rejects stream chunks loaded in a pinned page.
+	inline const uint8_t *__ML_LOAD_STREAM_CHUNK_A(const ML_Stream *stream, uint8_t i) { extern const uint8_t __ML_CONFIG_STREAM_PAGE_A[]; __ML_LOAD_SEGMENT_A(stream->chunk[i].segment); return __ML_CONFIG_STREAM_PAGE_A + stream->chunk[i].offset; }
+	inline const uint8_t *__ML_LOAD_STREAM_CHUNK_B(const ML_Stream *stream, uint8_t i) { extern const uint8_t __ML_CONFIG_STREAM_PAGE_B[]; __ML_LOAD_SEGMENT_B(stream->chunk[i].segment); return __ML_CONFIG_STREAM_PAGE_B + stream->chunk[i].offset; }
+	inline const uint8_t *__ML_LOAD_STREAM_CHUNK_C(const ML_Stream *stream, uint8_t i) { extern const uint8_t __ML_CONFIG_STREAM_PAGE_C[]; __ML_LOAD_SEGMENT_C(stream->chunk[i].segment); return __ML_CONFIG_STREAM_PAGE_C + stream->chunk[i].offset; }
+	inline const uint8_t *__ML_LOAD_STREAM_CHUNK_D(const ML_Stream *stream, uint8_t i) { extern const uint8_t __ML_CONFIG_STREAM_PAGE_D[]; __ML_LOAD_SEGMENT_D(stream->chunk[i].segment); return __ML_CONFIG_STREAM_PAGE_D + stream->chunk[i].offset; }
+
+	__sfr __at 0xFE __ML_ram_port;
+	inline uint8_t __ML_LOAD_RAM_SEGMENT(uint8_t segment) { extern volatile uint8_t __ML_current_ram_segment; register uint8_t old = __ML_current_ram_segment; __ML_ram_port = __ML_current_ram_segment = segment; return old; }
+	void __ML_ram_window_on(void);
+	void __ML_ram_window_off(void);
+
+	void __ML_far_call(const ML_FarPointer *far_pointer) __z88dk_fastcall;
+	void __ML_far_call_16(const ML_FarPointer *far_pointer) __z88dk_fastcall;
+
+	// The runtimes return in hl and dehl, as sdcccall(0) does. SDCC 4.1.12 made sdcccall(1) the default, which returns
+	// 16 bit values in de and 32 bit values in hlde, thus their declarations keep sdcccall(0).
+	#if defined(__SDCC_VERSION_MAJOR) && (__SDCC_VERSION_MAJOR * 10000 + __SDCC_VERSION_MINOR * 100 + __SDCC_VERSION_PATCH) >= 40112
+		#define __ML_SDCCCALL0 __sdcccall(0)
+	#else
+		#define __ML_SDCCCALL0
+	#endif
+
+	uint8_t *__ML_unpack(uint32_t src_dst) __z88dk_fastcall __ML_SDCCCALL0;
+	uint8_t *__ML_unpack_16(uint32_t src_dst) __z88dk_fastcall __ML_SDCCCALL0;
+
+	uint32_t __ML_load_set(const uint8_t *set) __z88dk_fastcall __ML_SDCCCALL0;
+	void __ML_restore_set(uint32_t segments) __z88dk_fastcall __ML_SDCCCALL0;
 
 #endif
@@ -0,0 +1,326 @@
+    .module megalinker_disk
+
+; Loader of the segments of a disk overlay (megalinker -d) into the RAM of pages A to D.
+; A segment that is already in its page is not loaded again. Loaded segments are kept in the cache slots,
+; two per segment of the memory mapper allocated from MSX-DOS 2, and copied from there until they are replaced.
+; Other segments are read from the overlay file through its table, and replace the oldest cached segment.
+; It is only linked by disk overlays. Requires MSX-DOS 2.
+;------------------------------------------------
+
+.globl  ___ML_CONFIG_DISK_CACHE_SLOTS
+.globl  ___ML_disk_tags
+.globl  ___ML_disk_segments
+
+;--------------------------------------------------------
+; MSX-DOS 2 FUNCTION CALLS
+;--------------------------------------------------------
+BDOS = 0x0005
+_OPEN = 0x43
+_READ = 0x48
+_SEEK = 0x4A
+_TERM = 0x62
+
+; Error code of MSX-DOS 2: not enough memory
+_NORAM = 0xDE
+
+;--------------------------------------------------------
+; MSX-DOS 2 MAPPER SUPPORT
+;--------------------------------------------------------
+EXTBIO = 0xFFCA
+
+;--------------------------------------------------------
+; DATA
+;--------------------------------------------------------
+
+    .area   _DATA
+__ML_disk_handle:
+    .ds 1
+__ML_disk_next:
+    .ds 1
+; Segment in the RAM of pages A, B, C and D.
+__ML_disk_resident:
+    .ds 4
+; Table entry of the segment being read: offset (32 bit) and used bytes (16 bit).
+__ML_disk_entry:
+    .ds 6
+; Mapper segment of page 0 in the TPA, and number of cache segments allocated.
+__ML_disk_tpa_p0:
+    .ds 1
+__ML_disk_allocated:
+    .ds 1
+; Entries of the mapper support routines (jp instructions), copied from the table of MSX-DOS 2.
+__ML_disk_all_seg:
+    .ds 3
+__ML_disk_fre_seg:
+    .ds 3
+__ML_disk_put_p0:
+    .ds 3
+__ML_disk_get_p0:
+    .ds 3
+
+;--------------------------------------------------------
+; HOME
+;--------------------------------------------------------
+
+    .area   _HOME
+
+; Called by the crt at boot.
+;   de: name of the overlay file. Allocates the segments of the cache, opens the file, and empties the cache.
+;   The program ends if there are not enough free segments, or if the file can not be opened.
+___ML_disk_open::
+    push de
+
+;   copies the entries of ALL_SEG, FRE_SEG, PUT_P0 and GET_P0
+    xor a
+    ld  (__ML_disk_allocated),a
+    ld  de,#0x0402
+    call EXTBIO
+    ld  de,#__ML_disk_all_seg
+    ld  bc,#6
+    ldir
+    ld  bc,#0x12
+    add hl,bc
+    ld  bc,#6
+    ldir
+    call __ML_disk_get_p0
+    ld  (__ML_disk_tpa_p0),a
+
+;   allocates a user segment of the primary mapper for every two slots
+    ld  a,#___ML_CONFIG_DISK_CACHE_SLOTS
+    inc a
+    srl a
+    ld  b,a
+    ld  hl,#___ML_disk_segments
+1$:
+    push bc
+    push hl
+    xor a
+    ld  b,a
+    call __ML_disk_all_seg
+    pop hl
+    pop bc
+    ld  (hl),a
+    ld  a,#_NORAM
+    jp  c,__ML_disk_term
+    inc hl
+    ld  a,(__ML_disk_allocated)
+    inc a
+    ld  (__ML_disk_allocated),a
+    djnz 1$
+
+    pop de
+    ld  a,#1
+    ld  c,#_OPEN
+    call __ML_disk_bdos
+    ld  a,b
+    ld  (__ML_disk_handle),a
+    xor a
+    ld  (__ML_disk_next),a
+    ld  hl,#__ML_disk_resident
+    ld  (hl),a
+    inc hl
+    inc a
+    ld  (hl),a
+    inc hl
+    inc a
+    ld  (hl),a
+    inc hl
+    inc a
+    ld  (hl),a
+    ld  hl,#___ML_disk_tags
+    ld  de,#___ML_disk_tags+1
+    ld  bc,#___ML_CONFIG_DISK_CACHE_SLOTS-1
+    ld  (hl),#0xFF
+    ldir
+    ret
+
+; Called by the crt before returning to MSX-DOS, and on errors. Frees the segments of the cache.
+___ML_disk_close::
+    ld  hl,#__ML_disk_allocated
+    ld  a,(hl)
+    ld  (hl),#0
+    or  a
+    ret z
+    ld  b,a
+    ld  hl,#___ML_disk_segments
+1$:
+    push bc
+    push hl
+    ld  a,(hl)
+    ld  b,#0
+    call __ML_disk_fre_seg
+    pop hl
+    pop bc
+    inc hl
+    djnz 1$
+    ret
+
+; void __ML_disk_map_x(uint8_t segment) __z88dk_fastcall
+;   l: segment. Brings the segment into the RAM of page x, from the cache or from the overlay file.
+;   The interrupt state is preserved.
+___ML_disk_map_a::
+    ld  h,#0
+    jr  __ML_disk_map
+___ML_disk_map_b::
+    ld  h,#1
+    jr  __ML_disk_map
+___ML_disk_map_c::
+    ld  h,#2
+    jr  __ML_disk_map
+___ML_disk_map_d::
+    ld  h,#3
+
+;   l: segment, h: page
+__ML_disk_map:
+    ld  c,h
+    ld  b,#0
+    ld  a,l
+    ld  hl,#__ML_disk_resident
+    add hl,bc
+    cp  (hl)
+    ret z
+    ld  (hl),a
+    ld  b,a
+    ld  a,c
+    rrca
+    rrca
+    rrca
+    add a,#0x40
+    ld  d,a
+    ld  e,#0
+    ld  a,b
+    ld  hl,#___ML_disk_tags
+    ld  bc,#___ML_CONFIG_DISK_CACHE_SLOTS
+    cpir
+    jr  nz,1$
+
+;   Cached: copies its slot to the page.
+    ld  bc,#___ML_disk_tags+1
+    or  a
+    sbc hl,bc
+    ld  a,i
+    push af
+    di
+    ld  a,l
+    call __ML_disk_window
+    ld  bc,#0x2000
+    ldir
+    jr  __ML_disk_done
+
+;   Not cached: reads it into the page, and copies the page to the oldest slot.
+1$:
+    push de
+    push af
+    call __ML_disk_read
+    ld  a,(__ML_disk_next)
+    ld  c,a
+    inc a
+    cp  #___ML_CONFIG_DISK_CACHE_SLOTS
+    jr  c,2$
+    xor a
+2$:
+    ld  (__ML_disk_next),a
+    ld  b,#0
+    ld  hl,#___ML_disk_tags
+    add hl,bc
+    pop af
+    ld  (hl),a
+    pop hl
+    ld  a,i
+    push af
+    di
+    ld  a,c
+    push hl
+    call __ML_disk_window
+    ex  de,hl
+    pop hl
+    ld  bc,#0x2000
+    ldir
+
+__ML_disk_done:
+    ld  a,(__ML_disk_tpa_p0)
+    call __ML_disk_put_p0
+    pop af
+    ret po
+    ei
+    ret
+
+;   a: slot. Maps the mapper segment of the slot in page 0, and returns in hl the address of the slot. Preserves de.
+;   Interrupts must be disabled, as page 0 holds the interrupt handler.
+__ML_disk_window:
+    ld  l,#0
+    srl a
+    rr  l
+    srl l
+    srl l
+    push hl
+    ld  hl,#___ML_disk_segments
+    add a,l
+    ld  l,a
+    adc a,h
+    sub l
+    ld  h,a
+    ld  a,(hl)
+    call __ML_disk_put_p0
+    pop hl
+    ld  h,l
+    ld  l,#0
+    ret
+
+;   a: segment, de: RAM of the page. Reads the entry of the segment in the table, and then its used bytes.
+__ML_disk_read:
+    push de
+    ld  l,a
+    ld  h,#0
+    add hl,hl
+    ld  b,h
+    ld  c,l
+    add hl,hl
+    add hl,bc
+    ld  bc,#8
+    add hl,bc
+    ld  de,#0
+    call __ML_disk_seek
+    ld  de,#__ML_disk_entry
+    ld  hl,#6
+    call __ML_disk_read_bytes
+    ld  hl,(__ML_disk_entry)
+    ld  de,(__ML_disk_entry+2)
+    call __ML_disk_seek
+    pop de
+    ld  hl,(__ML_disk_entry+4)
+    ld  a,h
+    or  l
+    ret z
+
+;   de: buffer, hl: bytes.
+__ML_disk_read_bytes:
+    ld  a,(__ML_disk_handle)
+    ld  b,a
+    ld  c,#_READ
+    jr  __ML_disk_bdos
+
+;   dehl: offset from the start of the file.
+__ML_disk_seek:
+    ld  a,(__ML_disk_handle)
+    ld  b,a
+    xor a
+    ld  c,#_SEEK
+
+;   Calls MSX-DOS, and ends the program on errors.
+__ML_disk_bdos:
+    push ix
+    push iy
+    call BDOS
+    pop iy
+    pop ix
+    or  a
+    ret z
+
+;   a: error code. Frees the cache, and ends the program.
+__ML_disk_term:
+    push af
+    call ___ML_disk_close
+    pop bc
+    ld  c,#_TERM
+    jp  BDOS
@@ -0,0 +1,73 @@
+    .module megalinker_far
+
+; Dispatcher for the far pointers generated by the megalinker.
+; It is only linked if a far pointer is called.
+;------------------------------------------------
+
+.globl  ___ML_current_segment_a
+.globl  ___ML_address_a
+.globl  ___ML_address_b
+.globl  ___ML_address_c
+.globl  ___ML_address_d
+.globl  ___sdcc_call_hl
+
+;--------------------------------------------------------
+; HOME
+;--------------------------------------------------------
+
+    .area   _HOME
+
+; void __ML_far_call(const ML_FarPointer *far_pointer) __z88dk_fastcall
+;   hl: far pointer entry (segment, page, address)
+;   Maps the segment in its page, calls the function, and restores the page.
+;   a, de and hl are preserved from the function, thus its return value under sdcccall(0) and sdcccall(1).
+;   Requires the ___ML_current_segment_x variables to be consecutive in memory.
+___ML_far_call::
+    ld  a,(hl)
+    inc hl
+    ld  c,(hl)
+    inc hl
+    ld  e,(hl)
+    inc hl
+    ld  d,(hl)
+    ld  b,#0
+    ld  hl,#___ML_current_segment_a
+    add hl,bc
+    ld  b,(hl)
+    push bc
+    call __ML_far_map
+    ex  de,hl
+    call ___sdcc_call_hl
+    ex  (sp),hl
+    push de
+    push af
+    ld  a,h
+    ld  c,l
+    call __ML_far_map
+    pop af
+    pop de
+    pop hl
+    ret
+
+;   a: segment, c: page. Preserves de.
+__ML_far_map:
+    ld  b,#0
+    ld  hl,#___ML_current_segment_a
+    add hl,bc
+    ld  (hl),a
+    ld  hl,#__ML_far_mapper
+    add hl,bc
+    add hl,bc
+    push de
+    ld  e,(hl)
+    inc hl
+    ld  d,(hl)
+    ld  (de),a
+    pop de
+    ret
+
+__ML_far_mapper:
+    .dw ___ML_address_a
+    .dw ___ML_address_b
+    .dw ___ML_address_c
+    .dw ___ML_address_d
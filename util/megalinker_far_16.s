@@ -0,0 +1,96 @@
+    .module megalinker_far_16
+
+; Dispatcher for the far pointers generated by the megalinker, with 16 bit segment numbers (___ML_CONFIG_SEGMENT_BITS = 16).
+; It is only linked if a far pointer is called.
+;------------------------------------------------
+
+.globl  ___ML_current_segment_a
+.globl  ___ML_address_a
+.globl  ___ML_address_b
+.globl  ___ML_address_c
+.globl  ___ML_address_d
+.globl  ___ML_address_hi_a
+.globl  ___ML_address_hi_b
+.globl  ___ML_address_hi_c
+.globl  ___ML_address_hi_d
+.globl  ___sdcc_call_hl
+
+;--------------------------------------------------------
+; HOME
+;--------------------------------------------------------
+
+    .area   _HOME
+
+; void __ML_far_call_16(const ML_FarPointer *far_pointer) __z88dk_fastcall
+;   hl: far pointer entry (segment low, segment high, page, address)
+;   Maps the segment in its page, calls the function, and restores the page.
+;   a, de and hl are preserved from the function, thus its return value under sdcccall(0) and sdcccall(1).
+;   Requires the 16 bit ___ML_current_segment_x variables to be consecutive in memory.
+___ML_far_call_16::
+    ld  e,(hl)
+    inc hl
+    ld  d,(hl)
+    inc hl
+    ld  c,(hl)
+    inc hl
+    ld  a,(hl)
+    inc hl
+    ld  h,(hl)
+    ld  l,a
+    push hl
+    call __ML_far_map_16
+    pop hl
+    push bc
+    push de
+    call ___sdcc_call_hl
+    ex  (sp),hl
+    ex  de,hl
+    pop bc
+    ex  (sp),hl
+    push bc
+    ld  c,l
+    push af
+    call __ML_far_map_16
+    pop af
+    pop hl
+    pop de
+    ret
+
+;   de: segment, c: page. Returns the previous segment of the page in de. Preserves c.
+__ML_far_map_16:
+    ld  b,#0
+    ld  hl,#__ML_far_mapper_16
+    add hl,bc
+    add hl,bc
+    add hl,bc
+    add hl,bc
+    ld  a,(hl)
+    inc hl
+    push hl
+    ld  h,(hl)
+    ld  l,a
+    ld  (hl),e
+    pop hl
+    inc hl
+    ld  a,(hl)
+    inc hl
+    ld  h,(hl)
+    ld  l,a
+    ld  (hl),d
+    ld  hl,#___ML_current_segment_a
+    add hl,bc
+    add hl,bc
+    ld  a,(hl)
+    ld  (hl),e
+    ld  e,a
+    inc hl
+    ld  a,(hl)
+    ld  (hl),d
+    ld  d,a
+    ret
+
+__ML_far_mapper_16:
+    .dw ___ML_address_a, ___ML_address_hi_a
+    .dw ___ML_address_b, ___ML_address_hi_b
+    .dw ___ML_address_c, ___ML_address_hi_c
+    .dw ___ML_address_d, ___ML_address_hi_d
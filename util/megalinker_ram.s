@@ -0,0 +1,106 @@
+    .module megalinker_ram
+
+; Window to the banked RAM (_XDATA_BANKED) allocated by the megalinker in the MSX2 memory mapper.
+; While the window is enabled, page 2 (0x8000 - 0xbfff) holds the RAM segment selected through port 0xFE,
+; instead of the pages C and D of the ROM.
+; It is only linked if the banked RAM is used.
+;------------------------------------------------
+
+.globl  ___ML_current_ram_segment
+
+;--------------------------------------------------------
+; MSX BIOS CALLS
+;--------------------------------------------------------
+ENASLT = 0x0024
+RSLREG = 0x0138
+
+;--------------------------------------------------------
+; MSX BIOS WORK AREA
+;--------------------------------------------------------
+EXPTBL = 0xFCC1
+
+;--------------------------------------------------------
+; DATA
+;--------------------------------------------------------
+
+    .area   _INITIALIZED
+___ML_current_ram_segment::
+    .ds 1
+
+    .area   _INITIALIZER
+    .db 1
+
+;--------------------------------------------------------
+; HOME
+;--------------------------------------------------------
+
+    .area   _HOME
+
+; void __ML_ram_window_on(void)
+;   Maps the RAM slot (the slot of page 3) in page 2, and selects the current RAM segment.
+;   The interrupt state is preserved.
+___ML_ram_window_on::
+    ld  a,i
+    push af
+    ld  c,#3
+    call __ML_slot_of_page
+    ld  h,#0x80
+    call ENASLT
+    ld  a,(___ML_current_ram_segment)
+    out (0xFE),a
+    jr  __ML_ram_window_done
+
+; void __ML_ram_window_off(void)
+;   Maps back the ROM slot (the slot of page 1) in page 2.
+;   The interrupt state is preserved.
+___ML_ram_window_off::
+    ld  a,i
+    push af
+    ld  c,#1
+    call __ML_slot_of_page
+    ld  h,#0x80
+    call ENASLT
+__ML_ram_window_done:
+    pop af
+    ret po
+    ei
+    ret
+
+;   c: page. Returns in a the slot of that page, in the format of ENASLT.
+__ML_slot_of_page:
+    call RSLREG
+    ld  b,c
+    inc b
+    jr  2$
+1$:
+    rrca
+    rrca
+2$:
+    djnz 1$
+    and #0x03
+    ld  e,a
+    ld  hl,#EXPTBL
+    add a,l
+    ld  l,a
+    ld  a,(hl)
+    and #0x80
+    or  e
+    ld  e,a
+    inc l
+    inc l
+    inc l
+    inc l
+    ld  a,(hl)
+    ld  b,c
+    inc b
+    jr  4$
+3$:
+    rrca
+    rrca
+4$:
+    djnz 3$
+    and #0x03
+    rlca
+    rlca
+    or  e
+    ret
@@ -0,0 +1,98 @@
+    .module megalinker_set
+
+; Loads and restores the segment sets generated by the megalinker.
+; It is only linked if a segment set is used.
+;------------------------------------------------
+
+.globl  ___ML_current_segment_a
+.globl  ___ML_current_segment_b
+.globl  ___ML_current_segment_c
+.globl  ___ML_current_segment_d
+.globl  ___ML_address_a
+.globl  ___ML_address_b
+.globl  ___ML_address_c
+.globl  ___ML_address_d
+
+;--------------------------------------------------------
+; HOME
+;--------------------------------------------------------
+
+    .area   _HOME
+
+; uint32_t __ML_load_set(const uint8_t *set) __z88dk_fastcall
+;   hl: set table (mask of pages, segment of page a, b, c and d)
+;   Maps the pages of the set, and returns the previous segments in dehl (l: a, h: b, e: c, d: d).
+;   dehl is the 32 bit return register of sdcccall(0), which megalinker.h sets in the declaration.
+;   Requires the ___ML_current_segment_x variables to be consecutive in memory.
+___ML_load_set::
+    ld  c,(hl)
+    inc hl
+    ex  de,hl
+    ld  hl,(___ML_current_segment_a)
+    push hl
+    ld  hl,(___ML_current_segment_c)
+    push hl
+    ex  de,hl
+
+    ld  a,(hl)
+    inc hl
+    rrc c
+    jr  nc,1$
+    ld  (___ML_current_segment_a),a
+    ld  (___ML_address_a),a
+1$:
+    ld  a,(hl)
+    inc hl
+    rrc c
+    jr  nc,2$
+    ld  (___ML_current_segment_b),a
+    ld  (___ML_address_b),a
+2$:
+    ld  a,(hl)
+    inc hl
+    rrc c
+    jr  nc,3$
+    ld  (___ML_current_segment_c),a
+    ld  (___ML_address_c),a
+3$:
+    ld  a,(hl)
+    rrc c
+    jr  nc,4$
+    ld  (___ML_current_segment_d),a
+    ld  (___ML_address_d),a
+4$:
+    pop de
+    pop hl
+    ret
+
+; void __ML_restore_set(uint32_t segments) __z88dk_fastcall
+;   dehl: segments returned by __ML_load_set. Only the pages that changed are written.
+___ML_restore_set::
+    ld  a,(___ML_current_segment_a)
+    cp  l
+    jr  z,1$
+    ld  a,l
+    ld  (___ML_current_segment_a),a
+    ld  (___ML_address_a),a
+1$:
+    ld  a,(___ML_current_segment_b)
+    cp  h
+    jr  z,2$
+    ld  a,h
+    ld  (___ML_current_segment_b),a
+    ld  (___ML_address_b),a
+2$:
+    ld  a,(___ML_current_segment_c)
+    cp  e
+    jr  z,3$
+    ld  a,e
+    ld  (___ML_current_segment_c),a
+    ld  (___ML_address_c),a
+3$:
+    ld  a,(___ML_current_segment_d)
+    cp  d
+    ret z
+    ld  a,d
+    ld  (___ML_current_segment_d),a
+    ld  (___ML_address_d),a
+    ret
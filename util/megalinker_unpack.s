@@ -0,0 +1,86 @@
+    .module megalinker_unpack
+
+; Decompressor for the assets compressed by the megalinker (compress option).
+; It is only linked if a compressed asset is unpacked.
+;------------------------------------------------
+
+.globl  ___ML_current_segment_a
+.globl  ___ML_address_a
+.globl  ___ML_address_b
+.globl  ___ML_address_c
+.globl  ___ML_address_d
+
+;--------------------------------------------------------
+; HOME
+;--------------------------------------------------------
+
+    .area   _HOME
+
+; uint8_t *__ML_unpack(uint32_t src_dst) __z88dk_fastcall
+;   hl: packed data, already mapped. de: destination in RAM.
+;   Tokens: 0x00 end, 0x01-0x7F literal run, 0x80 next segment, 0x81-0xFF match of (token & 0x7F) + 2 bytes at a 16 bit distance.
+;   On 0x80, the next segment is mapped in the page of the packed data, and unpacking goes on from the start of that page.
+;   Returns the end of the unpacked data.
+;   Requires the ___ML_current_segment_x variables to be consecutive in memory.
+___ML_unpack::
+    ld  a,(hl)
+    inc hl
+    or  a
+    jr  z,3$
+    jp  m,1$
+    ld  c,a
+    ld  b,#0
+    ldir
+    jr  ___ML_unpack
+1$:
+    and #0x7F
+    jr  z,2$
+    add a,#2
+    ld  c,(hl)
+    inc hl
+    ld  b,(hl)
+    inc hl
+    push hl
+    ld  h,d
+    ld  l,e
+    sbc hl,bc
+    ld  c,a
+    ld  b,#0
+    ldir
+    pop hl
+    jr  ___ML_unpack
+2$:
+    dec hl
+    ld  a,h
+    and #0xE0
+    ld  h,a
+    ld  l,#0
+    rlca
+    rlca
+    rlca
+    sub #2
+    push hl
+    ld  c,a
+    ld  b,#0
+    ld  hl,#___ML_current_segment_a
+    add hl,bc
+    inc (hl)
+    ld  a,(hl)
+    ld  hl,#__ML_unpack_mapper
+    add hl,bc
+    add hl,bc
+    ld  c,(hl)
+    inc hl
+    ld  b,(hl)
+    ld  (bc),a
+    pop hl
+    jr  ___ML_unpack
+3$:
+    ex  de,hl
+    ret
+
+__ML_unpack_mapper:
+    .dw ___ML_address_a
+    .dw ___ML_address_b
+    .dw ___ML_address_c
+    .dw ___ML_address_d
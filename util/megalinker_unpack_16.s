@@ -0,0 +1,106 @@
+    .module megalinker_unpack_16
+
+; Decompressor for the assets compressed by the megalinker (compress option), with 16 bit segment numbers (___ML_CONFIG_SEGMENT_BITS = 16).
+; It is only linked if a compressed asset is unpacked.
+;------------------------------------------------
+
+.globl  ___ML_current_segment_a
+.globl  ___ML_address_a
+.globl  ___ML_address_b
+.globl  ___ML_address_c
+.globl  ___ML_address_d
+.globl  ___ML_address_hi_a
+.globl  ___ML_address_hi_b
+.globl  ___ML_address_hi_c
+.globl  ___ML_address_hi_d
+
+;--------------------------------------------------------
+; HOME
+;--------------------------------------------------------
+
+    .area   _HOME
+
+; uint8_t *__ML_unpack_16(uint32_t src_dst) __z88dk_fastcall
+;   Same as __ML_unpack, but the next segment mapped on token 0x80 is a 16 bit number.
+;   Requires the 16 bit ___ML_current_segment_x variables to be consecutive in memory.
+___ML_unpack_16::
+    ld  a,(hl)
+    inc hl
+    or  a
+    jr  z,3$
+    jp  m,1$
+    ld  c,a
+    ld  b,#0
+    ldir
+    jr  ___ML_unpack_16
+1$:
+    and #0x7F
+    jr  z,2$
+    add a,#2
+    ld  c,(hl)
+    inc hl
+    ld  b,(hl)
+    inc hl
+    push hl
+    ld  h,d
+    ld  l,e
+    sbc hl,bc
+    ld  c,a
+    ld  b,#0
+    ldir
+    pop hl
+    jr  ___ML_unpack_16
+2$:
+    dec hl
+    ld  a,h
+    and #0xE0
+    ld  h,a
+    ld  l,#0
+    rlca
+    rlca
+    rlca
+    sub #2
+    push hl
+    push de
+    ld  c,a
+    ld  b,#0
+    ld  hl,#___ML_current_segment_a
+    add hl,bc
+    add hl,bc
+    ld  e,(hl)
+    inc hl
+    ld  d,(hl)
+    inc de
+    ld  (hl),d
+    dec hl
+    ld  (hl),e
+    ld  hl,#__ML_unpack_mapper_16
+    add hl,bc
+    add hl,bc
+    add hl,bc
+    add hl,bc
+    ld  a,(hl)
+    inc hl
+    push hl
+    ld  h,(hl)
+    ld  l,a
+    ld  (hl),e
+    pop hl
+    inc hl
+    ld  a,(hl)
+    inc hl
+    ld  h,(hl)
+    ld  l,a
+    ld  (hl),d
+    pop de
+    pop hl
+    jr  ___ML_unpack_16
+3$:
+    ex  de,hl
+    ret
+
+__ML_unpack_mapper_16:
+    .dw ___ML_address_a, ___ML_address_hi_a
+    .dw ___ML_address_b, ___ML_address_hi_b
+    .dw ___ML_address_c, ___ML_address_hi_c
+    .dw ___ML_address_d, ___ML_address_hi_d